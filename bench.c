@@ -0,0 +1,681 @@
+/**
+ * @file bench.c
+ * @author Cody Ray <rayc2@oregonstate.edu>
+ * @version 1.0
+ * @section DESCRIPTION
+ *
+ * Benchmarks for smallsh
+ *
+ * Linked against smallsh.c built with SMALLSH_NO_MAIN. Run with "make bench".
+ * Every result is printed to stdout as one JSON object per line, so runs can be
+ * saved (make bench > run.jsonl) and compared over time.
+ */
+
+#define _GNU_SOURCE // For the CPU sets in smallsh.h
+
+#include <signal.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <poll.h>
+#include <termios.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/utsname.h>
+
+#include "smallsh.h"
+
+#define LEGACY_MAX_INPUT_LEN 2048          // Limits of the strtok parser
+#define LEGACY_MAX_ARGS 512
+#define LEGACY_MAX_FILENAME_LEN 256
+#define LEGACY_TOKEN_DELIMITER " \r\a\n\t"
+
+#define PARSE_BYTES_PER_CASE (64 << 20) // Parse roughly this many bytes of each line
+#define EXPAND_ITERS 2000000            // Tokens expanded by the expand_pid case
+#define LAUNCH_ITERS 2000               // Commands launched and waited for per launch case
+#define BG_JOBS 1000                    // Background jobs started per background case
+#define CAT_ITERS 20                    // Copies made per cat case
+#define ARENA_LINES 1000000             // Lines parsed and reset by the arena case
+#define ARENA_WARMUP 1000               // Lines parsed before the arena case takes its first sample
+
+extern enum launch_mode launch_mode; // Selected with -m in the shell
+
+// Where results go; the shell's own output during the process cases is sent to /dev/null
+static FILE *results;
+
+// The signalfd SIGCHLD arrives on, set up once by bg_init()
+static int bg_sigfd = -1;
+
+/**
+ * Command as filled by the strtok parser
+ */
+struct legacy_command
+{
+    char **args;
+    int nargs;
+    char *inFile;
+    char *outFile;
+    bool run_in_bg;
+};
+
+/**
+ * The strtok-based parse_command() that the single-pass lexer replaced
+ *
+ * Kept as it was, except that it frees what it allocates so it can be run in a loop.
+ */
+static void legacy_parse(char *cmd_str, struct legacy_command *cmd)
+{
+    char **tokens = malloc(sizeof(char *) * LEGACY_MAX_INPUT_LEN + 1);
+    char *expanded[LEGACY_MAX_ARGS];
+    int nexpanded = 0;
+
+    char *token = strtok(cmd_str, LEGACY_TOKEN_DELIMITER);
+    char *pid_str = malloc(sizeof(char) * MAX_PID_LEN + 1);
+    sprintf(pid_str, "%d", getpid());
+
+    while (token != NULL)
+    {
+        if (strmatch(token, "<"))
+        {
+            token = strtok(NULL, LEGACY_TOKEN_DELIMITER);
+            (*cmd).inFile = malloc(sizeof(char) * LEGACY_MAX_FILENAME_LEN + 1);
+            strcpy((*cmd).inFile, token);
+        }
+        else if (strmatch(token, ">"))
+        {
+            token = strtok(NULL, LEGACY_TOKEN_DELIMITER);
+            (*cmd).outFile = malloc(sizeof(char) * LEGACY_MAX_FILENAME_LEN + 1);
+            strcpy((*cmd).outFile, token);
+        }
+        else
+        {
+            if (strstr(token, "$$") != NULL)
+            {
+                size_t len = strlen(token);
+                tokens[(*cmd).nargs] = malloc(len + (len / 2 + 1) * strlen(pid_str) + 1);
+                expand_pid(tokens[(*cmd).nargs], token, pid_str);
+                expanded[nexpanded++] = tokens[(*cmd).nargs];
+            }
+            else
+                tokens[(*cmd).nargs] = token;
+            (*cmd).nargs++;
+        }
+        token = strtok(NULL, LEGACY_TOKEN_DELIMITER);
+    }
+    free(pid_str);
+
+    if ((*cmd).nargs > 1 && strmatch(tokens[(*cmd).nargs - 1], "&"))
+    {
+        (*cmd).run_in_bg = true;
+        (*cmd).nargs--;
+        tokens[(*cmd).nargs] = NULL;
+    }
+    (*cmd).args = tokens;
+
+    // Release everything, the original leaked it
+    for (int i = 0; i < nexpanded; i++)
+        free(expanded[i]);
+    free(tokens);
+    free((*cmd).inFile);
+    free((*cmd).outFile);
+}
+
+/**
+ * Seconds on the monotonic clock
+ */
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Build a command line of nargs arguments, every fourth one containing "$$"
+ */
+static char *synthetic_line(int nargs)
+{
+    char *line = malloc((size_t)nargs * 16 + 32);
+    char *pos = line + sprintf(line, "cmd");
+    for (int i = 1; i < nargs; i++)
+        pos += sprintf(pos, i % 4 == 0 ? " arg%d.$$" : " argument%d", i);
+    sprintf(pos, " < in > out &\n");
+    return line;
+}
+
+/**
+ * qsort comparator for doubles
+ */
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Print the mean, p50, p99 and max of n latency samples (in seconds) as microseconds
+ */
+static void print_latencies(double *samples, int n)
+{
+    double sum = 0;
+    for (int i = 0; i < n; i++)
+        sum += samples[i];
+    qsort(samples, n, sizeof(double), cmp_double);
+    fprintf(results, "\"mean_us\":%.2f,\"p50_us\":%.2f,\"p99_us\":%.2f,\"max_us\":%.2f", sum / n * 1e6,
+            samples[n / 2] * 1e6, samples[(int)(n * 0.99)] * 1e6, samples[n - 1] * 1e6);
+}
+
+/**
+ * Time the old and new parsers on the same line and print lines/s and MB/s for each
+ *
+ * @param name label for the case
+ * @param line the command line to parse
+ * @param legacyOk whether the line fits the strtok parser's fixed buffers
+ */
+static void bench_parse_case(const char *name, const char *line, bool legacyOk)
+{
+    size_t len = strlen(line);
+    long iters = PARSE_BYTES_PER_CASE / len + 1;
+    char *buf = malloc(len + 1);
+
+    // Both parsers split the line in place, so each run gets a fresh copy
+    double legacyTime = 0;
+    if (legacyOk)
+    {
+        double start = now();
+        for (long i = 0; i < iters; i++)
+        {
+            struct legacy_command cmd = {0};
+            memcpy(buf, line, len + 1);
+            legacy_parse(buf, &cmd);
+        }
+        legacyTime = now() - start;
+    }
+
+    struct pipeline pl = {0};
+    double start = now();
+    for (long i = 0; i < iters; i++)
+    {
+        memcpy(buf, line, len + 1);
+        reset_pipeline(&pl);
+        parse_command(buf, &pl);
+    }
+    double lexTime = now() - start;
+
+    fprintf(results, "{\"bench\":\"parse\",\"case\":\"%s\",\"bytes\":%zu,\"iters\":%ld,"
+                     "\"lines_per_s\":%.0f,\"mb_per_s\":%.1f",
+            name, len, iters, iters / lexTime, iters * len / lexTime / 1e6);
+    if (legacyOk)
+        fprintf(results, ",\"strtok_lines_per_s\":%.0f,\"strtok_mb_per_s\":%.1f,\"speedup\":%.2f",
+                iters / legacyTime, iters * len / legacyTime / 1e6, legacyTime / lexTime);
+    fprintf(results, "}\n");
+
+    free(buf);
+}
+
+/**
+ * Resident memory in KiB not backed by a file, from /proc/self/statm
+ *
+ * File pages (the program's own code, libc) are faulted in 64 KiB at a time whenever a
+ * new stretch of code first runs, which says nothing about what the shell allocates.
+ */
+static long rss_kib(void)
+{
+    long size = 0, resident = 0, shared = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (f == NULL)
+        return 0;
+    if (fscanf(f, "%ld %ld %ld", &size, &resident, &shared) != 3)
+        resident = shared = 0;
+    fclose(f);
+    return (resident - shared) * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+/**
+ * Parse and reset ARENA_LINES lines of varying length, checking that memory stays flat
+ *
+ * Resetting the pipeline rewinds its arena rather than freeing it, so once the longest
+ * line has been seen, nothing more should be allocated. RSS and ru_maxrss are sampled
+ * after a warm-up and again at the end.
+ *
+ * @return false if RSS grew
+ */
+static bool bench_arena_case(void)
+{
+    char *lines[] = {synthetic_line(4), synthetic_line(128), strdup("cat < in | sort | uniq -c > out &\n"),
+                     synthetic_line(16)};
+    int nlines = sizeof(lines) / sizeof(lines[0]);
+    char *buf = malloc(strlen(lines[1]) + 1); // The longest
+    struct pipeline pl = {0};
+
+    struct rusage usage; // ru_maxrss counts file pages too, so it is reported but not checked
+    long startRss = 0, startMax = 0;
+    double start = 0;
+    for (long i = 0; i < ARENA_LINES + ARENA_WARMUP; i++)
+    {
+        if (i == ARENA_WARMUP) // Every line has been seen, so the arena is as big as it gets
+        {
+            start = now(); // First, so the clock's code is already paged in when sampling
+            getrusage(RUSAGE_SELF, &usage);
+            startRss = rss_kib();
+            startMax = usage.ru_maxrss;
+        }
+        strcpy(buf, lines[i % nlines]);
+        reset_pipeline(&pl);
+        parse_command(buf, &pl);
+    }
+    double elapsed = now() - start;
+    getrusage(RUSAGE_SELF, &usage);
+    long endRss = rss_kib();
+    bool flat = endRss <= startRss;
+
+    fprintf(results, "{\"bench\":\"arena\",\"lines\":%d,\"lines_per_s\":%.0f,\"anon_rss_kib\":[%ld,%ld],"
+                     "\"maxrss_kib\":[%ld,%ld],\"flat\":%s}\n",
+            ARENA_LINES, ARENA_LINES / elapsed, startRss, endRss, startMax, usage.ru_maxrss, flat ? "true" : "false");
+
+    for (int i = 0; i < nlines; i++)
+        free(lines[i]);
+    free(buf);
+    arena_free(&pl.mem);
+    free(pl.cmds);
+    return flat;
+}
+
+/**
+ * Time expand_pid() on a token with n occurrences of "$$"
+ */
+static void bench_expand_case(int n)
+{
+    char *token = malloc(n * 8 + 1);
+    char *pos = token;
+    for (int i = 0; i < n; i++)
+        pos += sprintf(pos, "dir$$/..");
+    char pid[MAX_PID_LEN + 1];
+    sprintf(pid, "%d", getpid());
+    size_t len = strlen(token);
+    char *result = malloc(len + (len / 2 + 1) * strlen(pid) + 1);
+
+    long iters = EXPAND_ITERS / n;
+    double start = now();
+    for (long i = 0; i < iters; i++)
+        expand_pid(result, token, pid);
+    double elapsed = now() - start;
+
+    fprintf(results, "{\"bench\":\"expand_pid\",\"occurrences\":%d,\"bytes\":%zu,\"iters\":%ld,"
+                     "\"tokens_per_s\":%.0f,\"mb_per_s\":%.1f}\n",
+            n, len, iters, iters / elapsed, iters * len / elapsed / 1e6);
+    free(result);
+    free(token);
+}
+
+/**
+ * Parse a command line into pl, which keeps pointing into the returned buffer
+ */
+static char *parse_fixed(const char *line, struct pipeline *pl)
+{
+    char *buf = strdup(line);
+    reset_pipeline(pl);
+    parse_command(buf, pl);
+    return buf;
+}
+
+/**
+ * Time launching a command line in the foreground and waiting for it, LAUNCH_ITERS times
+ *
+ * @param name label for the case
+ * @param line the command line to run
+ * @param mode the launch strategy to use
+ */
+static void bench_launch_case(const char *name, const char *line, enum launch_mode mode)
+{
+    struct pipeline pl = {0};
+    char *buf = parse_fixed(line, &pl);
+    struct sigaction sa_SIGINT = {0};
+    sa_SIGINT.sa_handler = SIG_IGN;
+    struct background bg = {0};
+    int lastExit = 0;
+
+    launch_mode = mode;
+    double *samples = malloc(sizeof(double) * LAUNCH_ITERS);
+    for (int i = 0; i < LAUNCH_ITERS; i++)
+    {
+        double start = now();
+        exec_cmd(&pl, &lastExit, sa_SIGINT, &bg);
+        samples[i] = now() - start;
+    }
+
+    fprintf(results, "{\"bench\":\"launch\",\"case\":\"%s\",\"mode\":\"%s\",\"iters\":%d,", name,
+            mode == LAUNCH_SPAWN ? "spawn" : "fork", LAUNCH_ITERS);
+    print_latencies(samples, LAUNCH_ITERS);
+    fprintf(results, "}\n");
+
+    free(samples);
+    free(buf);
+    arena_free(&pl.mem);
+    free(pl.cmds);
+}
+
+/**
+ * Time starting BG_JOBS background jobs, then reaping them all through the signalfd census
+ *
+ * @param mode the launch strategy to use
+ */
+static void bench_background_case(enum launch_mode mode)
+{
+    struct pipeline pl = {0};
+    char *buf = parse_fixed("/bin/true &", &pl);
+    struct sigaction sa_SIGINT = {0};
+    sa_SIGINT.sa_handler = SIG_IGN;
+    struct background bg = {0};
+    bg.sigfd = bg_sigfd;
+    int lastExit = 0;
+
+    launch_mode = mode;
+    double start = now();
+    for (int i = 0; i < BG_JOBS; i++)
+        exec_cmd(&pl, &lastExit, sa_SIGINT, &bg);
+    double started = now();
+    struct pollfd pfd = {.fd = bg.sigfd, .events = POLLIN};
+    while (bg.size > 0)
+    {
+        poll(&pfd, 1, -1);
+        run_bg_census(&bg);
+    }
+    double reaped = now();
+
+    fprintf(results, "{\"bench\":\"background\",\"mode\":\"%s\",\"jobs\":%d,\"starts_per_s\":%.0f,"
+                     "\"reaps_per_s\":%.0f,\"total_s\":%.3f}\n",
+            mode == LAUNCH_SPAWN ? "spawn" : "fork", BG_JOBS, BG_JOBS / (started - start),
+            BG_JOBS / (reaped - started), reaped - start);
+
+    free(bg.pids);
+    free(bg.owner);
+    free(bg.index);
+    free(bg.jobs);
+    free(buf);
+    arena_free(&pl.mem);
+    free(pl.cmds);
+}
+
+/**
+ * Time opening a history of n entries (indexing it the first time, then just mapping
+ * it), a substring search over all of it and recalling entries by number and prefix
+ */
+static void bench_history_case(long n)
+{
+    char path[] = "/tmp/smallsh_bench_history.XXXXXX";
+    int fd = mkstemp(path);
+    FILE *f = fdopen(fd, "w");
+    fprintf(f, "make all\n");
+    for (long i = 1; i < n; i++)
+        fprintf(f, "cat < input%ld.log | grep -v healthcheck > out%ld.txt\n", i, i);
+    long bytes = ftell(f);
+    fclose(f);
+    char idxPath[sizeof(path) + 4];
+    sprintf(idxPath, "%s.idx", path);
+
+    var_set("SMALLSH_HISTORY", path, false);
+    history_close();
+    double start = now();
+    history_open();
+    double indexTime = now() - start;
+    history_close();
+    start = now();
+    history_open();
+    double openTime = now() - start;
+
+    char *search[] = {"history", "-s", "input4242.log", NULL};
+    start = now();
+    smallsh_history(search);
+    double searchTime = now() - start;
+
+    char *line;
+    start = now();
+    for (int i = 0; i < 1000; i++)
+        history_expand("!42", &line);
+    double numberTime = (now() - start) / 1000;
+    start = now();
+    history_expand("!make", &line); // Only the oldest entry matches, so every entry is compared
+    double prefixTime = now() - start;
+
+    fprintf(results, "{\"bench\":\"history\",\"entries\":%ld,\"bytes\":%ld,\"index_ms\":%.1f,\"open_us\":%.1f,"
+                     "\"search_ms\":%.1f,\"search_mb_per_s\":%.0f,\"recall_number_us\":%.2f,\"recall_prefix_ms\":%.1f}\n",
+            n, bytes, indexTime * 1e3, openTime * 1e6, searchTime * 1e3, bytes / searchTime / 1e6, numberTime * 1e6, prefixTime * 1e3);
+
+    history_close();
+    var_unset("SMALLSH_HISTORY");
+    unlink(path);
+    unlink(idxPath);
+}
+
+/**
+ * Time expanding a glob line in a directory of n files, against glob(3)
+ *
+ * Half the files end in ".log" and half in ".txt". Each line starts with an empty
+ * directory cache, as the shell does; a line with two patterns lists it once.
+ */
+static void bench_glob_case(long n)
+{
+    char dir[] = "/tmp/smallsh_bench_glob.XXXXXX";
+    mkdtemp(dir);
+    char cwd[4096];
+    getcwd(cwd, sizeof(cwd));
+    chdir(dir);
+    char name[32];
+    for (long i = 0; i < n; i++)
+    {
+        sprintf(name, "f%06ld.%s", i, i % 2 ? "txt" : "log");
+        close(open(name, O_WRONLY | O_CREAT, 0644));
+    }
+
+    const char *lines[] = {"echo *.log", "echo f0042*", "echo *.log *.txt"};
+    const char *patterns[] = {"*.log", "f0042*", "*.log"};
+    const int iters = 10;
+    struct pipeline pl = {0};
+    for (int c = 0; c < 3; c++)
+    {
+        double start = now();
+        int matches = 0;
+        for (int i = 0; i < iters; i++)
+            free(parse_fixed(lines[c], &pl)), matches = pl.cmds[0].nargs - 1;
+        double shellTime = (now() - start) / iters;
+
+        // glob(3) has no cache, so a second pattern costs a second listing
+        start = now();
+        for (int i = 0; i < iters; i++)
+        {
+            glob_t g;
+            glob(patterns[c], 0, NULL, &g);
+            if (c == 2)
+                glob("*.txt", GLOB_APPEND, NULL, &g);
+            globfree(&g);
+        }
+        double libcTime = (now() - start) / iters;
+
+        fprintf(results, "{\"bench\":\"glob\",\"entries\":%ld,\"line\":\"%s\",\"matches\":%d,"
+                         "\"ms\":%.2f,\"glob3_ms\":%.2f,\"speedup\":%.2f}\n",
+                n, lines[c], matches, shellTime * 1e3, libcTime * 1e3, libcTime / shellTime);
+    }
+    reset_pipeline(&pl);
+
+    for (long i = 0; i < n; i++)
+    {
+        sprintf(name, "f%06ld.%s", i, i % 2 ? "txt" : "log");
+        unlink(name);
+    }
+    chdir(cwd);
+    rmdir(dir);
+}
+
+/**
+ * Time copying a file of size bytes with the cat built-in and with the program
+ */
+static void bench_cat_case(long size)
+{
+    char src[] = "/tmp/smallsh_bench_cat.XXXXXX";
+    int fd = mkstemp(src);
+    char *block = malloc(1 << 20);
+    memset(block, 'x', 1 << 20);
+    for (long left = size; left > 0; left -= 1 << 20)
+        write(fd, block, left < (1 << 20) ? left : (1 << 20));
+    close(fd);
+    free(block);
+
+    struct sigaction sa_SIGINT = {0};
+    sa_SIGINT.sa_handler = SIG_IGN;
+    struct background bg = {0};
+    int lastExit = 0;
+    launch_mode = LAUNCH_SPAWN;
+    const char *progs[] = {"cat", "/bin/cat"}; // A path skips the built-in
+    double times[2];
+    for (int c = 0; c < 2; c++)
+    {
+        char line[128];
+        snprintf(line, sizeof(line), "%s %s > %s.out", progs[c], src, src);
+        struct pipeline pl = {0};
+        char *buf = parse_fixed(line, &pl);
+        double start = now();
+        for (int i = 0; i < CAT_ITERS; i++)
+            exec_cmd(&pl, &lastExit, sa_SIGINT, &bg);
+        times[c] = (now() - start) / CAT_ITERS;
+        free(buf);
+        arena_free(&pl.mem);
+        free(pl.cmds);
+    }
+
+    fprintf(results, "{\"bench\":\"cat\",\"bytes\":%ld,\"iters\":%d,\"builtin_ms\":%.2f,\"builtin_mb_per_s\":%.0f,"
+                     "\"program_ms\":%.2f,\"program_mb_per_s\":%.0f,\"speedup\":%.2f}\n",
+            size, CAT_ITERS, times[0] * 1e3, size / times[0] / 1e6, times[1] * 1e3, size / times[1] / 1e6, times[1] / times[0]);
+
+    char out[sizeof(src) + 4];
+    sprintf(out, "%s.out", src);
+    unlink(out);
+    unlink(src);
+}
+
+/**
+ * Time stopping n background jobs at exit, as kill_zombies() does
+ *
+ * The jobs are all signalled before any is waited for, so this should take about
+ * as long for many jobs as for a few, rather than growing by a wait per job.
+ */
+static void bench_shutdown_case(int n)
+{
+    struct pipeline pl = {0};
+    char *buf = parse_fixed("sleep 100 &", &pl);
+    struct sigaction sa_SIGINT = {0};
+    sa_SIGINT.sa_handler = SIG_IGN;
+    struct background bg = {0};
+    bg.sigfd = bg_sigfd;
+    int lastExit = 0;
+
+    launch_mode = LAUNCH_SPAWN;
+    for (int i = 0; i < n; i++)
+        exec_cmd(&pl, &lastExit, sa_SIGINT, &bg);
+    run_bg_census(&bg);
+    double start = now();
+    kill_zombies(&bg);
+    double elapsed = now() - start;
+
+    fprintf(results, "{\"bench\":\"shutdown\",\"jobs\":%d,\"left\":%d,\"ms\":%.1f,\"us_per_job\":%.1f}\n", n,
+            bg.size, elapsed * 1e3, elapsed * 1e6 / n);
+
+    free(bg.pids);
+    free(bg.owner);
+    free(bg.index);
+    free(bg.jobs);
+    free(buf);
+    arena_free(&pl.mem);
+    free(pl.cmds);
+}
+
+/**
+ * Print the versions of everything that affects the results, to tell runs apart
+ */
+static void print_meta(void)
+{
+    struct utsname u;
+    uname(&u);
+    fprintf(results, "{\"bench\":\"meta\",\"time\":%ld,\"kernel\":\"%s\",\"machine\":\"%s\",\"cpus\":%ld}\n",
+            (long)time(NULL), u.release, u.machine, sysconf(_SC_NPROCESSORS_ONLN));
+}
+
+int main(void)
+{
+    // Keep the real stdout for results; the shell's own messages and the
+    // children's output go to /dev/null
+    results = fdopen(dup(STDOUT_FILENO), "w");
+    int devnull = open("/dev/null", O_WRONLY);
+    dup2(devnull, STDOUT_FILENO);
+    close(devnull);
+    setvbuf(results, NULL, _IOLBF, 0);
+
+    print_meta();
+
+    // The arena is rewound per line, not freed, so parsing shouldn't grow memory; run
+    // first, before the other cases push up the peak it is compared against
+    bool flat = bench_arena_case();
+
+    // parse_command(): strtok parser vs single-pass lexer
+    bench_parse_case("simple", "ls -la /tmp/some/directory > listing.txt\n", true);
+    bench_parse_case("pid", "mkdir testdir$$ && echo $$ > pid$$.txt\n", true);
+    bench_parse_case("pipeline", "cat < access.log | grep -v healthcheck | sort | uniq -c > counts.txt\n", true);
+
+    char *line = synthetic_line(128);
+    bench_parse_case("128 args", line, true);
+    free(line);
+
+    line = synthetic_line(100000);
+    bench_parse_case("100k args", line, false);
+    free(line);
+
+    bench_expand_case(1);
+    bench_expand_case(64);
+
+    // History is mapped, so opening it shouldn't depend on its length once indexed
+    bench_history_case(10000);
+    bench_history_case(2000000);
+
+    // Globbing lists each directory once per line, in large getdents64 batches
+    bench_glob_case(1000);
+    bench_glob_case(100000);
+
+    // Children are launched and reaped exactly as the shell does it
+    struct background bg = {0};
+    bg_init(&bg);
+    bg_sigfd = bg.sigfd;
+    enum launch_mode modes[] = {LAUNCH_SPAWN, LAUNCH_FORK};
+    for (int m = 0; m < 2; m++)
+    {
+        bench_launch_case("true", "/bin/true", modes[m]);
+        bench_launch_case("true redirected", "/bin/true < /dev/null > /dev/null", modes[m]);
+        bench_launch_case("true here-string", "/bin/true <<< hello", modes[m]);
+        bench_background_case(modes[m]);
+    }
+
+    // Built-ins run in the shell, so this isolates the cost of swapping stdin/stdout
+    bench_launch_case("builtin", "true", LAUNCH_SPAWN);
+    bench_launch_case("builtin redirected", "true < /dev/null > /dev/null", LAUNCH_SPAWN);
+
+    // Jobs left at exit get SIGTERM together and one deadline between them
+    bench_shutdown_case(100);
+    bench_shutdown_case(2000);
+
+    // The cat built-in copies in the kernel, with no child to launch
+    bench_cat_case(4096);
+    bench_cat_case(64 << 20);
+
+    if (!flat)
+    {
+        fprintf(stderr, "arena: resident memory grew while parsing\n");
+        return 1;
+    }
+    return 0;
+}
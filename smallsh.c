@@ -11,14 +11,38 @@
  * a shell that implements a subset of features of well-known shells
  */
 
+#define _GNU_SOURCE // For pipe2, splice, tee, close_range and CPU sets
+
 #include <signal.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <errno.h>
 #include <string.h>
+#include <time.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <poll.h>
+#include <spawn.h>
+#include <sched.h>
+#include <termios.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <sys/wait.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 #include "smallsh.h"
 
@@ -26,8 +50,148 @@
 // but cannot be passed as a parameter to `void (*sa_handler)(int)`
 bool allow_bg = true;
 
-int main()
+// Whether commands are typed at a terminal (prompts, idle job reports) or run as a batch
+bool interactive = true;
+
+// Whether commands are read from a stdin that isn't a terminal, and which file that is,
+// so "parallel" can tell it would be reading the rest of the script
+bool script_on_stdin = false;
+struct stat script_stdin;
+
+// How non-built-in commands are launched, selected with -m so the two paths can be compared
+enum launch_mode launch_mode = LAUNCH_SPAWN;
+
+// Check syntax without running anything, not even the commands inside $(...) (-n)
+bool parse_only = false;
+
+// PID that "$$" expands to; a $(...) subshell keeps the one of the shell it came from
+pid_t shell_pid = 0;
+
+// Run bare "cat" and "tee FILE" pipeline stages as splice/tee relays (-z)
+bool zero_copy = false;
+
+// CPUs background jobs run on unless they give their own (-a CPUS or "affinity -b CPUS")
+cpu_set_t bg_cpus;
+bool bg_cpus_set = false;
+
+// Seconds jobs left at exit get between SIGTERM and SIGKILL; 0 kills them outright (-k SECS)
+double shutdown_grace = SHUTDOWN_GRACE_DEFAULT;
+
+// Whether a loop's SIGINT handler is installed, in place of the shell ignoring Ctrl-C;
+// background children are started ignoring it all the same
+bool loop_catching = false;
+
+// Exit statuses of every stage of the last foreground pipeline, reported by "status";
+// emptied by any other command that sets "$?"
+int *pipe_status = NULL;
+int pipe_nstatus = 0;
+
+// Whether jobs get process groups and the terminal (interactive shells only), and the
+// shell's own group and terminal modes to go back to after a foreground job
+bool job_control = false;
+pid_t shell_pgid = 0;
+struct termios shell_tmodes;
+
+// Signal mask children start with; the shell itself runs with SIGCHLD blocked
+sigset_t child_sigmask;
+
+// Command name -> absolute path, shared by both launch paths and the "hash" built-in
+struct path_cache path_cache = {0};
+
+// Shell variables, the exported ones making up the environment of every command
+struct var_store vars = {0};
+
+// Resource usage of reaped children, per command, reported by "stats"
+struct stats stats = {0};
+
+// Output of background jobs kept in memory when capture is on (-o)
+struct capture capture = {0};
+
+// Lines typed at the prompt, kept across sessions
+struct history history = {.fd = -1, .idx_fd = -1};
+
+// Clients of the job-submission socket when running as a daemon (-S)
+struct server server = {.listen_fd = -1};
+
+// Phase timings written when tracing is on (-x FILE or SMALLSH_TRACE=FILE)
+struct trace trace = {.fd = -1};
+
+extern char **environ;
+
+#ifndef SMALLSH_NO_MAIN // Defined when linking the shell into the benchmarks
+int main(int argc, char *argv[])
 {
+    // Parse command line options
+    bool stopOnError = false; // -e: stop at the first failing command
+    bool report = false;      // -r: print lines/s at exit
+    const char *tracePath = getenv("SMALLSH_TRACE"); // -x: where to write a trace
+    const char *serverPath = NULL; // -S: serve commands on this socket instead
+    long serverJobs = 0;           // -j: most commands the daemon runs at once
+    char *end;
+    int opt;
+    while ((opt = getopt(argc, argv, "m:zenrx:o:a:S:j:k:")) != -1)
+    {
+        if (opt == 'z')
+            zero_copy = true;
+        else if (opt == 'e')
+            stopOnError = true;
+        else if (opt == 'n')
+            parse_only = true;
+        else if (opt == 'r')
+            report = true;
+        else if (opt == 'x')
+            tracePath = optarg;
+        else if (opt == 'o' && capture_configure(optarg))
+            ;
+        else if (opt == 'a' && parse_cpu_list(optarg, &bg_cpus))
+            bg_cpus_set = true;
+        else if (opt == 'S')
+            serverPath = optarg;
+        else if (opt == 'j' && (serverJobs = strtol(optarg, &end, 10)) > 0 && *end == '\0')
+            ;
+        else if (opt == 'k' && (shutdown_grace = strtod(optarg, &end)) >= 0 && end != optarg && *end == '\0')
+            ;
+        else if (opt == 'm' && strmatch(optarg, "spawn"))
+            launch_mode = LAUNCH_SPAWN;
+        else if (opt == 'm' && strmatch(optarg, "fork"))
+            launch_mode = LAUNCH_FORK;
+        else
+        {
+            fprintf(stderr, "usage: %s [-m spawn|fork] [-z] [-e] [-n] [-r] [-x tracefile] [-o size[,total]] [-a cpus] [-S socket [-j jobs]] [-k secs] [script]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (tracePath != NULL && *tracePath != '\0' && !trace_open(tracePath))
+        fprintf(stderr, "cannot open file %s for tracing\n", tracePath);
+
+    // Commands come from the script named on the command line, or from stdin.
+    // Anything but a terminal is run in batch mode: no prompts and no per-line flushes.
+    struct line_source src;
+    const char *srcName = "stdin";
+    if (optind < argc)
+    {
+        srcName = argv[optind];
+        if (!open_script(srcName, &src))
+        {
+            fprintf(stderr, "cannot open file %s for input\n", srcName);
+            exit(EXIT_FAILURE);
+        }
+        interactive = false;
+    }
+    else if (serverPath != NULL) // Commands come from the socket's clients
+        interactive = false;
+    else
+    {
+        open_stream(STDIN_FILENO, &src);
+        interactive = isatty(STDIN_FILENO);
+        script_on_stdin = !interactive && fstat(STDIN_FILENO, &script_stdin) == 0;
+    }
+    if (interactive)
+    {
+        job_control_init();
+        history_open();
+    }
+
     // Initialize sigaction struct for SIGTSTP (Ctrl-Z)
     struct sigaction sa_SIGTSTP = {0};
     sa_SIGTSTP.sa_handler = &handle_SIGTSTP; // Register handler to toggle foreground-only mode
@@ -42,44 +206,130 @@ int main()
     sa_SIGINT.sa_flags = 0;
     sigaction(SIGINT, &sa_SIGINT, NULL);
 
-    // Create new struct to store command info
-    struct command cmd;
-    cmd.args = malloc(sizeof(char *) * MAX_ARGS + 1);
+    // Create new struct to store the stages of each command line
+    struct pipeline pl = {0};
+
+    // Blocks and lists of commands are parsed into nodes kept here while they run
+    struct arena scriptMem = {0};
 
     // Create new struct to store info about background processes
-    struct background bg;
+    struct background bg = {0};
+    bg_init(&bg);
+
+    if (serverPath != NULL)
+    {
+        int result = run_server(serverPath, serverJobs, sa_SIGINT, &bg);
+        kill_zombies(&bg);
+        trace_flush();
+        return result;
+    }
 
     // To store exit status or terminating signal of the last fg process
     int lastExit = 0;
 
     // To determine when to exit the shell
     bool cont = true;
+    int syntaxErrors = 0;
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
 
     do
     {
         // Display prompt
-        printf(": ");
-        fflush(stdout);
+        if (interactive)
+        {
+            printf(": ");
+            fflush(stdout);
+        }
+
+        // Release the previous command line's stages so we can store the next one
+        reset_pipeline(&pl);
+
+        // Report background jobs that finish while we wait for the user
+        if (interactive && !line_ready(&src))
+            wait_for_input(&bg);
 
-        // Zero out members of the command struct so we can store the next command
-        reset_command(&cmd);
+        // Read current command; end of input works like "exit"
+        long long phase = trace_now();
+        char *line = read_command(&src);
+        trace_event("read", "shell", phase, trace.pid, NULL);
+        if (line == NULL)
+            break;
+
+        // Recall "!n" and "!prefix" references, and keep what was typed
+        if (interactive)
+        {
+            char *recalled;
+            int expanded = history_expand(line, &recalled);
+            if (expanded == -1)
+                continue;
+            if (expanded == 1) // Show what is run, like other shells
+            {
+                line = recalled;
+                printf("%s\n", line);
+            }
+            history_add(line);
+        }
 
-        // Read current command, parse it, and store it in cmd
-        parse_command(read_command(), &cmd);
+        // Parse it and store it in pl
+        phase = trace_now();
+        arena_reset(&scriptMem);
+        struct node *script;
+        bool parsed = parse_line(line, &src, false, &pl, &scriptMem, &script);
+        trace_event("parse", "shell", phase, trace.pid, NULL);
+        if (!parsed)
+        {
+            if (interactive)
+                fprintf(stderr, "syntax error\n");
+            else
+                fprintf(stderr, "%s: line %ld: syntax error\n", srcName, src.lineno);
+            fflush(stderr);
+            syntaxErrors++;
+            if (stopOnError)
+            {
+                lastExit = W_EXITCODE(2, 0);
+                break;
+            }
+            continue;
+        }
+        if (parse_only)
+            continue;
 
         // Execute the current command
-        cont = exec_cmd(&cmd, &lastExit, sa_SIGINT, &bg);
+        if (script != NULL)
+            cont = run_script(script, &pl, &lastExit, sa_SIGINT, &bg);
+        else
+            cont = exec_cmd(&pl, &lastExit, sa_SIGINT, &bg);
+        vars.status = lastExit;
 
         // Check on background processes
-        bg = run_bg_census(bg, lastExit);
+        run_bg_census(&bg);
 
-        // Free memory allocated for input and output files
-        free(cmd.inFile);
-        free(cmd.outFile);
+        if (stopOnError && lastExit != 0) // The command failed
+            break;
     } while (cont);
 
-    kill_zombies(bg);
+    if (report)
+    {
+        struct timespec end;
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        fprintf(stderr, "%ld lines in %.3f s (%.0f lines/s)\n", src.lineno, secs, src.lineno / secs);
+    }
+
+    kill_zombies(&bg);
+    fflush(stdout);
+    trace_flush();
+
+    // A script's exit status is that of its last foreground command, like other shells
+    if (parse_only)
+        return syntaxErrors ? 2 : EXIT_SUCCESS;
+    if (interactive)
+        return EXIT_SUCCESS;
+    return WIFEXITED(lastExit) ? WEXITSTATUS(lastExit) : 128 + WTERMSIG(lastExit);
 }
+#endif
 
 void handle_SIGTSTP(int signo)
 {
@@ -103,315 +353,6447 @@ void handle_SIGTSTP(int signo)
     }
 
     // Give the prompt again and clear stdout
-    printf(": ");
+    if (interactive)
+        printf(": ");
     fflush(stdout);
 }
 
 void reset_command(struct command *cmd)
 {
-    // Zero out args so we can fill it again
-    memset((*cmd).args, 0, MAX_ARGS + 1);
+    // Forget the args so we can fill them again; the memory belongs to the pipeline's arena
+    (*cmd).args = NULL;
     (*cmd).nargs = 0;
+    (*cmd).cap = 0;
 
     // By default, don't run in background
     (*cmd).run_in_bg = false;
 
     // Don't carry over i/o redirects
-    (*cmd).inFile = NULL;
-    (*cmd).outFile = NULL;
+    (*cmd).redirs = NULL;
+    (*cmd).nredirs = 0;
+    (*cmd).redircap = 0;
+    (*cmd).capture_fd = -1;
+
+    // Nor affinity/nice/ulimit settings
+    (*cmd).opts = NULL;
+    (*cmd).prefix = 0;
 }
 
-char *read_command(void)
+void reset_pipeline(struct pipeline *pl)
 {
-    size_t buffer_size = 0;
-    char *line = NULL;
-    getline(&line, &buffer_size, stdin); // Read command
-    return line;                         // Return command string so it can be parsed
+    // Everything the last command line allocated lives in the arena, release it in one go
+    arena_reset(&(*pl).mem);
+    (*pl).ncmds = 0;
+    (*pl).run_in_bg = false;
+    (*pl).dirs = NULL; // The listings were in the arena too
 }
 
-void parse_command(char *cmd_str, struct command *cmd)
+struct command *add_stage(struct pipeline *pl)
 {
-    // Allocate enough space for 512 arguments
-    char **tokens = malloc(sizeof(char *) * MAX_INPUT_LEN + 1);
-
-    // Get the first argument
-    char *token = strtok(cmd_str, TOKEN_DELIMITER);
-
-    // Create a string to hold the PID for variable expansion
-    char *pid_str = malloc(sizeof(char) * MAX_PID_LEN + 1);
-    sprintf(pid_str, "%d", getpid());
-
-    // Iterate through all arguments in command
-    while (token != NULL)
+    if ((*pl).ncmds == (*pl).cap) // Out of room, double the number of stages
     {
+        (*pl).cap = (*pl).cap ? (*pl).cap * 2 : 4;
+        (*pl).cmds = realloc((*pl).cmds, sizeof(struct command) * (*pl).cap);
+    }
 
-        if (strmatch(token, "<")) // Input redirect encountered
-        {
-            token = strtok(NULL, TOKEN_DELIMITER);                       // Move to the next argument
-            (*cmd).inFile = malloc(sizeof(char) * MAX_FILENAME_LEN + 1); // Allocate enough space for a file name
-            strcpy((*cmd).inFile, token);                                // Copy the token into the command struct
-        }
-        else if (strmatch(token, ">")) // Output redirect encountered
-        {
-            token = strtok(NULL, TOKEN_DELIMITER);                        // Move to the next token
-            (*cmd).outFile = malloc(sizeof(char) * MAX_FILENAME_LEN + 1); // Allocate enough space for a file name
-            strcpy((*cmd).outFile, token);                                // Copy the token into the command struct
-        }
-        else // Not a redirect character
-        {
-            if (strstr(token, "$$") != NULL) // Token has at least one instance of "$$"
-            {
-                tokens[(*cmd).nargs] = malloc((sizeof(char) * ((strlen(token)) / 2) + 1) * strlen(pid_str) + 1); // Allocate enough space for a token with only '$' characters
-                expand_pid(tokens[(*cmd).nargs], token, pid_str);                                                // Replace all instances of "$$" with the PID and store result in tokens
-            }
-            else                              // It's a regular argument
-                tokens[(*cmd).nargs] = token; // Store it as it is
+    struct command *cmd = &(*pl).cmds[(*pl).ncmds++];
+    reset_command(cmd);
+    return cmd;
+}
 
-            (*cmd).nargs++; // Increment the number of arguments
-        }
+void add_arg(struct arena *mem, struct command *cmd, char *arg)
+{
+    if ((*cmd).nargs + 1 >= (*cmd).cap) // No room for the argument and the NULL after it
+    {
+        // Double the array; the old one stays in the arena until the next reset
+        (*cmd).cap = (*cmd).cap ? (*cmd).cap * 2 : 8;
+        char **args = arena_alloc(mem, sizeof(char *) * (*cmd).cap);
+        if ((*cmd).nargs > 0)
+            memcpy(args, (*cmd).args, sizeof(char *) * (*cmd).nargs);
+        (*cmd).args = args;
+    }
+    (*cmd).args[(*cmd).nargs++] = arg;
+    (*cmd).args[(*cmd).nargs] = NULL;
+}
 
-        token = strtok(NULL, TOKEN_DELIMITER); // Get the next token
+struct redirect *add_redirect(struct arena *mem, struct command *cmd, enum redirect_type type, int fd, char *file, int target)
+{
+    if ((*cmd).nredirs == (*cmd).redircap) // Double the array, like add_arg() does
+    {
+        (*cmd).redircap = (*cmd).redircap ? (*cmd).redircap * 2 : 4;
+        struct redirect *redirs = arena_alloc(mem, sizeof(struct redirect) * (*cmd).redircap);
+        if ((*cmd).nredirs > 0)
+            memcpy(redirs, (*cmd).redirs, sizeof(struct redirect) * (*cmd).nredirs);
+        (*cmd).redirs = redirs;
     }
+    struct redirect *r = &(*cmd).redirs[(*cmd).nredirs++];
+    *r = (struct redirect){type, fd, file, target};
+    return r;
+}
+
+bool redirects_fd(struct command *cmd, int fd)
+{
+    for (int i = 0; i < (*cmd).nredirs; i++)
+        if ((*cmd).redirs[i].fd == fd)
+            return true;
+    return false;
+}
 
-    free(pid_str);
+void *arena_alloc(struct arena *a, size_t size)
+{
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1); // Keep every allocation aligned
 
-    // Check if the last argument is the background character
-    if ((*cmd).nargs > 1 && strmatch(tokens[(*cmd).nargs - 1], "&"))
+    struct arena_chunk *chunk = (*a).head;
+    if (chunk == NULL || (*chunk).used + size > (*chunk).size) // Current chunk is full, start a new one
     {
-        if (allow_bg)                // Not in foreground-only mode
-            (*cmd).run_in_bg = true; // Indicate the command should run in the background
+        size_t chunkSize = ARENA_CHUNK_SIZE;
+        if (chunk != NULL && (*chunk).size * 2 > chunkSize)
+            chunkSize = (*chunk).size * 2; // Grow geometrically so long lines need few chunks
+        if (size > chunkSize)
+            chunkSize = size;
 
-        // Remove the character
-        (*cmd).nargs--;
-        tokens[(*cmd).nargs] = NULL;
+        chunk = malloc(sizeof(struct arena_chunk) + chunkSize);
+        if (chunk == NULL)
+        {
+            fprintf(stderr, "out of resources\n");
+            exit(EXIT_FAILURE);
+        }
+        (*chunk).size = chunkSize;
+        (*chunk).used = 0;
+        (*chunk).next = (*a).head;
+        (*a).head = chunk;
     }
 
-    (*cmd).args = tokens; // Store the arguments in the command struct
+    void *ptr = (*chunk).data + (*chunk).used;
+    (*chunk).used += size;
+    return ptr;
 }
 
-bool strmatch(const char *str1, const char *str2)
+char *arena_strdup(struct arena *a, const char *str)
 {
-    if (strcmp(str1, str2) == 0)
-        return true; // Strings match
-    return false;    // Strings don't match
+    size_t len = strlen(str) + 1;
+    return memcpy(arena_alloc(a, len), str, len);
 }
 
-void expand_pid(char *result, char *token, char *pid)
+void arena_reset(struct arena *a)
 {
-    // Create a buffer large enough to hold a token consisting entirely of $ characters
-    // i.e. half of the string length * the max number of digits in a PID
-    char *buf = malloc(sizeof(char) * (((strlen(token) / 2) + 1) * MAX_PID_LEN) + 1);
+    while ((*a).large != NULL) // Don't let one huge $(...) pin its memory for good
+    {
+        struct arena_chunk *next = (*(*a).large).next;
+        free((*a).large);
+        (*a).large = next;
+    }
 
-    char *pos = buf;   // The position to insert at
-    char *tmp = token; // Temp variable to store chunks of the token
+    struct arena_chunk *chunk = (*a).head;
+    if (chunk == NULL)
+        return;
 
-    while (true)
+    // If the last command line needed more than one chunk, replace them all with a single
+    // chunk big enough for that much, so a steady workload settles on one allocation
+    if ((*chunk).next != NULL)
     {
-        char *substr = strstr(tmp, "$$"); // Get the substring starting at the first occurrence of "$$"
-        if (substr != NULL)
+        size_t total = 0;
+        while (chunk != NULL)
         {
-            // Copy over the chunk before substr
-            memcpy(pos, tmp, substr - tmp);
-            pos += substr - tmp;
-
-            // Copy over the PID value
-            memcpy(pos, pid, strlen(pid));
-            pos += strlen(pid);
-
-            tmp = substr + 2; // Move past "$$"
+            struct arena_chunk *next = (*chunk).next;
+            total += (*chunk).size;
+            free(chunk);
+            chunk = next;
         }
-        else // We've gone beyond the last instance of "$$""
+        chunk = malloc(sizeof(struct arena_chunk) + total);
+        if (chunk == NULL)
         {
-            strcpy(pos, tmp); // Copy the remaining part of the string
-            break;
+            fprintf(stderr, "out of resources\n");
+            exit(EXIT_FAILURE);
         }
+        (*chunk).size = total;
+        (*chunk).next = NULL;
+        (*a).head = chunk;
     }
-
-    strcpy(result, buf); // Copy buffer into result
+    (*chunk).used = 0;
 }
 
-bool exec_cmd(struct command *cmd, int *lastExit, struct sigaction sa_SIGINT, struct background *bg)
+/**
+ * Move a descriptor the shell keeps for itself above the ones a redirect can name,
+ * so that N>&M can never reach it
+ *
+ * @return the new descriptor, or fd itself if it was already out of reach or -1
+ */
+static int fd_lift(int fd)
 {
-    // Pull out the first and second arguments to make syntax less busy
-    char *firstArg = (*cmd).args[0];
-    char *secondArg = (*cmd).args[1];
+    if (fd == -1 || fd > MAX_REDIRECT_FD)
+        return fd;
+    int moved = fcntl(fd, F_DUPFD_CLOEXEC, MAX_REDIRECT_FD + 1);
+    if (moved == -1) // Out of descriptors; better low than lost
+        return fd;
+    close(fd);
+    return moved;
+}
 
-    // Check if first command is a built-in function
-    if (firstArg == NULL || (strncmp(firstArg, "#", 1)) == 0) // For empty line or comment, do nothing
+/**
+ * Whether fd is one the shell holds for itself rather than one a command may be given
+ */
+static bool fd_owned(int fd)
+{
+    if (fd == trace.fd || fd == history.fd || fd == history.idx_fd || fd == server.listen_fd)
         return true;
-    else if (strmatch(firstArg, "exit")) // For "exit", return false to exit the main loop
-        return false;
-    else if (strmatch(firstArg, "cd")) // For "cd", change the directory based on the second argument
-        return smallsh_cd(secondArg);
-    else if (strmatch(firstArg, "status")) // For "status", print the exit/termination value of the last fg process
-        return smallsh_status(*lastExit);
-
-    // Command is not built in, outsource execution
-    run_non_builtin(cmd, lastExit, sa_SIGINT, bg);
-    return true;
+    for (int i = 0; i < server.nclients; i++)
+        if ((*server.clients[i]).fd == fd)
+            return true;
+    for (struct job_log *log = capture.oldest; log != NULL; log = (*log).next)
+        if ((*log).fd == fd)
+            return true;
+    return false;
 }
 
-bool smallsh_cd(char *dir)
+bool open_script(const char *path, struct line_source *src)
 {
-    if (dir == NULL) // "cd" is the only argument
+    int fd = fd_lift(open(path, O_RDONLY | O_CLOEXEC));
+    if (fd == -1)
+        return false;
+
+    // Map regular files whole; anything else (a FIFO, /dev/stdin) is read in chunks
+    struct stat sb;
+    if (fstat(fd, &sb) == 0 && S_ISREG(sb.st_mode) && sb.st_size > 0)
     {
-        const char *homeDir = getenv("HOME");
-        if (chdir(homeDir) == -1)                                 // Change to HOME directory
-            fprintf(stderr, "directory %s not found\n", homeDir); // Directory wasn't found, so print an error
+        // Private and writable so lines can be split in place; only touched pages are copied
+        void *map = mmap(NULL, sb.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED)
+        {
+            close(fd);
+            madvise(map, sb.st_size, MADV_SEQUENTIAL);
+            memset(src, 0, sizeof(*src));
+            (*src).buf = map;
+            (*src).len = sb.st_size;
+            (*src).fd = -1;
+            return true;
+        }
     }
-    else if (chdir(dir) == -1)                   // A path was specified, change the working directory to that path
-        printf("directory %s not found\n", dir); // Directory wasn't found, so print an error
 
-    fflush(stderr);
-    return true; // Always continue shell execution after "cd"
+    open_stream(fd, src);
+    return true;
 }
 
-bool smallsh_status(int lastExit)
+void open_stream(int fd, struct line_source *src)
 {
-    if (WIFEXITED(lastExit))                                     // Last foreground process exited on its own
-        printf("exit value %d\n", WEXITSTATUS(lastExit));        // Print the exit value
-    else                                                         // The last foreground process was terminated
-        printf("terminated by signal %d\n", WTERMSIG(lastExit)); // Print the terminating signal
-    return true;                                                 // Always continue shell execution after "cd"
+    memset(src, 0, sizeof(*src));
+    (*src).fd = fd;
+    (*src).cap = LINE_CHUNK_SIZE;
+    (*src).buf = malloc((*src).cap);
 }
 
-void run_non_builtin(struct command *cmd, int *lastExit, struct sigaction sa_SIGINT, struct background *bg)
+bool line_ready(struct line_source *src)
 {
-    // A lot of this code comes from the Module 4 explorations
+    return memchr((*src).buf + (*src).pos, '\n', (*src).len - (*src).pos) != NULL;
+}
 
-    pid_t pid = fork(); // Create a new process
-    if (pid < 0)        // The process failed, print an error and exit
+void arena_free(struct arena *a)
+{
+    arena_reset(a); // Drops the large blocks
+    while ((*a).head != NULL)
     {
-        fprintf(stderr, "out of resources\n");
-        exit(EXIT_FAILURE);
+        struct arena_chunk *next = (*(*a).head).next;
+        free((*a).head);
+        (*a).head = next;
     }
-    else if (pid == 0) // Child process
+}
+
+char *read_command(struct line_source *src)
+{
+    while (true)
     {
-        if ((*cmd).run_in_bg) // Process is running in the background
+        // Hand out the next complete line, splitting it off in place
+        char *line = (*src).buf + (*src).pos;
+        char *nl = memchr(line, '\n', (*src).len - (*src).pos);
+        if (nl != NULL)
         {
-            if ((*cmd).inFile == NULL)
-                handle_redirect("/dev/null", "in"); // No input redirect, use /dev/null
-            if ((*cmd).outFile == NULL)
-                handle_redirect("/dev/null", "out"); // No output redirect, use /dev/null
+            *nl = '\0';
+            (*src).pos = nl - (*src).buf + 1;
+            (*src).lineno++;
+            return line;
         }
-        else // Process is not running in the background
+
+        if ((*src).fd == -1 || (*src).eof) // No more data, but maybe a last line with no newline
         {
-            // Set the SIGINT action to its default behavior
-            sa_SIGINT.sa_handler = SIG_DFL;
-            sigaction(SIGINT, &sa_SIGINT, NULL);
+            if ((*src).pos == (*src).len)
+                return NULL;
+            size_t len = (*src).len - (*src).pos;
+            if ((*src).fd == -1) // Mapped, so there may be no byte after it to terminate it with
+            {
+                (*src).spill = realloc((*src).spill, len + 1);
+                line = memcpy((*src).spill, line, len);
+            }
+            line[len] = '\0';
+            (*src).pos = (*src).len;
+            (*src).lineno++;
+            return line;
         }
 
-        if (((*cmd).inFile != NULL))
-            handle_redirect((*cmd).inFile, "in"); // Command has an input redirect, so redirect to specified file
-        if (((*cmd).outFile != NULL))
-            handle_redirect((*cmd).outFile, "out"); // Command has an output redirect, so redirect to specified file
-
-        // Execute command
-        if (execvp((*cmd).args[0], (*cmd).args))
+        // Move the partial line to the front, making room for the rest (and its '\0')
+        memmove((*src).buf, line, (*src).len - (*src).pos);
+        (*src).len -= (*src).pos;
+        (*src).pos = 0;
+        if ((*src).len + 1 >= (*src).cap)
         {
-            // An error occurred, print an error and exit
-            fprintf(stderr, "%s: no such file or directory\n", (*cmd).args[0]);
-            exit(EXIT_FAILURE);
+            (*src).cap *= 2;
+            (*src).buf = realloc((*src).buf, (*src).cap);
         }
+
+        ssize_t n = read((*src).fd, (*src).buf + (*src).len, (*src).cap - (*src).len - 1);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            (*src).eof = true;
+        else
+            (*src).len += n;
     }
-    else // Parent process
-    {
-        if (!((*cmd).run_in_bg)) // Child process not running in background, so wait until it completes
-        {
-            // Wait until the process exits on its own or a terminating signal is detected
-            do
-            {
-                waitpid(pid, lastExit, 0);
-            } while (!WIFEXITED(*lastExit) && !WIFSIGNALED(*lastExit));
+}
 
-            // If the process was terminated by a signal, print a message about the signal
-            if (WIFSIGNALED(*lastExit))
-                printf("terminated by signal %d\n", WTERMSIG(*lastExit));
-        }
-        else // Child process running in the background, don't wait
-        {
-            // Print a message about the background PID
-            printf("background pid: %d\n", pid);
+// Class of every byte value, for the bytes the lexer has to stop at
+static const unsigned char byte_class[256] = {
+    [' '] = BYTE_DELIM, ['\r'] = BYTE_DELIM, ['\a'] = BYTE_DELIM, ['\n'] = BYTE_DELIM, ['\t'] = BYTE_DELIM,
+    ['$'] = BYTE_DOLLAR, ['<'] = BYTE_LT, ['>'] = BYTE_GT, ['&'] = BYTE_AMP, ['#'] = BYTE_HASH, ['|'] = BYTE_PIPE,
+    [';'] = BYTE_SEMI, ['*'] = BYTE_GLOB, ['?'] = BYTE_GLOB, ['['] = BYTE_GLOB};
 
-            // Add the background process' PID to the background struct so we can keep an eye on them
-            (*bg).pids[(*bg).size++] = pid;
-        }
+/**
+ * Scalar version of scan_special(), also used for the tail of the vectorized versions
+ */
+static const char *scan_special_scalar(const char *p, const char *end)
+{
+    while (p < end && byte_class[(unsigned char)*p] == BYTE_WORD)
+        p++;
+    return p;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/**
+ * SSE2 version of scan_special(), 16 bytes per step
+ *
+ * Every delimiter is a control character or space, so a single unsigned "<= ' '"
+ * comparison stands in for all of them; the few other control characters it catches
+ * are WORD bytes and are skipped by the caller.
+ */
+__attribute__((target("sse2"))) static const char *scan_special_sse2(const char *p, const char *end)
+{
+    const __m128i space = _mm_set1_epi8(' ');
+    while (end - p >= 16)
+    {
+        __m128i b = _mm_loadu_si128((const __m128i *)p);
+        __m128i hit = _mm_cmpeq_epi8(_mm_min_epu8(b, space), b); // b <= ' '
+        hit = _mm_or_si128(hit, _mm_cmpeq_epi8(b, _mm_set1_epi8('$')));
+        hit = _mm_or_si128(hit, _mm_cmpeq_epi8(b, _mm_set1_epi8('<')));
+        hit = _mm_or_si128(hit, _mm_cmpeq_epi8(b, _mm_set1_epi8('>')));
+        hit = _mm_or_si128(hit, _mm_cmpeq_epi8(b, _mm_set1_epi8('&')));
+        hit = _mm_or_si128(hit, _mm_cmpeq_epi8(b, _mm_set1_epi8('#')));
+        hit = _mm_or_si128(hit, _mm_cmpeq_epi8(b, _mm_set1_epi8('|')));
+        hit = _mm_or_si128(hit, _mm_cmpeq_epi8(b, _mm_set1_epi8(';')));
+        hit = _mm_or_si128(hit, _mm_cmpeq_epi8(b, _mm_set1_epi8('*')));
+        hit = _mm_or_si128(hit, _mm_cmpeq_epi8(b, _mm_set1_epi8('?')));
+        hit = _mm_or_si128(hit, _mm_cmpeq_epi8(b, _mm_set1_epi8('[')));
+        int mask = _mm_movemask_epi8(hit);
+        if (mask != 0)
+            return p + __builtin_ctz(mask);
+        p += 16;
+    }
+    return scan_special_scalar(p, end);
+}
+
+/**
+ * AVX2 version of scan_special(), 32 bytes per step
+ */
+__attribute__((target("avx2"))) static const char *scan_special_avx2(const char *p, const char *end)
+{
+    const __m256i space = _mm256_set1_epi8(' ');
+    while (end - p >= 32)
+    {
+        __m256i b = _mm256_loadu_si256((const __m256i *)p);
+        __m256i hit = _mm256_cmpeq_epi8(_mm256_min_epu8(b, space), b); // b <= ' '
+        hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(b, _mm256_set1_epi8('$')));
+        hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(b, _mm256_set1_epi8('<')));
+        hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(b, _mm256_set1_epi8('>')));
+        hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(b, _mm256_set1_epi8('&')));
+        hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(b, _mm256_set1_epi8('#')));
+        hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(b, _mm256_set1_epi8('|')));
+        hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(b, _mm256_set1_epi8(';')));
+        hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(b, _mm256_set1_epi8('*')));
+        hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(b, _mm256_set1_epi8('?')));
+        hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(b, _mm256_set1_epi8('[')));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(hit);
+        if (mask != 0)
+            return p + __builtin_ctz(mask);
+        p += 32;
     }
+    return scan_special_sse2(p, end);
 }
+#endif
+
+/**
+ * Pick the widest scan_special() the CPU supports, the first time it is needed
+ */
+static const char *scan_special_init(const char *p, const char *end);
+
+// The scanner in use; starts out pointing at the function that chooses one
+static const char *(*scan_special)(const char *, const char *) = scan_special_init;
 
-void handle_redirect(char *file, const char *direction)
+static const char *scan_special_init(const char *p, const char *end)
 {
-    // This code takes from "Exploration: Processes and I/O"
+    scan_special = scan_special_scalar;
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        scan_special = scan_special_avx2;
+    else if (__builtin_cpu_supports("sse2"))
+        scan_special = scan_special_sse2;
+#endif
+    return scan_special(p, end);
+}
 
-    int fd;      // File descriptor
-    int dup_res; // Dup result
+static bool var_name_start(char c);
+static bool var_valid(const char *name, size_t len);
 
-    if (strmatch(direction, "in")) // Input redirect
+/**
+ * Find the ")" closing a "$(", counting the parentheses nested inside it
+ */
+static char *match_paren(char *p, const char *end)
+{
+    int depth = 1;
+    for (; p < end; p++)
     {
-        fd = open(file, O_RDONLY); // Open the file only for reading
-        if (fd == -1)
-        {
-            // Error opening file; print error and exit
-            fprintf(stderr, "cannot open file %s for input\n", file);
-            exit(EXIT_FAILURE);
-        }
-        dup_res = dup2(fd, 0); // Redirect to stdin
-        if (dup_res == -1)
-        {
-            // Error using dup2; print error and exit
-            fprintf(stderr, "cannot redirect input to file %s\n", file);
-            exit(EXIT_FAILURE);
-        }
+        if (*p == '(')
+            depth++;
+        else if (*p == ')' && --depth == 0)
+            return p;
     }
-    else // Output redirect
+    return NULL;
+}
+
+/**
+ * Run a $(...) command line in the forked child, returning its exit value
+ */
+static int run_subshell(char *text)
+{
+    // Start over as a plain batch shell: no job control, capture or tracing of our own
+    job_control = false;
+    interactive = false;
+    capture = (struct capture){0};
+    trace.fd = -1;
+    sigprocmask(SIG_SETMASK, &child_sigmask, NULL); // So bg_init() records the right mask again
+
+    struct pipeline pl = {0};
+    struct arena mem = {0};
+    struct node *script;
+    if (!parse_line(text, NULL, true, &pl, &mem, &script)) // Any "$(...)" nested in it is expanded here
     {
-        // Open the file only for writing; create if doesn't exit; truncate if it does
-        fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-        if (fd == -1)
-        {
-            // Error opening file; print error and exit
-            fprintf(stderr, "cannot open file %s for output\n", file);
-            exit(EXIT_FAILURE);
-        }
-        dup_res = dup2(fd, 1);
-        if (dup_res == -1)
-        {
-            // Error using dup2; print error and exit
-            fprintf(stderr, "cannot redirect output to file %s\n", file);
-            exit(EXIT_FAILURE);
-        }
+        fprintf(stderr, "syntax error\n");
+        return 2;
     }
-    close(fd); // Close the file
+    if (script == NULL && pl.ncmds == 0) // Empty or only a comment
+        return 0;
+
+    struct sigaction sa_SIGINT = {0};
+    sa_SIGINT.sa_handler = SIG_IGN;
+    sigfillset(&sa_SIGINT.sa_mask);
+    struct background bg = {0};
+    bg_init(&bg);
+    int lastExit = 0;
+    if (script != NULL)
+        run_script(script, &pl, &lastExit, sa_SIGINT, &bg);
+    else
+        exec_cmd(&pl, &lastExit, sa_SIGINT, &bg);
+    fflush(stdout);
+    return WIFEXITED(lastExit) ? WEXITSTATUS(lastExit) : 128 + WTERMSIG(lastExit);
 }
 
-struct background run_bg_census(struct background bg, int lastExit)
+/**
+ * Run the commands of a "$(...)" and return everything they write to stdout, with
+ * trailing newlines removed
+ *
+ * The output is read straight into one buffer that doubles as it fills, so it is
+ * copied once however big it gets; the buffer is a large block of the arena and is
+ * split into words in place.
+ */
+static char *run_subst(struct arena *mem, char *text, size_t *len)
 {
-    pid_t pid;
-    struct background still_running = {}; // Struct to hold info about all of the still-running processes
-    for (int i = 0; i < bg.size; i++)     // Walk through all of the processes that were running in the background after the last command
+    size_t cap = LINE_CHUNK_SIZE;
+    struct arena_chunk *buf = malloc(sizeof(struct arena_chunk) + cap + 1);
+    if (buf == NULL)
+    {
+        fprintf(stderr, "out of resources\n");
+        exit(EXIT_FAILURE);
+    }
+    (*buf).size = cap;
+    (*buf).used = 0;
+    (*buf).next = (*mem).large;
+    (*mem).large = buf;
+
+    int fds[2];
+    if (parse_only || pipe2(fds, O_CLOEXEC) == -1) // Nothing is run when only checking syntax
+    {
+        if (!parse_only)
+            perror("pipe");
+        *len = 0;
+        (*buf).data[0] = '\0';
+        return (*buf).data;
+    }
+
+    fflush(stdout); // Don't let the child write out our buffered output too
+    pid_t pid = fork();
+    if (pid == 0)
     {
-        pid = waitpid(bg.pids[i], &lastExit, WNOHANG); // Check on it
-        if (pid > 0)                                   // The process has finished
+        dup2(fds[1], STDOUT_FILENO); // The copy loses O_CLOEXEC, the originals don't
+        exit(run_subshell(text));
+    }
+    close(fds[1]);
+    if (pid == -1)
+        perror("fork");
+
+    while (pid != -1)
+    {
+        if ((*buf).used == (*buf).size) // Full, double it
         {
-            // Print a message about the process finishing
-            printf("background pid %d is done: ", pid);
-            smallsh_status(lastExit);
+            struct arena_chunk *bigger = realloc(buf, sizeof(struct arena_chunk) + (*buf).size * 2 + 1);
+            if (bigger == NULL)
+            {
+                fprintf(stderr, "out of resources\n");
+                exit(EXIT_FAILURE);
+            }
+            buf = (*mem).large = bigger;
+            (*buf).size *= 2;
         }
-        else if (pid == 0)                                         // The process is still running
-            still_running.pids[still_running.size++] = bg.pids[i]; // Store its PID in the new background struct
+        ssize_t n = read(fds[0], (*buf).data + (*buf).used, (*buf).size - (*buf).used);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        (*buf).used += n;
     }
-    fflush(stdout);
-    return still_running; // Return the new background struct, with only info about still-running background processes
+    close(fds[0]);
+
+    int status;
+    if (pid != -1)
+        reap_child(pid, &status, 0);
+
+    while ((*buf).used > 0 && (*buf).data[(*buf).used - 1] == '\n')
+        (*buf).used--;
+    (*buf).data[(*buf).used] = '\0';
+    *len = (*buf).used;
+    return (*buf).data;
 }
 
-void kill_zombies(struct background bg)
+/**
+ * Append b to the word being built (NULL if none yet) as a new arena string
+ */
+static char *word_join(struct arena *mem, char *a, size_t alen, const char *b, size_t blen)
 {
-    pid_t pid;
-    int exitVal;
-    for (int i = 0; i < bg.size; i++) // Walk through all processes that were running in background after last command
+    char *word = arena_alloc(mem, alen + blen + 1);
+    if (alen > 0)
+        memcpy(word, a, alen);
+    memcpy(word + alen, b, blen);
+    word[alen + blen] = '\0';
+    return word;
+}
+
+/**
+ * Whether a word has any glob characters; a "[" needs a "]" after it to count
+ */
+static bool has_glob(const char *s)
+{
+    for (; *s != '\0'; s++)
+        if (*s == '*' || *s == '?' || (*s == '[' && strchr(s + 1, ']') != NULL))
+            return true;
+    return false;
+}
+
+/**
+ * qsort() comparator for glob matches: the keys first, the paths only when they tie
+ */
+static int glob_match_cmp(const void *a, const void *b)
+{
+    const struct glob_match *x = a, *y = b;
+    if ((*x).key != (*y).key)
+        return (*x).key < (*y).key ? -1 : 1;
+    return strcmp((*x).path, (*y).path);
+}
+
+/**
+ * Sort paths the way strcmp() orders them
+ *
+ * Comparing the first 8 bytes as one integer settles most comparisons without
+ * following the pointers, which matters for the tens of thousands of paths a
+ * large directory can match.
+ */
+static void glob_sort(char **paths, int n)
+{
+    struct glob_match *m = malloc(sizeof(struct glob_match) * n);
+    for (int i = 0; i < n; i++)
+    {
+        uint64_t key = 0;
+        for (int b = 0; b < 8 && paths[i][b] != '\0'; b++)
+            key |= (uint64_t)(unsigned char)paths[i][b] << (56 - 8 * b);
+        m[i] = (struct glob_match){key, paths[i]};
+    }
+    qsort(m, n, sizeof(struct glob_match), glob_match_cmp);
+    for (int i = 0; i < n; i++)
+        paths[i] = m[i].path;
+    free(m);
+}
+
+/**
+ * Find a directory in the line's cache, listing it the first time it is asked for
+ *
+ * The entries are read with getdents64 in GLOB_DENTS_BUF batches, and each batch is
+ * copied into the arena whole so the names need no copying of their own. Returns
+ * NULL if the directory can't be opened.
+ */
+static struct dir_listing *glob_list_dir(struct arena *mem, struct dir_listing **dirs, const char *path)
+{
+    for (struct dir_listing *l = *dirs; l != NULL; l = (*l).next)
+        if (strmatch((*l).path, path))
+            return l;
+
+    int fd = open(*path != '\0' ? path : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1)
+        return NULL;
+
+    static char buf[GLOB_DENTS_BUF];
+    struct dir_entry *entries = NULL;
+    int count = 0, cap = 0;
+    long n;
+    while ((n = syscall(SYS_getdents64, fd, buf, sizeof(buf))) > 0)
+    {
+        char *batch = arena_alloc(mem, n);
+        memcpy(batch, buf, n);
+        for (long off = 0; off < n;)
+        {
+            struct linux_dirent64 *d = (struct linux_dirent64 *)(batch + off);
+            off += (*d).d_reclen;
+            char *name = (*d).d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+                continue;
+            if (count == cap) // Double the array; it is copied into the arena once complete
+            {
+                cap = cap ? cap * 2 : 64;
+                entries = realloc(entries, sizeof(struct dir_entry) * cap);
+            }
+            entries[count++] = (struct dir_entry){name, (*d).d_type};
+        }
+    }
+    close(fd);
+
+    struct dir_listing *l = arena_alloc(mem, sizeof(struct dir_listing));
+    (*l).path = arena_strdup(mem, path);
+    (*l).count = count;
+    (*l).entries = NULL;
+    if (count > 0)
+    {
+        (*l).entries = arena_alloc(mem, sizeof(struct dir_entry) * count);
+        memcpy((*l).entries, entries, sizeof(struct dir_entry) * count);
+    }
+    free(entries);
+    (*l).next = *dirs;
+    *dirs = l;
+    return l;
+}
+
+/**
+ * Whether a directory entry is a directory, following a symbolic link to one
+ */
+static bool glob_is_dir(struct arena *mem, const char *dir, struct dir_entry *e)
+{
+    if ((*e).type == DT_DIR)
+        return true;
+    if ((*e).type != DT_LNK && (*e).type != DT_UNKNOWN) // The file system already said what it is
+        return false;
+    struct stat st;
+    char *path = word_join(mem, (char *)dir, strlen(dir), (*e).name, strlen((*e).name));
+    return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+/**
+ * Add the paths under dir matching pattern, one path component at a time
+ *
+ * dir is the path matched so far: "" or ending in '/'. Components with no glob
+ * characters aren't listed, only checked to exist once the whole path is known.
+ */
+static void glob_walk(struct arena *mem, struct dir_listing **dirs, struct command *cmd, const char *dir, const char *pattern)
+{
+    const char *slash = strchr(pattern, '/');
+    size_t len = slash != NULL ? (size_t)(slash - pattern) : strlen(pattern);
+    const char *next = slash;
+    while (next != NULL && *next == '/') // Doubled slashes are one separator
+        next++;
+    char comp[len + 1];
+    memcpy(comp, pattern, len);
+    comp[len] = '\0';
+    size_t dirLen = strlen(dir);
+    struct stat st;
+
+    if (!has_glob(comp))
+    {
+        char *path = word_join(mem, (char *)dir, dirLen, comp, len);
+        if (slash == NULL)
+        {
+            if (lstat(path, &st) == 0)
+                add_arg(mem, cmd, path);
+        }
+        else if (*next == '\0') // A trailing '/' only matches a directory
+        {
+            if (stat(path, &st) == 0 && S_ISDIR(st.st_mode))
+                add_arg(mem, cmd, word_join(mem, path, dirLen + len, "/", 1));
+        }
+        else
+            glob_walk(mem, dirs, cmd, word_join(mem, path, dirLen + len, "/", 1), next);
+        return;
+    }
+
+    struct dir_listing *l = glob_list_dir(mem, dirs, dir);
+    if (l == NULL)
+        return;
+
+    // The literal text before the first wildcard and after the last '*' rules most
+    // names out without calling fnmatch()
+    size_t prefixLen = strcspn(comp, "*?[\\");
+    const char *star = strrchr(comp, '*');
+    const char *suffix = star != NULL && strpbrk(star + 1, "?[\\") == NULL ? star + 1 : "";
+    size_t suffixLen = strlen(suffix);
+
+    for (int i = 0; i < (*l).count; i++)
+    {
+        struct dir_entry *e = &(*l).entries[i];
+        const char *name = (*e).name;
+        if (strncmp(name, comp, prefixLen) != 0)
+            continue;
+        size_t nameLen = strlen(name);
+        if (nameLen < prefixLen + suffixLen || memcmp(name + nameLen - suffixLen, suffix, suffixLen) != 0)
+            continue;
+        if (fnmatch(comp, name, FNM_PERIOD) != 0)
+            continue;
+
+        char *path = word_join(mem, (char *)dir, dirLen, name, nameLen);
+        if (slash == NULL)
+            add_arg(mem, cmd, path);
+        else if (glob_is_dir(mem, dir, e))
+        {
+            path = word_join(mem, path, dirLen + nameLen, "/", 1);
+            if (*next == '\0')
+                add_arg(mem, cmd, path);
+            else
+                glob_walk(mem, dirs, cmd, path, next);
+        }
+    }
+}
+
+int glob_expand(struct arena *mem, struct dir_listing **dirs, struct command *cmd, char *pattern)
+{
+    int first = (*cmd).nargs;
+    if (has_glob(pattern))
+    {
+        const char *rest = pattern;
+        while (*rest == '/')
+            rest++;
+        glob_walk(mem, dirs, cmd, rest > pattern ? "/" : "", rest);
+    }
+
+    int n = (*cmd).nargs - first;
+    if (n == 0) // No match, the word stays as it is
+        add_arg(mem, cmd, pattern);
+    else if (n > 1) // Listings are in directory order
+        glob_sort((*cmd).args + first, n);
+    return n;
+}
+
+/**
+ * Add a finished word as an argument, or as the file name a redirect is waiting for
+ */
+static void subst_word(struct arena *mem, struct command *cmd, char ***file, int *nfile, char *word)
+{
+    if (*file == NULL)
+        add_arg(mem, cmd, word);
+    else if ((*nfile)++ == 0)
+        **file = word;
+}
+
+/**
+ * Expand a token containing "$(...)": literal text (with variables expanded) joins on to the
+ * first and last words of the output, and the output is split at spaces, tabs and newlines
+ *
+ * Words coming from nothing but the output point into the output buffer, so big outputs
+ * are never copied again. As a redirect's file name the token must give exactly one word.
+ */
+static bool expand_subst(struct arena *mem, struct command *cmd, char *token, char ***file, const char *pid_str)
+{
+    char *word = NULL; // Word being built, not finished until a separator or the end
+    size_t wordLen = 0;
+    int nfile = 0;
+
+    char *p = token;
+    while (*p != '\0')
+    {
+        // Literal text up to the next "$(", expanding "$$" and variables
+        char *lit = p;
+        bool hasDollar = false;
+        while (*p != '\0' && !(p[0] == '$' && p[1] == '('))
+        {
+            if (p[0] == '$')
+            {
+                hasDollar = true;
+                if (p[1] == '$') // Not the start of a "$("
+                    p++;
+            }
+            p++;
+        }
+        if (p > lit)
+        {
+            size_t n = p - lit;
+            char save = *p;
+            *p = '\0';
+            if (hasDollar)
+            {
+                lit = expand_vars(mem, lit, pid_str);
+                n = strlen(lit);
+            }
+            if (n > 0)
+            {
+                word = word_join(mem, word, wordLen, lit, n);
+                wordLen += n;
+            }
+            *p = save;
+        }
+        if (*p == '\0')
+            break;
+
+        // The substitution; the lexer already checked its ")" is there
+        char *close = match_paren(p + 2, p + strlen(p));
+        *close = '\0';
+        size_t outLen;
+        char *out = run_subst(mem, p + 2, &outLen);
+        *close = ')'; // The token may be a loop's, expanded again next time round
+        p = close + 1;
+
+        char *q = out;
+        char *outEnd = out + outLen;
+        while (q < outEnd)
+        {
+            if (*q == ' ' || *q == '\t' || *q == '\n') // A separator finishes the current word
+            {
+                if (word != NULL)
+                    subst_word(mem, cmd, file, &nfile, word);
+                word = NULL;
+                wordLen = 0;
+                q++;
+                continue;
+            }
+            char *start = q;
+            while (q < outEnd && *q != ' ' && *q != '\t' && *q != '\n')
+                q++;
+            size_t n = q - start;
+            if (word != NULL) // Literal text before it
+            {
+                word = word_join(mem, word, wordLen, start, n);
+                wordLen += n;
+            }
+            else // Used where it lies, terminated by overwriting the separator
+            {
+                word = start;
+                wordLen = n;
+            }
+            if (q < outEnd)
+            {
+                *q++ = '\0';
+                subst_word(mem, cmd, file, &nfile, word);
+                word = NULL;
+                wordLen = 0;
+            }
+        }
+    }
+    if (word != NULL)
+        subst_word(mem, cmd, file, &nfile, word);
+
+    if (*file != NULL) // Ambiguous, or empty, file name
+    {
+        if (parse_only && nfile == 0) // Nothing was run to give one
+            **file = "";
+        else if (nfile != 1)
+            return false;
+        *file = NULL;
+    }
+    return true;
+}
+
+/**
+ * The PID "$$" expands to, as text; formatted once rather than for every line
+ */
+static const char *shell_pid_text(void)
+{
+    static char text[MAX_PID_LEN + 1];
+    if (shell_pid == 0)
+    {
+        shell_pid = getpid();
+        snprintf(text, sizeof(text), "%d", shell_pid);
+    }
+    return text;
+}
+
+/**
+ * Split a command line into words in place, noting what each needs expanded
+ *
+ * Like strtok, the delimiter after each word is overwritten with '\0', so no word is
+ * copied. ';' only separates commands when semis is set. Returns the number of words,
+ * or -1 for a "$(" with no ")".
+ */
+static int lex_words(char *line, struct arena *mem, struct word **words, bool semis)
+{
+    char *p = line;
+    char *end = line + strlen(line);
+    int nwords = 0, cap = 0;
+    *words = NULL;
+
+    while (true)
+    {
+        // Skip delimiters to the start of the next word
+        while (p < end && byte_class[(unsigned char)*p] == BYTE_DELIM)
+            p++;
+        if (p == end)
+            break;
+
+        // Find the end of the word, noting any "$$", variable or "$(...)" on the way
+        char *token = p;
+        unsigned flags = 0;
+        while (true)
+        {
+            p = (char *)scan_special(p, end);
+            if (p == end || byte_class[(unsigned char)*p] == BYTE_DELIM || (semis && *p == ';'))
+                break;
+            if (p[0] == '$' && p + 1 < end && p[1] == '$')
+            {
+                flags |= WORD_PID;
+                p += 2;
+            }
+            else if (p[0] == '$' && p + 1 < end && (var_name_start(p[1]) || p[1] == '{' || p[1] == '?' || p[1] == '!'))
+            {
+                flags |= WORD_VAR;
+                p++;
+            }
+            else if (p[0] == '$' && p + 1 < end && p[1] == '(') // Spaces inside are part of the word
+            {
+                char *close = match_paren(p + 2, end);
+                if (close == NULL) // No ")" to end it
+                    return -1;
+                flags |= WORD_SUBST;
+                p = close + 1;
+            }
+            else
+            {
+                if (byte_class[(unsigned char)*p] == BYTE_GLOB)
+                    flags |= WORD_GLOB;
+                p++; // Other operator characters only mean something as whole words
+            }
+        }
+        bool semi = semis && p < end && *p == ';'; // Ends the word it is stuck to as well
+        size_t len = p - token;
+        if (p < end)
+            p++;
+        token[len] = '\0';
+
+        // A comment runs to the end of the line, when it starts a command
+        if (token[0] == '#' && (nwords == 0 || ((*words)[nwords - 1].flags & WORD_SEMI)))
+            break;
+
+        for (int i = len > 0 ? 0 : 1; i < 1 + semi; i++)
+        {
+            if (nwords == cap) // Double the array; the old one stays in the arena until the next reset
+            {
+                cap = cap ? cap * 2 : 16;
+                struct word *grown = arena_alloc(mem, sizeof(struct word) * cap);
+                if (nwords > 0)
+                    memcpy(grown, *words, sizeof(struct word) * nwords);
+                *words = grown;
+            }
+            if (i == 0)
+                (*words)[nwords++] = (struct word){token, flags};
+            else
+                (*words)[nwords++] = (struct word){";", WORD_SEMI};
+        }
+    }
+    return nwords;
+}
+
+/**
+ * Recognize a redirect operator word: [N]<, [N]>, [N]>>, [N]>&M, [N]<&M, &>, &>>,
+ * [N]<<, [N]<<- or [N]<<<.
+ * Adds its redirects to cmd and returns 1 if a file name has to follow, 0 if not,
+ * or -1 if the word isn't a redirect.
+ */
+static int parse_redirect(struct arena *mem, struct command *cmd, const char *t)
+{
+    if (t[0] == '&' && t[1] == '>') // Both stdout and stderr
+    {
+        enum redirect_type type = t[2] == '\0' ? REDIR_OUT : REDIR_APPEND;
+        if (type == REDIR_APPEND && (t[2] != '>' || t[3] != '\0'))
+            return -1;
+        add_redirect(mem, cmd, type, STDOUT_FILENO, NULL, -1);
+        add_redirect(mem, cmd, REDIR_DUP, STDERR_FILENO, NULL, STDOUT_FILENO);
+        return 1;
+    }
+
+    int fd = -1;
+    if (*t >= '0' && *t <= '9' && (t[1] == '<' || t[1] == '>')) // Single digits only, so "10>" is a word
+        fd = *t++ - '0';
+    enum redirect_type type;
+    if (t[0] == '<' && t[1] == '<' && t[2] == '<')
+        type = REDIR_HERESTR, t += 2;
+    else if (t[0] == '<' && t[1] == '<')
+        type = REDIR_HEREDOC, t += 1 + (t[2] == '-'); // The tabs "<<-" strips are gone already
+    else if (t[0] == '<')
+        type = REDIR_IN;
+    else if (t[0] == '>' && t[1] == '>')
+        type = REDIR_APPEND, t++;
+    else if (t[0] == '>')
+        type = REDIR_OUT;
+    else
+        return -1;
+    if (fd == -1)
+        fd = type == REDIR_OUT || type == REDIR_APPEND ? STDOUT_FILENO : STDIN_FILENO;
+    t++;
+
+    if (*t == '\0')
+    {
+        add_redirect(mem, cmd, type, fd, NULL, -1);
+        return 1;
+    }
+    if ((type == REDIR_IN || type == REDIR_OUT) && t[0] == '&' && t[1] >= '0' && t[1] <= '9' && t[2] == '\0')
+    {
+        add_redirect(mem, cmd, REDIR_DUP, fd, NULL, t[1] - '0');
+        return 0;
+    }
+    return -1;
+}
+
+/**
+ * Expand the words of one pipeline into the stages of pl, the way parse_command() does
+ */
+static bool build_pipeline(struct word *words, int nwords, struct pipeline *pl)
+{
+    struct arena *mem = &(*pl).mem;
+
+    const char *pid_str = shell_pid_text();
+
+    // Start the first stage
+    struct command *cmd = add_stage(pl);
+
+    char **file = NULL; // Redirect waiting for its file name
+    bool body = false;  // That redirect is a here-document, so its "file" is the body
+    bool syntaxError = false;
+
+    for (int i = 0; i < nwords && !syntaxError; i++)
+    {
+        char *token = words[i].text;
+        unsigned flags = words[i].flags;
+
+        if (flags & WORD_SEMI) // Only a list of commands can have these
+        {
+            syntaxError = true;
+            break;
+        }
+
+        if (flags & WORD_SUBST) // Run the commands and split their output into words
+        {
+            if (!expand_subst(mem, cmd, token, &file, pid_str))
+                syntaxError = true;
+            continue;
+        }
+
+        if (flags & WORD_VAR) // Replace the variables, and any "$$" with them
+        {
+            token = expand_vars(mem, token, pid_str);
+            if (*token == '\0' && file == NULL) // Unset variables alone make no argument at all
+                continue;
+        }
+        else if (flags & WORD_PID) // Replace all instances of "$$" with the PID
+        {
+            // Allocate enough space for a token with only '$' characters
+            size_t len = strlen(token);
+            char *expanded = arena_alloc(mem, len + (len / 2 + 1) * strlen(pid_str) + 1);
+            expand_pid(expanded, token, (char *)pid_str);
+            token = expanded;
+        }
+
+        if (file != NULL) // This token is the file name for the preceding redirect
+        {
+            if (body != ((flags & WORD_BODY) != 0)) // The body was never read, e.g. with no lines to read it from
+                syntaxError = true;
+            *file = token;
+            file = NULL;
+            continue;
+        }
+
+        unsigned char class = flags == 0 && token[1] == '\0' ? byte_class[(unsigned char)token[0]] : BYTE_WORD;
+        int redirect = flags == 0 && class != BYTE_PIPE ? parse_redirect(mem, cmd, token) : -1;
+        if (redirect == 1) // The next word names the file; for "&>" that's the redirect before the dup
+        {
+            int last = (*cmd).nredirs - 1;
+            if ((*cmd).redirs[last].type == REDIR_DUP)
+                last--;
+            file = &(*cmd).redirs[last].file;
+            body = (*cmd).redirs[last].type == REDIR_HEREDOC;
+        }
+        else if (redirect == 0) // Complete in itself
+            continue;
+        else if (class == BYTE_PIPE) // End of this stage, start the next one
+        {
+            if ((*cmd).nargs == 0) // Nothing before the "|"
+                syntaxError = true;
+            else
+                cmd = add_stage(pl);
+        }
+        else if ((flags & WORD_GLOB) && !parse_only) // Replace a pattern with the paths it matches
+            glob_expand(mem, &(*pl).dirs, cmd, token);
+        else // Not a redirect or pipe character
+            add_arg(mem, cmd, token);
+    }
+
+    // Check if the last argument is the background character
+    if ((*cmd).nargs > 1 && strmatch((*cmd).args[(*cmd).nargs - 1], "&"))
+    {
+        if (allow_bg)               // Not in foreground-only mode
+            (*pl).run_in_bg = true; // Indicate the pipeline should run in the background
+
+        // Remove the character
+        (*cmd).nargs--;
+        (*cmd).args[(*cmd).nargs] = NULL;
+    }
+
+    // A redirect with no file, or a trailing "|" leaving an empty last stage
+    if (file != NULL || ((*cmd).nargs == 0 && (*pl).ncmds > 1))
+        syntaxError = true;
+
+    if (syntaxError || (*cmd).nargs == 0) // Nothing to run for an error, empty line or comment
+    {
+        reset_pipeline(pl);
+        return !syntaxError;
+    }
+
+    for (int i = 0; i < (*pl).ncmds; i++) // Every stage shares the pipeline's background setting
+        (*pl).cmds[i].run_in_bg = (*pl).run_in_bg;
+    return true;
+}
+
+/**
+ * Whether a word is the keyword kw; only words with nothing to expand can be one
+ */
+static bool is_keyword(struct word *w, const char *kw)
+{
+    return (*w).flags == 0 && strmatch((*w).text, kw);
+}
+
+// Words that are only special at the start of a command
+static const char *const keywords[] = {"for", "while", "if", "do", "done", "then", "elif", "else", "fi", NULL};
+
+/**
+ * Whether a line starts with for, while or if
+ *
+ * Only then (and on the following lines of the block) does ";" separate commands.
+ * Elsewhere it stays an ordinary character, as in the original grammar, which
+ * the assignment's test script relies on ("echo ...; cat junk2 (10 points ...)").
+ */
+static bool opens_block(const char *line)
+{
+    static const char *const openers[] = {"for", "while", "if", NULL};
+    while (byte_class[(unsigned char)*line] == BYTE_DELIM)
+        line++;
+    for (int k = 0; openers[k] != NULL; k++)
+    {
+        size_t n = strlen(openers[k]);
+        if (strncmp(line, openers[k], n) == 0 && (line[n] == '\0' || line[n] == ';' || byte_class[(unsigned char)line[n]] == BYTE_DELIM))
+            return true;
+    }
+    return false;
+}
+
+/**
+ * Whether the words are more than a single pipeline: a block, or a list with ";"
+ */
+static bool is_script(struct word *words, int nwords)
+{
+    for (int i = 0; i < nwords; i++)
+        if (words[i].flags & WORD_SEMI)
+            return true;
+    if (nwords == 0 || strchr("fwidte", words[0].text[0]) == NULL) // Can't be a keyword
+        return false;
+    for (int k = 0; keywords[k] != NULL; k++)
+        if (is_keyword(&words[0], keywords[k]))
+            return true;
+    return false;
+}
+
+/**
+ * The flags a here-document body needs for its "$$" and variables to be expanded
+ */
+static unsigned body_flags(const char *body)
+{
+    unsigned flags = 0;
+    for (const char *p = strchr(body, '$'); p != NULL; p = strchr(p + 1, '$'))
+    {
+        if (p[1] == '$')
+            flags |= WORD_PID, p++;
+        else if (var_name_start(p[1]) || p[1] == '{' || p[1] == '?' || p[1] == '!')
+            flags |= WORD_VAR;
+    }
+    return flags;
+}
+
+/**
+ * Read the bodies of a line's here-documents from src, in the order their "<<" come
+ *
+ * Each body replaces the delimiter word after its "<<". Quoting the delimiter ('EOF'
+ * or "EOF") keeps "$" in the body as it is; "<<-" strips the leading tabs of every
+ * line. The line's words are copied into mem first, since reading on can move the
+ * buffer they point into. Returns false if there is nowhere to read from, or the
+ * input ends before a delimiter.
+ */
+static bool read_heredocs(struct word *words, int nwords, struct line_source *src, struct arena *mem)
+{
+    bool copied = false;
+    for (int i = 0; i + 1 < nwords; i++)
+    {
+        const char *op = words[i].text;
+        if (*op >= '0' && *op <= '9')
+            op++;
+        if (words[i].flags != 0 || op[0] != '<' || op[1] != '<' || (op[2] != '\0' && !(op[2] == '-' && op[3] == '\0')))
+            continue;
+        if (src == NULL)
+            return false;
+        if (!copied)
+        {
+            for (int j = 0; j < nwords; j++)
+                words[j].text = arena_strdup(mem, words[j].text);
+            copied = true;
+        }
+
+        struct word *delim = &words[++i];
+        char *end = (*delim).text;
+        size_t endLen = strlen(end);
+        bool quoted = endLen >= 2 && (end[0] == '\'' || end[0] == '"') && end[endLen - 1] == end[0];
+        if (quoted)
+        {
+            end[endLen - 1] = '\0';
+            end++;
+        }
+
+        char *text = NULL;
+        size_t len = 0, cap = 0;
+        while (true)
+        {
+            if (interactive)
+            {
+                printf("> ");
+                fflush(stdout);
+            }
+            char *line = read_command(src);
+            if (line == NULL) // No delimiter before the end of input
+            {
+                free(text);
+                return false;
+            }
+            if (op[2] == '-')
+                line += strspn(line, "\t");
+            if (strmatch(line, end))
+                break;
+            size_t n = strlen(line);
+            if (len + n + 2 > cap) // Room for the line, its newline and the final '\0'
+            {
+                cap = (len + n + 2) * 2;
+                text = realloc(text, cap);
+            }
+            memcpy(text + len, line, n);
+            len += n;
+            text[len++] = '\n';
+        }
+        char *bodyText = arena_alloc(mem, len + 1);
+        if (len > 0)
+            memcpy(bodyText, text, len);
+        bodyText[len] = '\0';
+        free(text);
+        *delim = (struct word){bodyText, WORD_BODY | (quoted ? 0 : body_flags(bodyText))};
+    }
+    return true;
+}
+
+bool parse_command(char *cmd_str, struct pipeline *pl)
+{
+    struct word *words;
+    int nwords = lex_words(cmd_str, &(*pl).mem, &words, false);
+    if (nwords == -1 || is_script(words, nwords))
+    {
+        reset_pipeline(pl);
+        return false;
+    }
+    return build_pipeline(words, nwords, pl);
+}
+
+/**
+ * The word the script parser is looking at, or NULL at the end of the line
+ */
+static struct word *sp_peek(struct script_parser *sp)
+{
+    return (*sp).pos < (*sp).nwords ? &(*sp).words[(*sp).pos] : NULL;
+}
+
+/**
+ * Move on to the next line of a block that isn't finished, returning false if there is none
+ */
+static bool sp_next_line(struct script_parser *sp)
+{
+    if ((*sp).src == NULL)
+        return false;
+    if (interactive)
+    {
+        printf("> ");
+        fflush(stdout);
+    }
+    char *line = read_command((*sp).src);
+    if (line == NULL)
+        return false;
+    if (interactive)
+        history_add(line);
+    (*sp).nwords = lex_words(line, (*sp).mem, &(*sp).words, true);
+    (*sp).pos = 0;
+    return (*sp).nwords != -1 && read_heredocs((*sp).words, (*sp).nwords, (*sp).src, (*sp).mem);
+}
+
+/**
+ * Skip ";" and line ends up to the next word, reading more lines as needed; NULL if input ends
+ */
+static struct word *sp_skip(struct script_parser *sp)
+{
+    while (true)
+    {
+        struct word *w = sp_peek(sp);
+        if (w != NULL && !((*w).flags & WORD_SEMI))
+            return w;
+        if (w != NULL)
+            (*sp).pos++;
+        else if (!sp_next_line(sp))
+            return NULL;
+    }
+}
+
+/**
+ * Consume the keyword kw, which has to come next (perhaps on a later line)
+ */
+static bool sp_expect(struct script_parser *sp, const char *kw)
+{
+    struct word *w = sp_skip(sp);
+    if (w == NULL || !is_keyword(w, kw))
+        return false;
+    (*sp).pos++;
+    return true;
+}
+
+/**
+ * A new node, in the arena the script is parsed into
+ */
+static struct node *sp_node(struct script_parser *sp, enum node_type type)
+{
+    struct node *n = arena_alloc((*sp).mem, sizeof(struct node));
+    *n = (struct node){.type = type};
+    return n;
+}
+
+/**
+ * Copy the words up to the next ";" (or "&", for a command) into the script's arena, as
+ * the words of n; the text has to be copied because the line buffer is reused
+ */
+static void sp_words(struct script_parser *sp, struct node *n, bool command)
+{
+    int start = (*sp).pos;
+    while ((*sp).pos < (*sp).nwords && !((*sp).words[(*sp).pos].flags & WORD_SEMI))
+    {
+        struct word *w = &(*sp).words[(*sp).pos++];
+        if (command && (*w).flags == 0 && strmatch((*w).text, "&")) // Runs in the background, and ends it
+            break;
+    }
+    (*n).nwords = (*sp).pos - start;
+    (*n).words = arena_alloc((*sp).mem, sizeof(struct word) * ((*n).nwords + 1));
+    for (int i = 0; i < (*n).nwords; i++)
+    {
+        struct word *w = &(*sp).words[start + i];
+        (*n).words[i] = (struct word){arena_strdup((*sp).mem, (*w).text), (*w).flags};
+    }
+}
+
+static struct node *sp_list(struct script_parser *sp, const char *const *terms);
+
+/**
+ * Whether a finished block is followed by something that may follow it
+ */
+static bool sp_block_end(struct script_parser *sp)
+{
+    struct word *w = sp_peek(sp);
+    return w == NULL || ((*w).flags & WORD_SEMI);
+}
+
+/**
+ * Parse "if"/"elif" COND; then LIST [elif ...] [else LIST] fi
+ */
+static struct node *sp_if(struct script_parser *sp)
+{
+    static const char *const thenTerms[] = {"then", NULL};
+    static const char *const bodyTerms[] = {"elif", "else", "fi", NULL};
+    static const char *const elseTerms[] = {"fi", NULL};
+
+    struct node *n = sp_node(sp, NODE_IF);
+    (*sp).pos++; // "if" or "elif"
+    if (((*n).cond = sp_list(sp, thenTerms)) == NULL || !sp_expect(sp, "then"))
+        return NULL;
+    if (((*n).body = sp_list(sp, bodyTerms)) == NULL)
+        return NULL;
+
+    struct word *w = sp_skip(sp);
+    if (w != NULL && is_keyword(w, "elif")) // The rest is an "if" of its own, which takes the "fi"
+        return ((*n).orelse = sp_if(sp)) != NULL ? n : NULL;
+    if (w != NULL && is_keyword(w, "else"))
+    {
+        (*sp).pos++;
+        if (((*n).orelse = sp_list(sp, elseTerms)) == NULL)
+            return NULL;
+    }
+    return sp_expect(sp, "fi") ? n : NULL;
+}
+
+/**
+ * Parse a command, or a whole block if it starts with a keyword
+ */
+static struct node *sp_item(struct script_parser *sp)
+{
+    static const char *const doTerms[] = {"do", NULL};
+    static const char *const doneTerms[] = {"done", NULL};
+    struct word *w = sp_peek(sp);
+
+    if (is_keyword(w, "for")) // for NAME in WORDS; do LIST; done
+    {
+        struct node *n = sp_node(sp, NODE_FOR);
+        (*sp).pos++;
+        w = sp_peek(sp);
+        if (w == NULL || (*w).flags != 0 || !var_valid((*w).text, strlen((*w).text)))
+            return NULL;
+        (*n).var = arena_strdup((*sp).mem, (*w).text);
+        (*sp).pos++;
+        w = sp_peek(sp);
+        if (w == NULL || !is_keyword(w, "in"))
+            return NULL;
+        (*sp).pos++;
+        sp_words(sp, n, false);
+        if (!sp_expect(sp, "do") || ((*n).body = sp_list(sp, doneTerms)) == NULL || !sp_expect(sp, "done"))
+            return NULL;
+        return sp_block_end(sp) ? n : NULL;
+    }
+    if (is_keyword(w, "while")) // while LIST; do LIST; done
+    {
+        struct node *n = sp_node(sp, NODE_WHILE);
+        (*sp).pos++;
+        if (((*n).cond = sp_list(sp, doTerms)) == NULL || !sp_expect(sp, "do"))
+            return NULL;
+        if (((*n).body = sp_list(sp, doneTerms)) == NULL || !sp_expect(sp, "done"))
+            return NULL;
+        return sp_block_end(sp) ? n : NULL;
+    }
+    if (is_keyword(w, "if"))
+    {
+        struct node *n = sp_if(sp);
+        return n != NULL && sp_block_end(sp) ? n : NULL;
+    }
+    for (int k = 0; keywords[k] != NULL; k++) // Any other keyword is out of place here
+        if (is_keyword(w, keywords[k]))
+            return NULL;
+
+    struct node *n = sp_node(sp, NODE_CMD);
+    sp_words(sp, n, true);
+    return n;
+}
+
+/**
+ * Parse commands up to one of the keywords in terms (left unconsumed), reading more
+ * lines until one turns up; with no terms, parse to the end of the current line.
+ * Returns NULL for a syntax error or an empty list.
+ */
+static struct node *sp_list(struct script_parser *sp, const char *const *terms)
+{
+    struct node *head = NULL;
+    struct node **tail = &head;
+    while (true)
+    {
+        struct word *w;
+        if (terms == NULL) // Top level: stop at the end of the line
+        {
+            while ((w = sp_peek(sp)) != NULL && ((*w).flags & WORD_SEMI))
+                (*sp).pos++;
+            if (w == NULL)
+                return head;
+        }
+        else if ((w = sp_skip(sp)) == NULL) // Input ended inside a block
+            return NULL;
+
+        for (int t = 0; terms != NULL && terms[t] != NULL; t++)
+            if (is_keyword(w, terms[t]))
+                return head;
+
+        struct node *n = sp_item(sp);
+        if (n == NULL)
+            return NULL;
+        *tail = n;
+        tail = &(*n).next;
+    }
+}
+
+bool parse_line(char *line, struct line_source *src, bool lists, struct pipeline *pl, struct arena *mem, struct node **script)
+{
+    *script = NULL;
+    struct word *words;
+    int nwords = lex_words(line, &(*pl).mem, &words, lists || opens_block(line));
+    if (nwords == -1 || !read_heredocs(words, nwords, src, &(*pl).mem))
+    {
+        reset_pipeline(pl);
+        return false;
+    }
+    if (!is_script(words, nwords)) // A plain pipeline needs no copying at all
+        return build_pipeline(words, nwords, pl);
+
+    struct script_parser sp = {src, mem, words, nwords, 0};
+    *script = sp_list(&sp, NULL);
+    if (*script == NULL) // Syntax error; a line of just ";" is one too
+    {
+        reset_pipeline(pl);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Whether a status means the command was interrupted with Ctrl-C, which ends the whole block
+ */
+static bool interrupted(int status)
+{
+    return WIFSIGNALED(status) && WTERMSIG(status) == SIGINT;
+}
+
+// Set by Ctrl-C while a loop runs, so a body of only built-ins can be stopped too
+static volatile sig_atomic_t loop_interrupted = 0;
+
+/**
+ * SIGINT handler while a loop runs: the loop stops before its next iteration
+ */
+static void handle_loop_SIGINT(int signo)
+{
+    loop_interrupted = 1;
+}
+
+/**
+ * Catch Ctrl-C for a loop, unless an enclosing loop already does
+ *
+ * @param old where the action to put back is stored
+ * @return whether the handler was installed here, and so has to be removed by loop_release_SIGINT()
+ */
+static bool loop_catch_SIGINT(struct sigaction *old)
+{
+    if (loop_catching)
+        return false;
+    struct sigaction sa = {0};
+    sa.sa_handler = handle_loop_SIGINT;
+    sigfillset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART; // The shell's own reads and waits carry on
+    loop_interrupted = 0;
+    sigaction(SIGINT, &sa, old);
+    loop_catching = true;
+    return true;
+}
+
+/**
+ * Put back the SIGINT action loop_catch_SIGINT() replaced, if it did
+ */
+static void loop_release_SIGINT(bool caught, struct sigaction *old)
+{
+    if (!caught)
+        return;
+    sigaction(SIGINT, old, NULL);
+    loop_catching = false;
+}
+
+/**
+ * Whether a loop has to stop: its last command was interrupted, or Ctrl-C came while
+ * built-ins ran, which is then recorded in the status like a command killed by it
+ */
+static bool loop_stopped(int *lastExit)
+{
+    if (loop_interrupted)
+    {
+        *lastExit = W_EXITCODE(0, SIGINT);
+        pipe_nstatus = 0;
+    }
+    return interrupted(*lastExit);
+}
+
+bool run_script(struct node *n, struct pipeline *pl, int *lastExit, struct sigaction sa_SIGINT, struct background *bg)
+{
+    for (; n != NULL; n = (*n).next)
+    {
+        bool cont = true;
+        if ((*n).type == NODE_CMD) // Only the expansions are redone each time
+        {
+            reset_pipeline(pl);
+            if (!build_pipeline((*n).words, (*n).nwords, pl))
+            {
+                fprintf(stderr, "syntax error\n");
+                fflush(stderr);
+                *lastExit = W_EXITCODE(2, 0);
+                pipe_nstatus = 0;
+            }
+            else
+            {
+                cont = exec_cmd(pl, lastExit, sa_SIGINT, bg);
+                run_bg_census(bg);
+            }
+            vars.status = *lastExit;
+        }
+        else if ((*n).type == NODE_FOR)
+        {
+            // Expand the words once, up front, into an arena of their own: the body's
+            // commands reset the pipeline's
+            struct arena itemMem = {0};
+            struct dir_listing *itemDirs = NULL;
+            struct command items;
+            reset_command(&items);
+            char **file = NULL;
+            const char *pid_str = shell_pid_text();
+            for (int i = 0; i < (*n).nwords; i++)
+            {
+                struct word *w = &(*n).words[i];
+                if ((*w).flags & WORD_SUBST)
+                    expand_subst(&itemMem, &items, (*w).text, &file, pid_str);
+                else if ((*w).flags & (WORD_VAR | WORD_PID))
+                {
+                    char *item = expand_vars(&itemMem, (*w).text, pid_str);
+                    if (*item != '\0')
+                        add_arg(&itemMem, &items, item);
+                }
+                else if ((*w).flags & WORD_GLOB)
+                    glob_expand(&itemMem, &itemDirs, &items, (*w).text);
+                else
+                    add_arg(&itemMem, &items, (*w).text);
+            }
+
+            *lastExit = 0;
+            struct sigaction old;
+            bool caught = loop_catch_SIGINT(&old);
+            for (int i = 0; i < items.nargs && cont && !loop_stopped(lastExit); i++)
+            {
+                var_set((*n).var, items.args[i], false);
+                cont = run_script((*n).body, pl, lastExit, sa_SIGINT, bg);
+            }
+            loop_release_SIGINT(caught, &old);
+            arena_free(&itemMem);
+        }
+        else if ((*n).type == NODE_WHILE)
+        {
+            int bodyExit = 0;
+            struct sigaction old;
+            bool caught = loop_catch_SIGINT(&old);
+            while (true)
+            {
+                cont = run_script((*n).cond, pl, lastExit, sa_SIGINT, bg);
+                if (!cont || loop_stopped(lastExit))
+                    break;
+                if (*lastExit != 0) // The loop's status is that of the body's last command
+                {
+                    *lastExit = bodyExit;
+                    break;
+                }
+                cont = run_script((*n).body, pl, lastExit, sa_SIGINT, bg);
+                bodyExit = *lastExit;
+                if (!cont || loop_stopped(lastExit))
+                    break;
+            }
+            loop_release_SIGINT(caught, &old);
+        }
+        else // NODE_IF
+        {
+            cont = run_script((*n).cond, pl, lastExit, sa_SIGINT, bg);
+            if (cont && !interrupted(*lastExit))
+            {
+                if (*lastExit == 0)
+                    cont = run_script((*n).body, pl, lastExit, sa_SIGINT, bg);
+                else if ((*n).orelse != NULL)
+                    cont = run_script((*n).orelse, pl, lastExit, sa_SIGINT, bg);
+                else
+                    *lastExit = 0;
+            }
+        }
+
+        if (!cont) // "exit"
+            return false;
+        if (interrupted(*lastExit)) // Ctrl-C stops the rest of the block too
+            break;
+    }
+    return true;
+}
+
+bool strmatch(const char *str1, const char *str2)
+{
+    if (strcmp(str1, str2) == 0)
+        return true; // Strings match
+    return false;    // Strings don't match
+}
+
+void expand_pid(char *result, char *token, char *pid)
+{
+    char *pos = result; // The position to insert at
+    char *tmp = token; // Temp variable to store chunks of the token
+
+    while (true)
+    {
+        char *substr = strstr(tmp, "$$"); // Get the substring starting at the first occurrence of "$$"
+        if (substr != NULL)
+        {
+            // Copy over the chunk before substr
+            memcpy(pos, tmp, substr - tmp);
+            pos += substr - tmp;
+
+            // Copy over the PID value
+            memcpy(pos, pid, strlen(pid));
+            pos += strlen(pid);
+
+            tmp = substr + 2; // Move past "$$"
+        }
+        else // We've gone beyond the last instance of "$$""
+        {
+            strcpy(pos, tmp); // Copy the remaining part of the string
+            break;
+        }
+    }
+}
+
+// Adapters giving every built-in the same signature for the dispatch table.
+// Those with an external equivalent set the status like the program would.
+
+static bool builtin_exit(struct command *cmd, int *lastExit, struct sigaction sa_SIGINT, struct background *bg)
+{
+    return false; // Return false to exit the main loop
+}
+
+static bool builtin_cd(struct command *cmd, int *lastExit, struct sigaction sa_SIGINT, struct background *bg)
+{
+    return smallsh_cd((*cmd).args[1]);
+}
+
+static bool builtin_status(struct command *cmd, int *lastExit, struct sigaction sa_SIGINT, struct background *bg)
+{
+    return pipe_nstatus > 1 ? smallsh_pipestatus() : smallsh_status(*lastExit);
+}
+
+static bool builtin_hash(struct command *cmd, int *lastExit, struct sigaction sa_SIGINT, struct background *bg)
+{
+    return smallsh_hash((*cmd).args);
+}
+
+static bool builtin_echo(struct command *cmd, int *lastExit, struct sigaction sa_SIGINT, struct background *bg)
+{
+    *lastExit = W_EXITCODE(smallsh_echo((*cmd).args), 0);
+    return true;
+}
+
+static bool builtin_true(struct command *cmd, int *lastExit, struct sigaction sa_SIGINT, struct background *bg)
+{
+    *lastExit = W_EXITCODE(0, 0);
+    return true;
+}
+
+static bool builtin_false(struct command *cmd, int *lastExit, struct sigaction sa_SIGINT, struct background *bg)
+{
+    *lastExit = W_EXITCODE(1, 0);
+    return true;
+}
+
+static bool builtin_pwd(struct command *cmd, int *lastExit, struct sigaction sa_SIGINT, struct background *bg)
+{
+    *lastExit = W_EXITCODE(smallsh_pwd(), 0);
+    return true;
+}
+
+static bool builtin_test(struct command *cmd, int *lastExit, struct sigaction sa_SIGINT, struct background *bg)
+{
+    *lastExit = W_EXITCODE(smallsh_test((*cmd).args), 0);
+    return true;
+}
+
+static bool builtin_printf(struct command *cmd, int *lastExit, struct sigaction sa_SIGINT, struct background *bg)
+{
+    *lastExit = W_EXITCODE(smallsh_printf((*cmd).args), 0);
+    return true;
+}
+
+static bool builtin_jobs(struct command *cmd, int *lastExit, struct sigaction sa_SIGINT, struct background *bg)
+{
+    *lastExit = W_EXITCODE(smallsh_jobs((*cmd).args, bg), 0);
+    return true;
+}
+
+static bool builtin_fg(struct command *cmd, int *lastExit, struct sigaction sa_SIGINT, struct background *bg)
+{
+    int result = smallsh_fg((*cmd).args, bg, lastExit); // Sets lastExit itself when the job ran
+    if (result != 0)
+        *lastExit = W_EXITCODE(result, 0);
+    return true;
+}
+
+static bool builtin_bg(struct command *cmd, int *lastExit, struct sigaction sa_SIGINT, struct background *bg)
+{
+    *lastExit = W_EXITCODE(smallsh_bg((*cmd).args, bg), 0);
+    return true;
+}
+
+static bool builtin_kill(struct command *cmd, int *lastExit, struct sigaction sa_SIGINT, struct background *bg)
+{
+    *lastExit = W_EXITCODE(smallsh_kill((*cmd).args, bg), 0);
+    return true;
+}
+
+static bool builtin_joblog(struct command *cmd, int *lastExit, struct sigaction sa_SIGINT, struct background *bg)
+{
+    *lastExit = W_EXITCODE(smallsh_joblog((*cmd).args, bg), 0);
+    return true;
+}
+
+/**
+ * Whether the cat built-in can stand in for the program: no options, and not reading
+ * a terminal, where the program's job control and Ctrl-D handling are wanted
+ */
+static bool cat_in_shell(struct command *cmd)
+{
+    bool readsStdin = (*cmd).nargs == 1;
+    for (int i = 1; i < (*cmd).nargs; i++)
+    {
+        if (strmatch((*cmd).args[i], "-"))
+            readsStdin = true;
+        else if ((*cmd).args[i][0] == '-')
+            return false;
+    }
+    return !readsStdin || redirects_fd(cmd, STDIN_FILENO) || !isatty(STDIN_FILENO);
+}
+
+static bool builtin_cat(struct command *cmd, int *lastExit, struct sigaction sa_SIGINT, struct background *bg)
+{
+    int status = smallsh_cat((*cmd).args);
+    *lastExit = status == -1 ? W_EXITCODE(0, SIGINT) : W_EXITCODE(status, 0); // Like the program killed by Ctrl-C
+    return true;
+}
+
+static bool builtin_stats(struct command *cmd, int *lastExit, struct sigaction sa_SIGINT, struct background *bg)
+{
+    *lastExit = W_EXITCODE(smallsh_stats((*cmd).args), 0);
+    return true;
+}
+
+static bool builtin_set(struct command *cmd, int *lastExit, struct sigaction sa_SIGINT, struct background *bg)
+{
+    *lastExit = W_EXITCODE(smallsh_set((*cmd).args), 0);
+    return true;
+}
+
+static bool builtin_export(struct command *cmd, int *lastExit, struct sigaction sa_SIGINT, struct background *bg)
+{
+    *lastExit = W_EXITCODE(smallsh_export((*cmd).args), 0);
+    return true;
+}
+
+static bool builtin_unset(struct command *cmd, int *lastExit, struct sigaction sa_SIGINT, struct background *bg)
+{
+    *lastExit = W_EXITCODE(smallsh_unset((*cmd).args), 0);
+    return true;
+}
+
+static bool builtin_affinity(struct command *cmd, int *lastExit, struct sigaction sa_SIGINT, struct background *bg)
+{
+    *lastExit = W_EXITCODE(smallsh_affinity((*cmd).args), 0);
+    return true;
+}
+
+static bool builtin_nice(struct command *cmd, int *lastExit, struct sigaction sa_SIGINT, struct background *bg)
+{
+    *lastExit = W_EXITCODE(smallsh_nice((*cmd).args), 0);
+    return true;
+}
+
+static bool builtin_ulimit(struct command *cmd, int *lastExit, struct sigaction sa_SIGINT, struct background *bg)
+{
+    *lastExit = W_EXITCODE(smallsh_ulimit((*cmd).args), 0);
+    return true;
+}
+
+static bool builtin_history(struct command *cmd, int *lastExit, struct sigaction sa_SIGINT, struct background *bg)
+{
+    *lastExit = W_EXITCODE(smallsh_history((*cmd).args), 0);
+    return true;
+}
+
+static bool builtin_parallel(struct command *cmd, int *lastExit, struct sigaction sa_SIGINT, struct background *bg)
+{
+    *lastExit = W_EXITCODE(smallsh_parallel((*cmd).args, sa_SIGINT, bg), 0);
+    return true;
+}
+
+static bool builtin_wait(struct command *cmd, int *lastExit, struct sigaction sa_SIGINT, struct background *bg)
+{
+    *lastExit = W_EXITCODE(smallsh_wait((*cmd).args, bg), 0);
+    return true;
+}
+
+// Every built-in; "external" marks those that are also programs, which are launched
+// normally when run in the background
+static const struct builtin builtins[] = {
+    {.name = "exit", .fn = builtin_exit, .external = false},
+    {.name = "cd", .fn = builtin_cd, .external = false},
+    {.name = "status", .fn = builtin_status, .external = false},
+    {.name = "hash", .fn = builtin_hash, .external = false},
+    {.name = "echo", .fn = builtin_echo, .external = true},
+    {.name = "true", .fn = builtin_true, .external = true},
+    {.name = "false", .fn = builtin_false, .external = true},
+    {.name = "pwd", .fn = builtin_pwd, .external = true},
+    {.name = "test", .fn = builtin_test, .external = true},
+    {.name = "[", .fn = builtin_test, .external = true},
+    {.name = "printf", .fn = builtin_printf, .external = true},
+    {.name = "stats", .fn = builtin_stats, .external = false},
+    {.name = "parallel", .fn = builtin_parallel, .external = false},
+    {.name = "wait", .fn = builtin_wait, .external = false},
+    {.name = "jobs", .fn = builtin_jobs, .external = false},
+    {.name = "fg", .fn = builtin_fg, .external = false},
+    {.name = "bg", .fn = builtin_bg, .external = false},
+    {.name = "kill", .fn = builtin_kill, .external = false},
+    {.name = "joblog", .fn = builtin_joblog, .external = false},
+    {.name = "set", .fn = builtin_set, .external = false},
+    {.name = "export", .fn = builtin_export, .external = false},
+    {.name = "unset", .fn = builtin_unset, .external = false},
+    {.name = "affinity", .fn = builtin_affinity, .external = false},
+    {.name = "nice", .fn = builtin_nice, .external = false},
+    {.name = "ulimit", .fn = builtin_ulimit, .external = false},
+    {.name = "history", .fn = builtin_history, .external = false},
+    {.name = "cat", .fn = builtin_cat, .external = true, .in_shell = cat_in_shell},
+};
+
+// Perfect hash table of the built-ins, filled on first use by find_builtin()
+static const struct builtin *builtin_slots[BUILTIN_SLOTS];
+static unsigned builtin_seed = 0;
+
+/**
+ * Seeded FNV-1a hash of a command name
+ */
+static unsigned builtin_name_hash(const char *name, unsigned seed)
+{
+    unsigned h = 2166136261u ^ seed;
+    while (*name)
+    {
+        h ^= (unsigned char)*name++;
+        h *= 16777619u;
+    }
+    // Mix the high bits down: the low bits of an FNV hash only depend on the low bits
+    // of the seed, which leaves too few distinct hashes to choose from once masked
+    h ^= h >> 16;
+    h *= 0x45d9f3bu;
+    h ^= h >> 16;
+    return h;
+}
+
+const struct builtin *find_builtin(const char *name)
+{
+    // Find a seed that puts every built-in in its own slot, so a lookup is
+    // one hash and at most one string comparison
+    while (builtin_seed == 0)
+    {
+        static unsigned candidate = 0;
+        candidate++;
+        memset(builtin_slots, 0, sizeof(builtin_slots));
+        builtin_seed = candidate;
+        for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++)
+        {
+            unsigned slot = builtin_name_hash(builtins[i].name, candidate) & (BUILTIN_SLOTS - 1);
+            if (builtin_slots[slot] != NULL) // Collision, try the next seed
+            {
+                builtin_seed = 0;
+                break;
+            }
+            builtin_slots[slot] = &builtins[i];
+        }
+    }
+
+    const struct builtin *b = builtin_slots[builtin_name_hash(name, builtin_seed) & (BUILTIN_SLOTS - 1)];
+    return b != NULL && strmatch((*b).name, name) ? b : NULL;
+}
+
+/**
+ * Write all of buf to fd, retrying short writes
+ */
+static bool write_all(int fd, const char *buf, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = write(fd, buf, len);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+/**
+ * Put the body of a here-document or here-string where a command can read it
+ *
+ * A small body fits in a pipe's buffer, so it is written there without blocking;
+ * a larger one goes into a memfd. Either way nothing touches the file system.
+ */
+static int open_here(struct redirect *r)
+{
+    size_t len = strlen((*r).file);
+    size_t nl = (*r).type == REDIR_HERESTR; // A here-string gets a newline after it
+    if (len + nl <= HEREDOC_PIPE_MAX)
+    {
+        int fds[2];
+        if (pipe2(fds, O_CLOEXEC) == -1)
+            return -1;
+        struct iovec iov[2] = {{(*r).file, len}, {"\n", nl}};
+        bool ok = writev(fds[1], iov, 2) == (ssize_t)(len + nl);
+        close(fds[1]);
+        if (!ok)
+        {
+            close(fds[0]);
+            return -1;
+        }
+        return fds[0];
+    }
+
+    int fd = memfd_create("smallsh-here", MFD_CLOEXEC);
+    if (fd == -1)
+        return -1;
+    if (!write_all(fd, (*r).file, len) || !write_all(fd, "\n", nl) || lseek(fd, 0, SEEK_SET) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Open a redirect's file with the flags its type calls for, close-on-exec
+ */
+static int open_redirect(struct redirect *r)
+{
+    if ((*r).type == REDIR_HEREDOC || (*r).type == REDIR_HERESTR)
+        return open_here(r);
+    if ((*r).type == REDIR_IN)
+        return open((*r).file, O_RDONLY | O_CLOEXEC);
+    int flags = (*r).type == REDIR_APPEND ? O_APPEND : O_TRUNC; // O_APPEND keeps concurrent writers from overwriting each other
+    return open((*r).file, O_WRONLY | O_CREAT | flags | O_CLOEXEC, 0644);
+}
+
+/**
+ * Report a redirect file that could not be opened
+ */
+static void redirect_error(struct redirect *r)
+{
+    if ((*r).type == REDIR_HEREDOC || (*r).type == REDIR_HERESTR)
+    {
+        fprintf(stderr, "cannot create here-document: %s\n", strerror(errno));
+        return;
+    }
+    fprintf(stderr, "cannot open file %s for %s\n", (*r).file, (*r).type == REDIR_IN ? "input" : "output");
+}
+
+bool swap_redirects(struct command *cmd, int saved[MAX_REDIRECT_FD + 1])
+{
+    for (int fd = 0; fd <= MAX_REDIRECT_FD; fd++)
+        saved[fd] = -1;
+    fflush(stdout); // Output so far belongs to the old stdout
+
+    for (int i = 0; i < (*cmd).nredirs; i++)
+    {
+        struct redirect *r = &(*cmd).redirs[i];
+        if (saved[(*r).fd] == -1) // Keep the real descriptor out of the way
+        {
+            saved[(*r).fd] = fcntl((*r).fd, F_DUPFD_CLOEXEC, MAX_REDIRECT_FD + 1);
+            if (saved[(*r).fd] == -1) // It wasn't open
+                saved[(*r).fd] = -2;
+        }
+
+        int fd = (*r).type == REDIR_DUP ? (*r).target : open_redirect(r);
+        if (fd == -1)
+            redirect_error(r);
+        else if ((*r).type == REDIR_DUP && (fd_owned(fd) || fcntl(fd, F_GETFD) == -1))
+        {
+            fprintf(stderr, "%d: bad file descriptor\n", fd);
+            fd = -1;
+        }
+        if (fd == -1)
+        {
+            restore_redirects(saved);
+            return false;
+        }
+
+        if (fd == (*r).fd) // Opened right where it belongs (or a dup to itself)
+            continue;
+        if ((*r).fd == STDOUT_FILENO || (*r).fd == STDERR_FILENO)
+            fflush((*r).fd == STDOUT_FILENO ? stdout : stderr);
+        dup2(fd, (*r).fd);
+        if ((*r).type != REDIR_DUP)
+            close(fd);
+    }
+    return true;
+}
+
+void restore_redirects(int saved[MAX_REDIRECT_FD + 1])
+{
+    fflush(stdout); // Everything the built-in printed goes to the redirect
+    fflush(stderr);
+    for (int fd = 0; fd <= MAX_REDIRECT_FD; fd++)
+    {
+        if (saved[fd] == -2) // Opened by the redirect, close it again
+            close(fd);
+        else if (saved[fd] != -1)
+        {
+            dup2(saved[fd], fd);
+            close(saved[fd]);
+        }
+        saved[fd] = -1;
+    }
+}
+
+/**
+ * Whether a built-in leaves "$?" as it was, and with it the statuses of the last pipeline's stages
+ */
+static bool keeps_status(const struct builtin *b)
+{
+    return b != NULL && ((*b).fn == builtin_status || (*b).fn == builtin_cd || (*b).fn == builtin_hash || (*b).fn == builtin_exit);
+}
+
+bool exec_cmd(struct pipeline *pl, int *lastExit, struct sigaction sa_SIGINT, struct background *bg)
+{
+    if ((*pl).ncmds == 0) // For empty line or comment, do nothing
+        return true;
+
+    // Anything else sets "$?", so the last pipeline's stage statuses no longer apply; a
+    // foreground pipeline fills them in again when it finishes
+    if ((*pl).ncmds > 1 || !keeps_status(find_builtin((*pl).cmds[0].args[0])))
+        pipe_nstatus = 0;
+    if ((*pl).ncmds > 1) // Built-ins only run on their own, pipelines are always outsourced
+    {
+        run_non_builtin(pl, lastExit, sa_SIGINT, bg);
+        return true;
+    }
+
+    // Check if the command is a built-in function; one run through a prefix is always
+    // launched as a program, the way nice(1) would run it
+    struct command *cmd = &(*pl).cmds[0];
+    if (take_prefixes(&(*pl).mem, cmd) == -1)
+    {
+        *lastExit = W_EXITCODE(1, 0);
+        return true;
+    }
+    const struct builtin *b = (*cmd).prefix > 0 ? NULL : find_builtin((*cmd).args[0]);
+    if (b == NULL || ((*cmd).run_in_bg && (*b).external) || ((*b).in_shell != NULL && !(*b).in_shell(cmd)))
+    {
+        // Command is not built in, outsource execution
+        run_non_builtin(pl, lastExit, sa_SIGINT, bg);
+        return true;
+    }
+
+    // Run it in the shell, pointing stdin/stdout at any redirect files while it runs
+    int saved[MAX_REDIRECT_FD + 1];
+    long long phase = trace_now();
+    bool swapped = swap_redirects(cmd, saved);
+    trace_event("redirect", "shell", phase, trace.pid, (*cmd).args[0]);
+    if (!swapped)
+    {
+        *lastExit = W_EXITCODE(1, 0);
+        return true;
+    }
+    phase = trace_now();
+    bool cont = (*b).fn(cmd, lastExit, sa_SIGINT, bg);
+    trace_event("builtin", "shell", phase, trace.pid, (*cmd).args[0]);
+    restore_redirects(saved);
+    return cont;
+}
+
+bool smallsh_cd(char *dir)
+{
+    if (dir == NULL) // "cd" is the only argument
+    {
+        const char *homeDir = var_get("HOME", 4);
+        if (homeDir == NULL)
+            fprintf(stderr, "cd: HOME not set\n");
+        else if (chdir(homeDir) == -1)                                 // Change to HOME directory
+            fprintf(stderr, "directory %s not found\n", homeDir); // Directory wasn't found, so print an error
+    }
+    else if (chdir(dir) == -1)                   // A path was specified, change the working directory to that path
+        printf("directory %s not found\n", dir); // Directory wasn't found, so print an error
+
+    fflush(stderr);
+    return true; // Always continue shell execution after "cd"
+}
+
+bool smallsh_status(int lastExit)
+{
+    if (WIFEXITED(lastExit))                                     // Last foreground process exited on its own
+        printf("exit value %d\n", WEXITSTATUS(lastExit));        // Print the exit value
+    else                                                         // The last foreground process was terminated
+        printf("terminated by signal %d\n", WTERMSIG(lastExit)); // Print the terminating signal
+    return true;                                                 // Always continue shell execution after "cd"
+}
+
+bool smallsh_pipestatus(void)
+{
+    for (int i = 0; i < pipe_nstatus; i++)
+    {
+        if (i > 0)
+            printf(" | ");
+        if (WIFEXITED(pipe_status[i]))
+            printf("exit value %d", WEXITSTATUS(pipe_status[i]));
+        else
+            printf("terminated by signal %d", WTERMSIG(pipe_status[i]));
+    }
+    printf("\n");
+    return true;
+}
+
+bool smallsh_hash(char **args)
+{
+    if (args[1] == NULL) // List the cache
+    {
+        if (path_cache.size == 0)
+        {
+            printf("hash: hash table empty\n");
+            return true;
+        }
+        printf("hits\tcommand\n");
+        for (int i = 0; i < PATH_CACHE_BUCKETS; i++)
+            for (struct path_entry *e = path_cache.buckets[i]; e != NULL; e = (*e).next)
+                printf("%4u\t%s\n", (*e).hits, (*e).path);
+    }
+    else if (strmatch(args[1], "-r")) // Forget everything
+        clear_path_cache();
+    else // Resolve and remember each named command
+    {
+        for (int i = 1; args[i] != NULL; i++)
+            if (strchr(args[i], '/') == NULL && resolve_command(args[i]) == NULL)
+                fprintf(stderr, "hash: %s: not found\n", args[i]);
+    }
+    fflush(stdout);
+    return true;
+}
+
+/**
+ * Print the character for the backslash escape at p (just past the backslash)
+ *
+ * Handles \\ \a \b \f \n \r \t \v and \0NNN octal. "\c" sets *stop.
+ *
+ * @return the number of characters of the escape consumed after the backslash
+ */
+static int print_escape(const char *p, bool *stop)
+{
+    const char *simple = "\\\\a\ab\bf\fn\nr\rt\tv\v";
+    for (const char *e = simple; *e; e += 2)
+        if (*p == e[0])
+        {
+            putchar(e[1]);
+            return 1;
+        }
+    if (*p == 'c')
+    {
+        *stop = true;
+        return 1;
+    }
+    if (*p == '0')
+    {
+        int n = 1, value = 0;
+        while (n < 4 && p[n] >= '0' && p[n] <= '7')
+            value = value * 8 + (p[n++] - '0');
+        putchar(value);
+        return n;
+    }
+    putchar('\\'); // Not an escape, print it as it is
+    return 0;
+}
+
+/**
+ * Print str, interpreting backslash escapes
+ *
+ * @return false if a "\c" said to stop all output
+ */
+static bool print_escaped(const char *str)
+{
+    bool stop = false;
+    for (const char *p = str; *p && !stop; p++)
+    {
+        if (*p == '\\' && p[1] != '\0')
+            p += print_escape(p + 1, &stop);
+        else
+            putchar(*p);
+    }
+    return !stop;
+}
+
+int smallsh_echo(char **args)
+{
+    // Leading options are only options if made up entirely of n, e and E, like GNU echo
+    bool newline = true, escapes = false;
+    int i = 1;
+    for (; args[i] != NULL && args[i][0] == '-' && args[i][1] != '\0'; i++)
+    {
+        if (strspn(args[i] + 1, "neE") != strlen(args[i] + 1))
+            break;
+        for (char *o = args[i] + 1; *o; o++)
+        {
+            if (*o == 'n')
+                newline = false;
+            else
+                escapes = *o == 'e';
+        }
+    }
+
+    for (; args[i] != NULL; i++)
+    {
+        if (escapes)
+        {
+            if (!print_escaped(args[i]))
+                return 0;
+        }
+        else
+            fputs(args[i], stdout);
+        if (args[i + 1] != NULL)
+            putchar(' ');
+    }
+    if (newline)
+        putchar('\n');
+    return 0;
+}
+
+int smallsh_pwd(void)
+{
+    char *cwd = getcwd(NULL, 0);
+    if (cwd == NULL)
+    {
+        perror("pwd");
+        return 1;
+    }
+    puts(cwd);
+    free(cwd);
+    return 0;
+}
+
+/**
+ * Convert a whole string to a number for printf's numeric conversions
+ */
+static long long printf_integer(const char *str)
+{
+    if (str[0] == '\'' || str[0] == '"') // 'c gives the character code, as in POSIX printf
+        return (unsigned char)str[1];
+    char *end;
+    errno = 0;
+    long long value = strtoll(str, &end, 0);
+    if (*end != '\0' || errno != 0)
+        fprintf(stderr, "printf: %s: invalid number\n", str);
+    return value;
+}
+
+int smallsh_printf(char **args)
+{
+    if (args[1] == NULL)
+    {
+        fprintf(stderr, "printf: usage: printf format [arguments]\n");
+        return 2;
+    }
+
+    char *format = args[1];
+    char **arg = &args[2];
+    bool stop = false;
+    do
+    {
+        bool converted = false; // The format is reused while arguments remain, if it uses any
+        for (char *p = format; *p && !stop; p++)
+        {
+            if (*p == '\\' && p[1] != '\0')
+            {
+                p += print_escape(p + 1, &stop);
+                continue;
+            }
+            if (*p != '%')
+            {
+                putchar(*p);
+                continue;
+            }
+            if (p[1] == '%')
+            {
+                putchar('%');
+                p++;
+                continue;
+            }
+
+            // Copy the conversion spec (flags, width, precision) so the C printf can do the work
+            char spec[32] = "%";
+            size_t len = 1;
+            for (p++; *p && strchr("-+ #0123456789.", *p) && len < sizeof(spec) - 4; p++)
+                spec[len++] = *p;
+            char conv = *p;
+            if (conv == '\0')
+                break;
+            const char *value = *arg != NULL ? *arg++ : "";
+            converted = true;
+
+            if (strchr("diouxX", conv))
+            {
+                spec[len++] = 'l';
+                spec[len++] = 'l';
+                spec[len++] = conv;
+                spec[len] = '\0';
+                printf(spec, printf_integer(value));
+            }
+            else if (strchr("eEfgG", conv))
+            {
+                spec[len++] = conv;
+                spec[len] = '\0';
+                printf(spec, strtod(value, NULL));
+            }
+            else if (conv == 'c')
+            {
+                spec[len++] = 'c';
+                spec[len] = '\0';
+                printf(spec, value[0]);
+            }
+            else if (conv == 's')
+            {
+                spec[len++] = 's';
+                spec[len] = '\0';
+                printf(spec, value);
+            }
+            else if (conv == 'b') // String with escapes
+                stop = !print_escaped(value);
+            else
+            {
+                fprintf(stderr, "printf: %%%c: invalid directive\n", conv);
+                return 1;
+            }
+        }
+        if (!converted)
+            break;
+    } while (*arg != NULL && !stop);
+    return 0;
+}
+
+/**
+ * Where smallsh_test() is in its arguments
+ */
+struct test_state
+{
+    char **argv; //< Arguments after "test"/"[" (without a closing "]")
+    int argc;    //< Number of arguments
+    int pos;     //< Next argument to look at
+    bool error;  //< A syntax error was found
+};
+
+static bool test_or(struct test_state *t);
+
+/**
+ * Parse a whole string as an integer operand, flagging an error if it isn't one
+ */
+static long long test_integer(struct test_state *t, const char *str)
+{
+    char *end;
+    errno = 0;
+    long long value = strtoll(str, &end, 10);
+    if (*str == '\0' || *end != '\0' || errno != 0)
+    {
+        fprintf(stderr, "test: %s: integer expression expected\n", str);
+        (*t).error = true;
+    }
+    return value;
+}
+
+/**
+ * Evaluate a binary test, or return -1 if op isn't a binary operator
+ */
+static int test_binary(struct test_state *t, const char *a, const char *op, const char *b)
+{
+    if (strmatch(op, "=") || strmatch(op, "=="))
+        return strmatch(a, b);
+    if (strmatch(op, "!="))
+        return !strmatch(a, b);
+
+    const char *intOps[] = {"-eq", "-ne", "-lt", "-le", "-gt", "-ge"};
+    for (int i = 0; i < 6; i++)
+        if (strmatch(op, intOps[i]))
+        {
+            long long x = test_integer(t, a), y = test_integer(t, b);
+            bool results[] = {x == y, x != y, x < y, x <= y, x > y, x >= y};
+            return results[i];
+        }
+    return -1;
+}
+
+/**
+ * Evaluate a unary file or string test, or return -1 if op isn't a unary operator
+ */
+static int test_unary(const char *op, const char *arg)
+{
+    if (op[0] != '-' || op[1] == '\0' || op[2] != '\0')
+        return -1;
+
+    struct stat sb;
+    switch (op[1])
+    {
+    case 'z':
+        return arg[0] == '\0';
+    case 'n':
+        return arg[0] != '\0';
+    case 'e':
+        return stat(arg, &sb) == 0;
+    case 'f':
+        return stat(arg, &sb) == 0 && S_ISREG(sb.st_mode);
+    case 'd':
+        return stat(arg, &sb) == 0 && S_ISDIR(sb.st_mode);
+    case 'p':
+        return stat(arg, &sb) == 0 && S_ISFIFO(sb.st_mode);
+    case 'S':
+        return stat(arg, &sb) == 0 && S_ISSOCK(sb.st_mode);
+    case 'b':
+        return stat(arg, &sb) == 0 && S_ISBLK(sb.st_mode);
+    case 'c':
+        return stat(arg, &sb) == 0 && S_ISCHR(sb.st_mode);
+    case 's':
+        return stat(arg, &sb) == 0 && sb.st_size > 0;
+    case 'h':
+    case 'L':
+        return lstat(arg, &sb) == 0 && S_ISLNK(sb.st_mode);
+    case 'r':
+        return access(arg, R_OK) == 0;
+    case 'w':
+        return access(arg, W_OK) == 0;
+    case 'x':
+        return access(arg, X_OK) == 0;
+    case 't':
+        return isatty(atoi(arg));
+    }
+    return -1;
+}
+
+/**
+ * primary := "(" or ")" | arg binop arg | unop arg | arg
+ */
+static bool test_primary(struct test_state *t)
+{
+    if ((*t).pos >= (*t).argc)
+    {
+        (*t).error = true;
+        return false;
+    }
+    char **argv = (*t).argv + (*t).pos;
+    int left = (*t).argc - (*t).pos;
+
+    if (left >= 3) // Binary operators take precedence, as POSIX requires for three arguments
+    {
+        int result = test_binary(t, argv[0], argv[1], argv[2]);
+        if (result != -1)
+        {
+            (*t).pos += 3;
+            return result;
+        }
+    }
+    if (strmatch(argv[0], "(") && left >= 2)
+    {
+        (*t).pos++;
+        bool result = test_or(t);
+        if ((*t).pos >= (*t).argc || !strmatch((*t).argv[(*t).pos], ")"))
+            (*t).error = true;
+        (*t).pos++;
+        return result;
+    }
+    if (left >= 2)
+    {
+        int result = test_unary(argv[0], argv[1]);
+        if (result != -1)
+        {
+            (*t).pos += 2;
+            return result;
+        }
+    }
+    (*t).pos++; // A lone string is true if it isn't empty
+    return argv[0][0] != '\0';
+}
+
+/**
+ * not := "!" not | primary
+ */
+static bool test_not(struct test_state *t)
+{
+    if ((*t).pos + 1 < (*t).argc && strmatch((*t).argv[(*t).pos], "!"))
+    {
+        (*t).pos++;
+        return !test_not(t);
+    }
+    return test_primary(t);
+}
+
+/**
+ * and := not ("-a" not)*
+ */
+static bool test_and(struct test_state *t)
+{
+    bool result = test_not(t);
+    while ((*t).pos < (*t).argc && strmatch((*t).argv[(*t).pos], "-a"))
+    {
+        (*t).pos++;
+        result = test_not(t) && result;
+    }
+    return result;
+}
+
+/**
+ * or := and ("-o" and)*
+ */
+static bool test_or(struct test_state *t)
+{
+    bool result = test_and(t);
+    while ((*t).pos < (*t).argc && strmatch((*t).argv[(*t).pos], "-o"))
+    {
+        (*t).pos++;
+        result = test_and(t) || result;
+    }
+    return result;
+}
+
+int smallsh_test(char **args)
+{
+    struct test_state t = {.argv = args + 1};
+    while (t.argv[t.argc] != NULL)
+        t.argc++;
+
+    if (strmatch(args[0], "[")) // "[" needs a closing "]", which isn't part of the expression
+    {
+        if (t.argc == 0 || !strmatch(t.argv[t.argc - 1], "]"))
+        {
+            fprintf(stderr, "[: missing ']'\n");
+            return 2;
+        }
+        t.argc--;
+    }
+    if (t.argc == 0) // No expression is false
+        return 1;
+
+    bool result = test_or(&t);
+    if (t.error || t.pos != t.argc)
+    {
+        if (t.pos != t.argc || !t.error)
+            fprintf(stderr, "test: syntax error\n");
+        return 2;
+    }
+    return result ? 0 : 1;
+}
+
+/**
+ * Check that path names a regular file the shell could execute
+ */
+static bool is_executable(const char *path)
+{
+    struct stat sb;
+    return stat(path, &sb) == 0 && S_ISREG(sb.st_mode) && access(path, X_OK) == 0;
+}
+
+/**
+ * djb2 string hash, reduced to a bucket index of the path cache
+ */
+static unsigned path_bucket(const char *name)
+{
+    unsigned h = 5381;
+    while (*name)
+        h = h * 33 + (unsigned char)*name++;
+    return h % PATH_CACHE_BUCKETS;
+}
+
+char *resolve_command(char *name)
+{
+    if (strchr(name, '/') != NULL) // Explicit path, nothing to search for
+        return name;
+
+    // Cached entries are only valid for the PATH they were resolved against
+    const char *pathEnv = var_get("PATH", 4);
+    if (pathEnv == NULL)
+        pathEnv = "/bin:/usr/bin"; // Same default execvp uses
+    if (path_cache.path_env == NULL || !strmatch(path_cache.path_env, pathEnv))
+    {
+        clear_path_cache();
+        path_cache.path_env = strdup(pathEnv);
+    }
+
+    // Look for a cached entry, dropping it if its file has gone away
+    struct path_entry **link = &path_cache.buckets[path_bucket(name)];
+    for (struct path_entry *e = *link; e != NULL; link = &(*e).next, e = *link)
+    {
+        if (!strmatch((*e).name, name))
+            continue;
+        if (is_executable((*e).path))
+        {
+            (*e).hits++;
+            return (*e).path;
+        }
+        *link = (*e).next; // Stale, unlink it and search PATH again
+        free((*e).name);
+        free((*e).path);
+        free(e);
+        path_cache.size--;
+        break;
+    }
+
+    // Walk each directory in PATH; an empty entry means the current directory
+    size_t nameLen = strlen(name);
+    char *candidate = malloc(strlen(pathEnv) + nameLen + 2);
+    const char *dir = pathEnv;
+    while (true)
+    {
+        const char *end = strchr(dir, ':');
+        if (end == NULL)
+            end = dir + strlen(dir);
+        size_t dirLen = end - dir;
+        if (dirLen == 0)
+            strcpy(candidate, name);
+        else
+        {
+            memcpy(candidate, dir, dirLen);
+            candidate[dirLen] = '/';
+            memcpy(candidate + dirLen + 1, name, nameLen + 1);
+        }
+
+        if (is_executable(candidate)) // Found it, cache the result
+        {
+            struct path_entry *e = malloc(sizeof(struct path_entry));
+            (*e).name = strdup(name);
+            (*e).path = candidate;
+            (*e).hits = 1;
+            (*e).next = path_cache.buckets[path_bucket(name)];
+            path_cache.buckets[path_bucket(name)] = e;
+            path_cache.size++;
+            return candidate;
+        }
+
+        if (*end == '\0')
+            break;
+        dir = end + 1;
+    }
+
+    free(candidate);
+    return NULL; // Not found anywhere in PATH
+}
+
+void clear_path_cache(void)
+{
+    for (int i = 0; i < PATH_CACHE_BUCKETS; i++)
+    {
+        struct path_entry *e = path_cache.buckets[i];
+        while (e != NULL)
+        {
+            struct path_entry *next = (*e).next;
+            free((*e).name);
+            free((*e).path);
+            free(e);
+            e = next;
+        }
+        path_cache.buckets[i] = NULL;
+    }
+    free(path_cache.path_env);
+    path_cache.path_env = NULL;
+    path_cache.size = 0;
+}
+
+/**
+ * Whether c may start a variable name, and whether it may appear in one
+ */
+static bool var_name_start(char c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+}
+
+static bool var_name_char(char c)
+{
+    return var_name_start(c) || (c >= '0' && c <= '9');
+}
+
+/**
+ * Whether the first len bytes of name are a valid variable name
+ */
+static bool var_valid(const char *name, size_t len)
+{
+    if (len == 0 || !var_name_start(name[0]))
+        return false;
+    for (size_t i = 1; i < len; i++)
+        if (!var_name_char(name[i]))
+            return false;
+    return true;
+}
+
+/**
+ * FNV-1a hash of a variable name
+ */
+static unsigned var_hash(const char *name, size_t len)
+{
+    unsigned h = 2166136261u;
+    for (size_t i = 0; i < len; i++)
+    {
+        h ^= (unsigned char)name[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/**
+ * Slot holding the variable name, or the empty slot where it would go
+ */
+static struct var *var_slot(const char *name, size_t len, unsigned hash)
+{
+    int mask = vars.nslots - 1;
+    for (int slot = hash & mask;; slot = (slot + 1) & mask)
+    {
+        struct var *v = &vars.slots[slot];
+        if ((*v).entry == NULL || ((*v).hash == hash && (*v).namelen == len && memcmp((*v).entry, name, len) == 0))
+            return v;
+    }
+}
+
+/**
+ * Double the table, or create it the first time, importing the environment
+ */
+static void var_grow(void)
+{
+    struct var *old = vars.slots;
+    int oldSlots = vars.nslots;
+    vars.nslots = oldSlots ? oldSlots * 2 : VAR_MIN_SLOTS;
+    vars.slots = calloc(vars.nslots, sizeof(struct var));
+    for (int i = 0; i < oldSlots; i++)
+        if (old[i].entry != NULL)
+            *var_slot(old[i].entry, old[i].namelen, old[i].hash) = old[i];
+    free(old);
+
+    if (oldSlots == 0) // First use: the environment we were started with is all exported
+    {
+        for (char **e = environ; *e != NULL; e++)
+        {
+            char *eq = strchr(*e, '=');
+            if (eq == NULL || !var_valid(*e, eq - *e))
+                continue;
+            if ((vars.size + 1) * 2 > vars.nslots)
+                var_grow();
+            unsigned hash = var_hash(*e, eq - *e);
+            struct var *v = var_slot(*e, eq - *e, hash);
+            if ((*v).entry != NULL) // Repeated name, the first one wins like getenv()
+                continue;
+            *v = (struct var){strdup(*e), eq - *e, hash, true};
+            vars.size++;
+        }
+        vars.stale = true;
+    }
+}
+
+const char *var_get(const char *name, size_t len)
+{
+    if (vars.nslots == 0)
+        var_grow();
+    struct var *v = var_slot(name, len, var_hash(name, len));
+    return (*v).entry != NULL ? (*v).entry + len + 1 : NULL;
+}
+
+void var_set(const char *name, const char *value, bool export)
+{
+    if (vars.nslots == 0)
+        var_grow();
+    if ((vars.size + 1) * 2 > vars.nslots) // Keep the table at most half full
+        var_grow();
+
+    size_t len = strlen(name);
+    size_t valueLen = strlen(value);
+    unsigned hash = var_hash(name, len);
+    struct var *v = var_slot(name, len, hash);
+    if ((*v).entry == NULL)
+    {
+        *v = (struct var){NULL, len, hash, false};
+        vars.size++;
+    }
+
+    char *entry = malloc(len + valueLen + 2);
+    memcpy(entry, name, len);
+    entry[len] = '=';
+    memcpy(entry + len + 1, value, valueLen + 1);
+    free((*v).entry);
+    (*v).entry = entry;
+    (*v).exported |= export;
+    if ((*v).exported)
+        vars.stale = true;
+}
+
+bool var_unset(const char *name)
+{
+    size_t len = strlen(name);
+    if (vars.nslots == 0)
+        var_grow();
+    struct var *v = var_slot(name, len, var_hash(name, len));
+    if ((*v).entry == NULL)
+        return false;
+    if ((*v).exported)
+        vars.stale = true;
+    free((*v).entry);
+    (*v).entry = NULL;
+    vars.size--;
+
+    // Shift later entries of the same probe run back into the gap so lookups never
+    // stop early (no tombstones needed)
+    int mask = vars.nslots - 1;
+    int gap = v - vars.slots;
+    for (int slot = (gap + 1) & mask; vars.slots[slot].entry != NULL; slot = (slot + 1) & mask)
+    {
+        int home = vars.slots[slot].hash & mask;
+        if (((slot - home) & mask) >= ((slot - gap) & mask)) // Entry may move back to the gap
+        {
+            vars.slots[gap] = vars.slots[slot];
+            vars.slots[slot].entry = NULL;
+            gap = slot;
+        }
+    }
+    return true;
+}
+
+char **var_envp(void)
+{
+    if (vars.nslots == 0)
+        var_grow();
+    if (vars.stale)
+    {
+        vars.envp = realloc(vars.envp, sizeof(char *) * (vars.size + 1));
+        int n = 0;
+        for (int i = 0; i < vars.nslots; i++)
+            if (vars.slots[i].entry != NULL && vars.slots[i].exported)
+                vars.envp[n++] = vars.slots[i].entry;
+        vars.envp[n] = NULL;
+        vars.stale = false;
+    }
+    return vars.envp;
+}
+
+/**
+ * Parse the variable reference after a '$', returning its length (0 if there is none)
+ * and the name it refers to
+ */
+static size_t var_ref(const char *p, const char **name, size_t *len)
+{
+    if (*p == '$' || *p == '?' || *p == '!') // Special parameters
+    {
+        *name = p;
+        *len = 1;
+        return 1;
+    }
+    if (*p == '{')
+    {
+        const char *close = strchr(p, '}');
+        if (close == NULL)
+            return 0;
+        *name = p + 1;
+        *len = close - p - 1;
+        bool special = *len == 1 && (p[1] == '$' || p[1] == '?' || p[1] == '!');
+        return special || var_valid(*name, *len) ? *len + 2 : 0;
+    }
+    if (!var_name_start(*p))
+        return 0;
+    *name = p;
+    *len = 1;
+    while (var_name_char(p[*len]))
+        (*len)++;
+    return *len;
+}
+
+/**
+ * Value of the variable a reference names, formatting "$?" and "$!" into num
+ */
+static const char *var_ref_value(const char *name, size_t len, const char *pid_str, char *num, size_t numSize)
+{
+    if (len == 1 && *name == '$')
+        return pid_str;
+    if (len == 1 && *name == '?')
+    {
+        int status = WIFEXITED(vars.status) ? WEXITSTATUS(vars.status) : 128 + WTERMSIG(vars.status);
+        snprintf(num, numSize, "%d", status);
+        return num;
+    }
+    if (len == 1 && *name == '!')
+    {
+        if (vars.lastbg == 0)
+            return "";
+        snprintf(num, numSize, "%d", vars.lastbg);
+        return num;
+    }
+    const char *value = var_get(name, len);
+    return value != NULL ? value : "";
+}
+
+char *expand_vars(struct arena *mem, const char *token, const char *pid_str)
+{
+    char num[16];
+
+    // Measure first, so the result is allocated once at its exact size
+    size_t size = 1;
+    for (const char *p = token; *p != '\0';)
+    {
+        const char *name;
+        size_t len;
+        size_t ref = *p == '$' ? var_ref(p + 1, &name, &len) : 0;
+        if (ref == 0)
+        {
+            size++;
+            p++;
+            continue;
+        }
+        size += strlen(var_ref_value(name, len, pid_str, num, sizeof(num)));
+        p += ref + 1;
+    }
+
+    char *result = arena_alloc(mem, size);
+    char *pos = result;
+    for (const char *p = token; *p != '\0';)
+    {
+        const char *name;
+        size_t len;
+        size_t ref = *p == '$' ? var_ref(p + 1, &name, &len) : 0;
+        if (ref == 0)
+        {
+            *pos++ = *p++;
+            continue;
+        }
+        const char *value = var_ref_value(name, len, pid_str, num, sizeof(num));
+        size_t valueLen = strlen(value);
+        memcpy(pos, value, valueLen);
+        pos += valueLen;
+        p += ref + 1;
+    }
+    *pos = '\0';
+    return result;
+}
+
+/**
+ * qsort comparator ordering variable entries by name
+ */
+static int var_by_name(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/**
+ * Print the variables in name order, each after prefix; only exported ones if asked
+ */
+static void var_list(const char *prefix, bool exportedOnly)
+{
+    if (vars.nslots == 0)
+        var_grow();
+    char **sorted = malloc(sizeof(char *) * (vars.size + 1));
+    int n = 0;
+    for (int i = 0; i < vars.nslots; i++)
+        if (vars.slots[i].entry != NULL && (vars.slots[i].exported || !exportedOnly))
+            sorted[n++] = vars.slots[i].entry;
+    qsort(sorted, n, sizeof(char *), var_by_name);
+    for (int i = 0; i < n; i++)
+        printf("%s%s\n", prefix, sorted[i]);
+    free(sorted);
+    fflush(stdout);
+}
+
+/**
+ * Apply each NAME=VALUE (or, for export, NAME) argument, returning the exit value
+ */
+static int var_assign(char **args, bool export)
+{
+    int status = 0;
+    for (int i = 1; args[i] != NULL; i++)
+    {
+        char *eq = strchr(args[i], '=');
+        size_t len = eq != NULL ? (size_t)(eq - args[i]) : strlen(args[i]);
+        if (!var_valid(args[i], len) || (eq == NULL && !export))
+        {
+            fprintf(stderr, "%s: `%s': not a valid identifier\n", args[0], args[i]);
+            status = 1;
+            continue;
+        }
+        if (eq != NULL)
+        {
+            *eq = '\0'; // The argument is in the command line's arena, so it can be split
+            var_set(args[i], eq + 1, export);
+            *eq = '=';
+        }
+        else if (var_get(args[i], len) != NULL) // Export a variable that is already set
+            var_set(args[i], var_get(args[i], len), true);
+    }
+    fflush(stderr);
+    return status;
+}
+
+int smallsh_set(char **args)
+{
+    if (args[1] == NULL)
+    {
+        var_list("", false);
+        return 0;
+    }
+    return var_assign(args, false);
+}
+
+int smallsh_export(char **args)
+{
+    if (args[1] == NULL)
+    {
+        var_list("export ", true);
+        return 0;
+    }
+    return var_assign(args, true);
+}
+
+int smallsh_unset(char **args)
+{
+    int status = 0;
+    for (int i = 1; args[i] != NULL; i++)
+    {
+        if (!var_valid(args[i], strlen(args[i])))
+        {
+            fprintf(stderr, "unset: `%s': not a valid identifier\n", args[i]);
+            status = 1;
+        }
+        else
+            var_unset(args[i]); // Unsetting what isn't set is no error
+    }
+    fflush(stderr);
+    return status;
+}
+
+/**
+ * Histogram bucket of v: exact below STATS_SUB_BUCKETS, then STATS_SUB_BUCKETS per power of two
+ */
+static int stats_bucket(unsigned long long v)
+{
+    if (v < STATS_SUB_BUCKETS)
+        return v;
+    int shift = 63 - __builtin_clzll(v) - __builtin_ctz(STATS_SUB_BUCKETS); // Keep the top bits below the leading one
+    return (shift + 1) * STATS_SUB_BUCKETS + ((v >> shift) & (STATS_SUB_BUCKETS - 1));
+}
+
+/**
+ * Largest value that falls in histogram bucket b
+ */
+static unsigned long long stats_bucket_max(int b)
+{
+    if (b < STATS_SUB_BUCKETS)
+        return b;
+    int shift = b / STATS_SUB_BUCKETS - 1;
+    return ((unsigned long long)(STATS_SUB_BUCKETS + b % STATS_SUB_BUCKETS + 1) << shift) - 1;
+}
+
+/**
+ * Value below which a fraction p of the n samples in hist fall, rounded up to its bucket's bound
+ * but never above max, the largest sample
+ */
+static unsigned long long stats_percentile(const unsigned *hist, long n, double p, unsigned long long max)
+{
+    long rank = (long)(p * n + 0.999999); // The ceil(p * n)-th smallest sample
+    if (rank < 1)
+        rank = 1;
+    long seen = 0;
+    for (int b = 0; b < STATS_BUCKETS; b++)
+    {
+        seen += hist[b];
+        if (seen >= rank)
+            return stats_bucket_max(b) < max ? stats_bucket_max(b) : max;
+    }
+    return max;
+}
+
+/**
+ * Position of name in the stats array, adding an entry for it if needed
+ */
+static int stats_command(const char *name)
+{
+    unsigned h = 5381; // djb2
+    for (const char *c = name; *c; c++)
+        h = h * 33 + (unsigned char)*c;
+
+    if ((stats.ncmds + 1) * 2 > stats.nslots) // Keep the index at most half full
+    {
+        free(stats.index);
+        stats.nslots = stats.nslots ? stats.nslots * 2 : 64;
+        stats.index = calloc(stats.nslots, sizeof(int));
+        for (int i = 0; i < stats.ncmds; i++)
+        {
+            unsigned g = 5381;
+            for (const char *c = stats.cmds[i].name; *c; c++)
+                g = g * 33 + (unsigned char)*c;
+            int slot = g & (stats.nslots - 1);
+            while (stats.index[slot] != 0)
+                slot = (slot + 1) & (stats.nslots - 1);
+            stats.index[slot] = i + 1;
+        }
+    }
+
+    int slot = h & (stats.nslots - 1);
+    for (; stats.index[slot] != 0; slot = (slot + 1) & (stats.nslots - 1))
+        if (strmatch(stats.cmds[stats.index[slot] - 1].name, name))
+            return stats.index[slot] - 1;
+
+    // Not seen before
+    if (stats.ncmds == stats.cap)
+    {
+        stats.cap = stats.cap ? stats.cap * 2 : 16;
+        stats.cmds = realloc(stats.cmds, sizeof(struct cmd_stats) * stats.cap);
+    }
+    struct cmd_stats *c = &stats.cmds[stats.ncmds];
+    memset(c, 0, sizeof(struct cmd_stats));
+    (*c).name = strdup(name);
+    stats.index[slot] = stats.ncmds + 1;
+    return stats.ncmds++;
+}
+
+/**
+ * Slot of the unreaped-children table to start probing at for pid
+ */
+static int stats_proc_slot(pid_t pid)
+{
+    return ((unsigned)pid * 2654435761u) & (stats.nprocslots - 1); // Knuth's multiplicative hash
+}
+
+/**
+ * Insert a launched child into the unreaped-children table, which must have room for it
+ */
+static void stats_proc_insert(struct proc_start p)
+{
+    int slot = stats_proc_slot(p.pid);
+    while (stats.procs[slot].pid != 0 && stats.procs[slot].pid != p.pid)
+        slot = (slot + 1) & (stats.nprocslots - 1);
+    if (stats.procs[slot].pid == 0)
+        stats.nprocs++;
+    stats.procs[slot] = p;
+}
+
+void stats_start(pid_t pid, const char *name)
+{
+    struct proc_start p = {.pid = pid, .cmd = stats_command(name)};
+    clock_gettime(CLOCK_MONOTONIC, &p.start);
+
+    if ((stats.nprocs + 1) * 2 > stats.nprocslots) // Keep the table at most half full
+    {
+        struct proc_start *old = stats.procs;
+        int nold = stats.nprocslots;
+        stats.nprocslots = nold ? nold * 2 : 128;
+        stats.procs = calloc(stats.nprocslots, sizeof(struct proc_start));
+        stats.nprocs = 0;
+        for (int i = 0; i < nold; i++)
+            if (old[i].pid != 0)
+                stats_proc_insert(old[i]);
+        free(old);
+    }
+    stats_proc_insert(p);
+}
+
+/**
+ * Remove pid from the unreaped-children table
+ *
+ * @return whether it was there, in which case *p receives its entry
+ */
+static bool stats_proc_take(pid_t pid, struct proc_start *p)
+{
+    if (stats.nprocslots == 0)
+        return false;
+    int mask = stats.nprocslots - 1;
+    int slot = stats_proc_slot(pid);
+    while (stats.procs[slot].pid != pid)
+    {
+        if (stats.procs[slot].pid == 0)
+            return false;
+        slot = (slot + 1) & mask;
+    }
+    *p = stats.procs[slot];
+
+    // Backward-shift deletion, as in bg_remove()
+    int gap = slot;
+    stats.procs[gap].pid = 0;
+    for (slot = (gap + 1) & mask; stats.procs[slot].pid != 0; slot = (slot + 1) & mask)
+    {
+        int home = stats_proc_slot(stats.procs[slot].pid);
+        if (((slot - home) & mask) >= ((slot - gap) & mask))
+        {
+            stats.procs[gap] = stats.procs[slot];
+            stats.procs[slot].pid = 0;
+            gap = slot;
+        }
+    }
+    stats.nprocs--;
+    return true;
+}
+
+pid_t reap_child(pid_t pid, int *status, int options)
+{
+    struct rusage ru;
+    pid_t reaped = wait4(pid, status, options, &ru);
+    if (reaped <= 0 || !(WIFEXITED(*status) || WIFSIGNALED(*status)))
+        return reaped;
+
+    struct proc_start p;
+    if (!stats_proc_take(reaped, &p)) // Not launched by launch_pipeline()
+        return reaped;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long wallUs = (now.tv_sec - p.start.tv_sec) * 1000000L + (now.tv_nsec - p.start.tv_nsec) / 1000;
+
+    struct cmd_stats *c = &stats.cmds[p.cmd];
+    (*c).runs++;
+    if (!WIFEXITED(*status) || WEXITSTATUS(*status) != 0)
+        (*c).failures++;
+    (*c).wall += wallUs / 1e6;
+    (*c).user += ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6;
+    (*c).sys += ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+    (*c).nvcsw += ru.ru_nvcsw;
+    (*c).nivcsw += ru.ru_nivcsw;
+    if (wallUs > (*c).max_wall_us)
+        (*c).max_wall_us = wallUs;
+    if (ru.ru_maxrss > (*c).max_rss) // In KiB on Linux
+        (*c).max_rss = ru.ru_maxrss;
+    (*c).wall_hist[stats_bucket(wallUs)]++;
+    (*c).rss_hist[stats_bucket(ru.ru_maxrss)]++;
+
+    // Show the child's whole lifetime on a track of its own
+    if (trace.fd != -1)
+    {
+        char detail[32];
+        if (WIFEXITED(*status))
+            snprintf(detail, sizeof(detail), "exit value %d", WEXITSTATUS(*status));
+        else
+            snprintf(detail, sizeof(detail), "terminated by signal %d", WTERMSIG(*status));
+        trace_event((*c).name, "job", p.start.tv_sec * 1000000000LL + p.start.tv_nsec, reaped, detail);
+    }
+    return reaped;
+}
+
+/**
+ * qsort comparator putting the command with the most total wall time first
+ */
+static int stats_by_wall(const void *a, const void *b)
+{
+    double wa = (*(*(struct cmd_stats *const *)a)).wall;
+    double wb = (*(*(struct cmd_stats *const *)b)).wall;
+    return (wa < wb) - (wa > wb);
+}
+
+// Names of the enum copy_method values, for stats and trace output
+static const char *const copy_method_names[] = {"copy_file_range", "sendfile", "splice", "read/write"};
+
+// Set by Ctrl-C while the cat built-in runs
+static volatile sig_atomic_t cat_interrupted = 0;
+
+int smallsh_stats(char **args)
+{
+    if (args[1] != NULL && strmatch(args[1], "-c") && args[2] == NULL) // Forget everything measured so far
+    {
+        for (int i = 0; i < stats.ncmds; i++)
+        {
+            char *name = stats.cmds[i].name;
+            memset(&stats.cmds[i], 0, sizeof(struct cmd_stats));
+            stats.cmds[i].name = name;
+        }
+        stats.copy_bytes = 0;
+        stats.copy_secs = 0;
+        memset(stats.copy_files, 0, sizeof(stats.copy_files));
+        return 0;
+    }
+    if (args[1] != NULL)
+    {
+        fprintf(stderr, "stats: usage: stats [-c]\n");
+        return 2;
+    }
+
+    struct cmd_stats **sorted = malloc(sizeof(struct cmd_stats *) * (stats.ncmds + 1));
+    int n = 0;
+    for (int i = 0; i < stats.ncmds; i++)
+        if (stats.cmds[i].runs > 0)
+            sorted[n++] = &stats.cmds[i];
+    qsort(sorted, n, sizeof(struct cmd_stats *), stats_by_wall);
+
+    printf("%-16s %6s %5s %10s %10s %10s %9s %9s %8s %8s %8s %8s %8s\n", "command", "runs", "fail",
+           "p50 ms", "p99 ms", "max ms", "user s", "sys s", "rss p50", "rss p99", "rss max", "vcsw", "ivcsw");
+    for (int i = 0; i < n; i++)
+    {
+        struct cmd_stats *c = sorted[i];
+        printf("%-16s %6ld %5ld %10.3f %10.3f %10.3f %9.3f %9.3f %8llu %8llu %8ld %8ld %8ld\n", (*c).name, (*c).runs,
+               (*c).failures, stats_percentile((*c).wall_hist, (*c).runs, 0.5, (*c).max_wall_us) / 1e3,
+               stats_percentile((*c).wall_hist, (*c).runs, 0.99, (*c).max_wall_us) / 1e3, (*c).max_wall_us / 1e3,
+               (*c).user, (*c).sys, stats_percentile((*c).rss_hist, (*c).runs, 0.5, (*c).max_rss),
+               stats_percentile((*c).rss_hist, (*c).runs, 0.99, (*c).max_rss), (*c).max_rss, (*c).nvcsw, (*c).nivcsw);
+    }
+    long copies = 0;
+    for (int m = 0; m < COPY_METHODS; m++)
+        copies += stats.copy_files[m];
+    if (copies > 0) // The cat built-in never makes a child, so it gets a line of its own
+    {
+        printf("cat in shell: %lld bytes from %ld inputs in %.3f s (%.1f MB/s);", stats.copy_bytes, copies,
+               stats.copy_secs, stats.copy_secs > 0 ? stats.copy_bytes / stats.copy_secs / 1e6 : 0);
+        for (int m = 0; m < COPY_METHODS; m++)
+            printf(" %s %ld", copy_method_names[m], stats.copy_files[m]);
+        printf("\n");
+    }
+    fflush(stdout);
+    free(sorted);
+    return 0;
+}
+
+/**
+ * SIGINT handler while the cat built-in runs: the copy stops at its next call
+ */
+static void handle_cat_SIGINT(int signo)
+{
+    cat_interrupted = 1;
+}
+
+/**
+ * Copy everything left in in to out with the fastest call that works for the pair
+ *
+ * A call that can't handle the pair fails (or, for copy_file_range, copies nothing)
+ * before any data has moved, and the next one down is tried. Returns false on an
+ * error, with errno set.
+ */
+static bool copy_fd(int in, int out, long long *bytes, enum copy_method *method)
+{
+    static char buf[COPY_BUF_SIZE];
+    struct stat inSt, outSt;
+    *bytes = 0;
+    *method = COPY_READ_WRITE;
+    if (fstat(in, &inSt) == -1 || fstat(out, &outSt) == -1)
+        return false;
+    bool file = S_ISREG(inSt.st_mode) && inSt.st_size > 0; // /proc files claim to be empty, and have to be read
+    bool pipes = S_ISFIFO(inSt.st_mode) || S_ISFIFO(outSt.st_mode);
+    if (file)
+        *method = S_ISREG(outSt.st_mode) ? COPY_RANGE : COPY_SENDFILE;
+    else if (pipes)
+        *method = COPY_SPLICE;
+
+    while (!cat_interrupted)
+    {
+        ssize_t n;
+        if (*method == COPY_RANGE)
+            n = copy_file_range(in, NULL, out, NULL, COPY_CHUNK, 0);
+        else if (*method == COPY_SENDFILE)
+            n = sendfile(out, in, NULL, COPY_CHUNK);
+        else if (*method == COPY_SPLICE)
+            n = splice(in, NULL, out, NULL, COPY_CHUNK, SPLICE_F_MOVE);
+        else
+        {
+            n = read(in, buf, sizeof(buf));
+            if (n > 0 && !write_all(out, buf, n))
+                return false;
+        }
+
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (*method != COPY_READ_WRITE && *bytes == 0 && (n == -1 || (n == 0 && *method == COPY_RANGE)))
+        {
+            // Not supported for these two (a different file system, O_APPEND, no pipe...)
+            if (*method == COPY_RANGE)
+                *method = COPY_SENDFILE;
+            else if (*method == COPY_SENDFILE && pipes)
+                *method = COPY_SPLICE;
+            else
+                *method = COPY_READ_WRITE;
+            continue;
+        }
+        if (n == -1)
+            return false;
+        if (n == 0)
+            return true;
+        *bytes += n;
+    }
+    errno = EINTR;
+    return false;
+}
+
+int smallsh_cat(char **args)
+{
+    struct sigaction sa = {0}, old;
+    sa.sa_handler = handle_cat_SIGINT; // No SA_RESTART, so a blocked read returns
+    sigaction(SIGINT, &sa, &old);
+    cat_interrupted = 0;
+
+    struct stat outSt;
+    bool outFile = fstat(STDOUT_FILENO, &outSt) == 0 && S_ISREG(outSt.st_mode);
+    static char *const stdinOnly[] = {"-", NULL};
+    int status = 0;
+    for (char *const *arg = args[1] != NULL ? args + 1 : stdinOnly; *arg != NULL && !cat_interrupted; arg++)
+    {
+        bool useStdin = strmatch(*arg, "-");
+        int in = useStdin ? STDIN_FILENO : open(*arg, O_RDONLY | O_CLOEXEC);
+        struct stat inSt;
+        if (in == -1 || fstat(in, &inSt) == -1)
+        {
+            if (!cat_interrupted) // Not a FIFO with no writer that Ctrl-C got us out of
+                fprintf(stderr, "cat: %s: %s\n", *arg, strerror(errno));
+            status = 1;
+            continue;
+        }
+        if (outFile && inSt.st_dev == outSt.st_dev && inSt.st_ino == outSt.st_ino) // It would never reach the end
+        {
+            fprintf(stderr, "cat: %s: input file is output file\n", *arg);
+            status = 1;
+        }
+        else
+        {
+            struct timespec start, end;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            long long phase = trace_now();
+            long long bytes;
+            enum copy_method method;
+            bool ok = copy_fd(in, STDOUT_FILENO, &bytes, &method);
+            int err = errno;
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+            stats.copy_bytes += bytes;
+            stats.copy_secs += secs;
+            stats.copy_files[method]++;
+            if (trace.fd != -1)
+            {
+                char detail[TRACE_FIELD_MAX];
+                snprintf(detail, sizeof(detail), "%lld bytes via %s, %.1f MB/s: %s", bytes, copy_method_names[method],
+                         secs > 0 ? bytes / secs / 1e6 : 0, *arg);
+                trace_event("cat", "shell", phase, trace.pid, detail);
+            }
+            if (!ok && !cat_interrupted)
+            {
+                fprintf(stderr, "cat: %s: %s\n", *arg, strerror(err));
+                status = 1;
+            }
+        }
+        if (!useStdin)
+            close(in);
+    }
+
+    sigaction(SIGINT, &old, NULL);
+    return cat_interrupted ? -1 : status;
+}
+
+int smallsh_parallel(char **args, struct sigaction sa_SIGINT, struct background *bg)
+{
+    // Default to one job per CPU
+    long njobs = sysconf(_SC_NPROCESSORS_ONLN);
+    if (args[1] != NULL)
+    {
+        char *count = NULL;
+        if (strmatch(args[1], "-j"))
+            count = args[2];
+        else if (strncmp(args[1], "-j", 2) == 0)
+            count = args[1] + 2;
+        char *end = NULL;
+        if (count != NULL)
+            njobs = strtol(count, &end, 10);
+        if (count == NULL || *count == '\0' || *end != '\0' || njobs < 1 || args[strmatch(args[1], "-j") ? 3 : 2] != NULL)
+        {
+            fprintf(stderr, "parallel: usage: parallel [-j N] < commands\n");
+            return 2;
+        }
+    }
+    if (njobs < 1)
+        njobs = 1;
+
+    // Without "<" or a pipe, stdin is where the shell reads the script from, which is
+    // already buffered ahead and isn't a list of commands for parallel anyway
+    struct stat in;
+    if (script_on_stdin && fstat(STDIN_FILENO, &in) == 0 && in.st_dev == script_stdin.st_dev && in.st_ino == script_stdin.st_ino)
+    {
+        fprintf(stderr, "parallel: stdin is the script; give the commands with <\n");
+        return 2;
+    }
+
+    struct line_source src;
+    open_stream(STDIN_FILENO, &src);
+    struct pipeline pl = {0};
+    struct parallel_slot *slots = calloc(njobs, sizeof(struct parallel_slot));
+    int running = 0;
+    long started = 0, failed = 0;
+    bool more = true;
+
+    while (more || running > 0)
+    {
+        // Start commands until every slot is busy
+        while (more && running < njobs)
+        {
+            char *line = read_command(&src);
+            if (line == NULL)
+            {
+                more = false;
+                break;
+            }
+            reset_pipeline(&pl);
+            if (!parse_command(line, &pl))
+            {
+                fprintf(stderr, "parallel: line %ld: syntax error\n", src.lineno);
+                started++;
+                failed++;
+                continue;
+            }
+            if (pl.ncmds == 0) // Empty line or comment
+                continue;
+
+            // Every line runs like a foreground command, but mustn't read our list of commands
+            pl.run_in_bg = false;
+            for (int i = 0; i < pl.ncmds; i++)
+                pl.cmds[i].run_in_bg = false;
+            if (!redirects_fd(&pl.cmds[0], STDIN_FILENO))
+                add_redirect(&pl.mem, &pl.cmds[0], REDIR_IN, STDIN_FILENO, "/dev/null", -1);
+
+            struct parallel_slot *slot = slots;
+            while ((*slot).nalive > 0)
+                slot++;
+            (*slot).pids = realloc((*slot).pids, sizeof(pid_t) * pl.ncmds);
+            (*slot).npids = pl.ncmds;
+            launch_pipeline(&pl, sa_SIGINT, (*slot).pids, false); // Stays in our group, so Ctrl-C reaches it
+            started++;
+
+            for (int i = 0; i < pl.ncmds; i++)
+                if ((*slot).pids[i] != -1)
+                    (*slot).nalive++;
+            if ((*slot).pids[pl.ncmds - 1] == -1) // Same status the fork path's child exits with
+                (*slot).status = W_EXITCODE(1, 0);
+            else
+                (*slot).status = 0;
+
+            if ((*slot).nalive > 0)
+                running++;
+            else if ((*slot).status != 0) // Nothing could be started
+                failed++;
+        }
+        if (running == 0)
+            continue;
+
+        // Wait for any child; those that aren't ours are background processes finishing
+        int status;
+        pid_t pid = wait_child(bg, &status, 0);
+        if (pid == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        bool found = false;
+        for (int s = 0; s < njobs && !found; s++)
+            for (int i = 0; i < slots[s].npids && slots[s].nalive > 0; i++)
+                if (slots[s].pids[i] == pid)
+                {
+                    found = true;
+                    slots[s].pids[i] = -1;
+                    if (i == slots[s].npids - 1) // A pipeline's status is its last stage's
+                        slots[s].status = status;
+                    if (--slots[s].nalive == 0) // The whole line is done, free the slot
+                    {
+                        running--;
+                        if (slots[s].status != 0)
+                            failed++;
+                    }
+                    break;
+                }
+        if (!found)
+            job_update(bg, pid, status);
+    }
+
+    // Clean up
+    for (int s = 0; s < njobs; s++)
+        free(slots[s].pids);
+    free(slots);
+    arena_free(&pl.mem);
+    free(pl.cmds);
+    free(src.buf);
+
+    if (failed > 0)
+        fprintf(stderr, "parallel: %ld of %ld jobs failed\n", failed, started);
+    fflush(stdout);
+    return failed > 255 ? 255 : failed; // Number of failed jobs
+}
+
+int smallsh_wait(char **args, struct background *bg)
+{
+    int result = 0;
+    if (args[1] == NULL) // Wait for every running background job
+    {
+        while (true)
+        {
+            bool running = false;
+            for (int j = 0; j < (*bg).njobs && !running; j++)
+                running = (*(*bg).jobs[j]).state == JOB_RUNNING;
+            if (!running)
+                break;
+
+            int status;
+            pid_t pid = wait_child(bg, &status, WUNTRACED);
+            if (pid == -1 && errno != EINTR)
+                break;
+            if (pid > 0)
+                job_update(bg, pid, status);
+        }
+        job_report(bg);
+        return 0;
+    }
+
+    // Wait for each job in turn; the status is that of the last one
+    for (int i = 1; args[i] != NULL; i++)
+    {
+        struct job *job = job_find(bg, args[i]);
+        if (job == NULL)
+        {
+            fprintf(stderr, "wait: %s is not a background job of this shell\n", args[i]);
+            result = 127;
+            continue;
+        }
+
+        while ((*job).state == JOB_RUNNING)
+        {
+            int status;
+            pid_t pid = wait_child(bg, &status, WUNTRACED);
+            if (pid == -1)
+            {
+                if (errno == EINTR)
+                    continue;
+                break;
+            }
+            job_update(bg, pid, status);
+        }
+
+        int status = (*job).status[(*job).npids - 1];
+        if ((*job).state == JOB_STOPPED)
+            result = 128 + (*job).stopsig;
+        else
+            result = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+        job_report(bg); // Frees the job if it is done
+    }
+    fflush(stdout);
+    return result;
+}
+
+/**
+ * Send a signal to every process of a job
+ *
+ * @return 0, or -1 if the signal could not be sent
+ */
+static int job_signal(struct job *job, int sig)
+{
+    if ((*job).pgid != -1)
+        return killpg((*job).pgid, sig);
+
+    int result = 0;
+    for (int i = 0; i < (*job).npids; i++)
+        if ((*job).pids[i] != -1 && kill((*job).pids[i], sig) == -1)
+            result = -1;
+    return result;
+}
+
+/**
+ * Word describing the state of a job, as listed by "jobs"
+ */
+static const char *job_state_name(struct job *job)
+{
+    if ((*job).state == JOB_RUNNING)
+        return "Running";
+    if ((*job).state == JOB_STOPPED)
+        return "Stopped";
+    return "Done";
+}
+
+int smallsh_jobs(char **args, struct background *bg)
+{
+    bool pgids = args[1] != NULL && strmatch(args[1], "-p");
+    if (args[1] != NULL && (!pgids || args[2] != NULL))
+    {
+        fprintf(stderr, "jobs: usage: jobs [-p]\n");
+        return 2;
+    }
+
+    run_bg_census(bg); // Finished jobs are reported and dropped first
+    for (int j = 0; j < (*bg).njobs; j++)
+    {
+        struct job *job = (*bg).jobs[j];
+        if (pgids)
+            printf("%d\n", (*job).pgid != -1 ? (*job).pgid : (*job).shown);
+        else
+            printf("[%d]%c  %-24s%s\n", (*job).id, (*job).id == (*bg).current ? '+' : ' ', job_state_name(job),
+                   (*job).text);
+        (*job).notified = true;
+    }
+    fflush(stdout);
+    return 0;
+}
+
+int smallsh_fg(char **args, struct background *bg, int *lastExit)
+{
+    if (!job_control)
+    {
+        fprintf(stderr, "fg: no job control\n");
+        return 1;
+    }
+    struct job *job = job_find(bg, args[1]);
+    if (job == NULL || (*job).state == JOB_DONE)
+    {
+        fprintf(stderr, "fg: %s: no such job\n", args[1] != NULL ? args[1] : "current");
+        return 1;
+    }
+
+    printf("%s\n", (*job).text);
+    fflush(stdout);
+    if ((*job).state == JOB_STOPPED)
+    {
+        (*job).state = JOB_RUNNING;
+        job_signal(job, SIGCONT);
+    }
+    job_foreground(bg, job, lastExit);
+    return 0;
+}
+
+int smallsh_bg(char **args, struct background *bg)
+{
+    int result = 0;
+    int i = 1;
+    do // With no arguments, continue the current job
+    {
+        struct job *job = job_find(bg, args[i]);
+        if (job == NULL || (*job).state == JOB_DONE)
+        {
+            fprintf(stderr, "bg: %s: no such job\n", args[i] != NULL ? args[i] : "current");
+            result = 1;
+            continue;
+        }
+        if ((*job).state == JOB_RUNNING)
+        {
+            fprintf(stderr, "bg: job %d already in background\n", (*job).id);
+            continue;
+        }
+
+        (*job).state = JOB_RUNNING;
+        (*job).notified = true;
+        job_signal(job, SIGCONT);
+        printf("[%d]+ %s &\n", (*job).id, (*job).text);
+    } while (args[i] != NULL && args[++i] != NULL);
+    fflush(stdout);
+    return result;
+}
+
+/**
+ * Number of a signal given by number or by name, with or without "SIG" in front
+ *
+ * @return the signal number, or -1 if there is no such signal
+ */
+static int signal_number(const char *name)
+{
+    char *end;
+    long num = strtol(name, &end, 10);
+    if (*name != '\0' && *end == '\0')
+        return num >= 0 && num < NSIG ? num : -1;
+
+    if (strncasecmp(name, "SIG", 3) == 0)
+        name += 3;
+    for (int sig = 1; sig < NSIG; sig++)
+    {
+        const char *abbrev = sigabbrev_np(sig);
+        if (abbrev != NULL && strcasecmp(abbrev, name) == 0)
+            return sig;
+    }
+    return -1;
+}
+
+int smallsh_kill(char **args, struct background *bg)
+{
+    if (args[1] != NULL && strmatch(args[1], "-l")) // List the signal names
+    {
+        for (int sig = 1; sig < NSIG; sig++)
+            if (sigabbrev_np(sig) != NULL)
+                printf("%2d) SIG%s\n", sig, sigabbrev_np(sig));
+        fflush(stdout);
+        return 0;
+    }
+
+    int sig = SIGTERM;
+    int i = 1;
+    if (args[1] != NULL && strmatch(args[1], "-s"))
+    {
+        sig = args[2] != NULL ? signal_number(args[2]) : -1;
+        i = 3;
+    }
+    else if (args[1] != NULL && args[1][0] == '-')
+    {
+        sig = signal_number(args[1] + 1);
+        i = 2;
+    }
+    if (sig == -1 && args[i - 1] != NULL)
+    {
+        fprintf(stderr, "kill: %s: invalid signal specification\n", args[i - 1]);
+        return 2;
+    }
+    if (sig == -1 || args[i] == NULL)
+    {
+        fprintf(stderr, "kill: usage: kill [-s SIG | -SIG] %%job|pid ... or kill -l\n");
+        return 2;
+    }
+
+    int result = 0;
+    for (; args[i] != NULL; i++)
+    {
+        if (args[i][0] == '%') // A job: signal its whole process group
+        {
+            struct job *job = job_find(bg, args[i]);
+            if (job == NULL || (*job).state == JOB_DONE)
+            {
+                fprintf(stderr, "kill: %s: no such job\n", args[i]);
+                result = 1;
+                continue;
+            }
+            if (job_signal(job, sig) == -1)
+            {
+                fprintf(stderr, "kill: %s: %s\n", args[i], strerror(errno));
+                result = 1;
+            }
+            else if ((*job).state == JOB_STOPPED && sig != SIGSTOP && sig != SIGTSTP && sig != SIGCONT && sig != 0)
+                job_signal(job, SIGCONT); // Otherwise the signal waits until the job is continued
+            continue;
+        }
+
+        char *end;
+        long pid = strtol(args[i], &end, 10);
+        if (*args[i] == '\0' || *end != '\0')
+        {
+            fprintf(stderr, "kill: %s: arguments must be process or job IDs\n", args[i]);
+            result = 1;
+        }
+        else if (kill(pid, sig) == -1)
+        {
+            fprintf(stderr, "kill: (%ld) - %s\n", pid, strerror(errno));
+            result = 1;
+        }
+    }
+    fflush(stderr);
+    return result;
+}
+
+// Resource limits ulimit can set, in the order of a command's launch_opts values
+static const struct limit_kind limit_kinds[NLIMITS] = {
+    {'v', RLIMIT_AS, 1024, "virtual memory (kbytes)"},
+    {'t', RLIMIT_CPU, 1, "cpu time (seconds)"},
+    {'n', RLIMIT_NOFILE, 1, "open files"},
+};
+
+bool parse_cpu_list(const char *list, cpu_set_t *set)
+{
+    CPU_ZERO(set);
+    const char *p = list;
+    while (true)
+    {
+        char *end;
+        if (*p < '0' || *p > '9')
+            return false;
+        long first = strtol(p, &end, 10);
+        long last = first;
+        if (*end == '-') // A range
+        {
+            p = end + 1;
+            if (*p < '0' || *p > '9')
+                return false;
+            last = strtol(p, &end, 10);
+        }
+        if (last < first || last >= CPU_SETSIZE)
+            return false;
+        for (long cpu = first; cpu <= last; cpu++)
+            CPU_SET(cpu, set);
+        if (*end == '\0')
+            return true;
+        if (*end != ',')
+            return false;
+        p = end + 1;
+    }
+}
+
+/**
+ * Print a CPU set the way parse_cpu_list() reads it, with runs collapsed into ranges
+ */
+static void print_cpu_list(const char *label, const cpu_set_t *set)
+{
+    printf("%s: ", label);
+    const char *sep = "";
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    {
+        if (!CPU_ISSET(cpu, set))
+            continue;
+        int last = cpu;
+        while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, set))
+            last++;
+        if (last == cpu)
+            printf("%s%d", sep, cpu);
+        else
+            printf("%s%d-%d", sep, cpu, last);
+        sep = ",";
+        cpu = last;
+    }
+    printf("\n");
+}
+
+/**
+ * The limit_kinds entry for an option such as "-v", or NULL
+ */
+static const struct limit_kind *limit_option(const char *opt)
+{
+    if (opt == NULL || opt[0] != '-' || opt[1] == '\0' || opt[2] != '\0')
+        return NULL;
+    for (int i = 0; i < NLIMITS; i++)
+        if (limit_kinds[i].flag == opt[1])
+            return &limit_kinds[i];
+    return NULL;
+}
+
+/**
+ * Parse a limit given to ulimit: a number of the kind's units, or "unlimited"
+ */
+static bool parse_limit(const char *str, const struct limit_kind *kind, rlim_t *value)
+{
+    if (strmatch(str, "unlimited"))
+    {
+        *value = RLIM_INFINITY;
+        return true;
+    }
+    char *end;
+    errno = 0;
+    unsigned long long n = strtoull(str, &end, 10);
+    if (*str < '0' || *str > '9' || *end != '\0' || errno == ERANGE || n >= RLIM_INFINITY / (*kind).unit)
+        return false;
+    *value = n * (*kind).unit;
+    return true;
+}
+
+/**
+ * The launch settings of a command, allocated the first time a prefix sets one
+ */
+static struct launch_opts *command_opts(struct arena *mem, struct command *cmd)
+{
+    if ((*cmd).opts == NULL)
+    {
+        (*cmd).opts = arena_alloc(mem, sizeof(struct launch_opts));
+        memset((*cmd).opts, 0, sizeof(struct launch_opts));
+    }
+    return (*cmd).opts;
+}
+
+int take_prefixes(struct arena *mem, struct command *cmd)
+{
+    int taken = 0;
+    while ((*cmd).nargs > 0)
+    {
+        char **args = (*cmd).args;
+        char first = args[0][0];
+        if (first != 'a' && first != 'n' && first != 'u') // Not worth comparing
+            break;
+
+        int used; // Words making up the prefix
+        if (strmatch(args[0], "affinity") && args[1] != NULL && !strmatch(args[1], "-b") && args[2] != NULL)
+        {
+            cpu_set_t cpus;
+            if (!parse_cpu_list(args[1], &cpus))
+            {
+                fprintf(stderr, "affinity: %s: invalid CPU list\n", args[1]);
+                return -1;
+            }
+            struct launch_opts *opts = command_opts(mem, cmd);
+            (*opts).cpus = cpus;
+            (*opts).has_cpus = true;
+            used = 2;
+        }
+        else if (strmatch(args[0], "nice") && args[1] != NULL)
+        {
+            // "nice -n N", "nice N", or a bare "nice", which adds 10 like nice(1)
+            long adjust = 10;
+            char *end;
+            used = 1;
+            if (strmatch(args[1], "-n"))
+            {
+                if (args[2] == NULL || (adjust = strtol(args[2], &end, 10), *args[2] == '\0' || *end != '\0'))
+                {
+                    fprintf(stderr, "nice: %s: invalid adjustment\n", args[2] ? args[2] : "");
+                    return -1;
+                }
+                used = 3;
+            }
+            else if (adjust = strtol(args[1], &end, 10), *args[1] != '\0' && *end == '\0')
+                used = 2;
+            else
+                adjust = 10;
+            if (args[used] == NULL) // No command after it, so it's the built-in
+                break;
+            (*command_opts(mem, cmd)).nice += adjust;
+        }
+        else if (strmatch(args[0], "ulimit"))
+        {
+            rlim_t values[NLIMITS];
+            unsigned given = 0;
+            const struct limit_kind *kind;
+            used = 1;
+            while ((kind = limit_option(args[used])) != NULL && args[used + 1] != NULL)
+            {
+                int i = kind - limit_kinds;
+                if (!parse_limit(args[used + 1], kind, &values[i]))
+                {
+                    fprintf(stderr, "ulimit: %s: invalid limit\n", args[used + 1]);
+                    return -1;
+                }
+                given |= 1u << i;
+                used += 2;
+            }
+            if (given == 0 || args[used] == NULL) // No command after it, so it's the built-in
+                break;
+            struct launch_opts *opts = command_opts(mem, cmd);
+            for (int i = 0; i < NLIMITS; i++)
+                if (given & (1u << i))
+                    (*opts).values[i] = values[i];
+            (*opts).limits |= given;
+        }
+        else
+            break;
+
+        // Keep the prefix words in front of args, for the job's text
+        (*cmd).args += used;
+        (*cmd).nargs -= used;
+        (*cmd).cap -= used;
+        (*cmd).prefix += used;
+        taken = 1;
+    }
+    return taken;
+}
+
+/**
+ * CPUs a command runs on: its own, the background default, or NULL to stay on the shell's
+ */
+static cpu_set_t *launch_cpus(struct command *cmd)
+{
+    if ((*cmd).opts != NULL && (*(*cmd).opts).has_cpus)
+        return &(*(*cmd).opts).cpus;
+    return (*cmd).run_in_bg && bg_cpus_set ? &bg_cpus : NULL;
+}
+
+/**
+ * Whether a command has settings only a forked child can apply to itself
+ *
+ * The shell could put on a CPU set and take it off again around posix_spawn, but
+ * it could not get its niceness or a lowered hard limit back.
+ */
+static bool needs_fork(struct command *cmd)
+{
+    return (*cmd).opts != NULL && ((*(*cmd).opts).nice != 0 || (*(*cmd).opts).limits != 0);
+}
+
+/**
+ * Apply a command's CPU set, niceness and limits to the calling process, a child about to exec
+ */
+static bool apply_launch_opts(struct command *cmd)
+{
+    cpu_set_t *cpus = launch_cpus(cmd);
+    if (cpus != NULL && sched_setaffinity(0, sizeof(cpu_set_t), cpus) == -1)
+    {
+        fprintf(stderr, "%s: cannot set CPU affinity: %s\n", (*cmd).args[0], strerror(errno));
+        return false;
+    }
+    struct launch_opts *opts = (*cmd).opts;
+    if (opts == NULL)
+        return true;
+
+    errno = 0;
+    if ((*opts).nice != 0 && nice((*opts).nice) == -1 && errno != 0)
+    {
+        fprintf(stderr, "%s: cannot set niceness: %s\n", (*cmd).args[0], strerror(errno));
+        return false;
+    }
+    for (int i = 0; i < NLIMITS; i++)
+    {
+        if (!((*opts).limits & (1u << i)))
+            continue;
+        // Hard limit too, so the command can't raise it again
+        struct rlimit rl = {(*opts).values[i], (*opts).values[i]};
+        if (setrlimit(limit_kinds[i].resource, &rl) == -1)
+        {
+            fprintf(stderr, "%s: cannot set limit -%c: %s\n", (*cmd).args[0], limit_kinds[i].flag, strerror(errno));
+            return false;
+        }
+    }
+    return true;
+}
+
+int smallsh_affinity(char **args)
+{
+    bool background = args[1] != NULL && strmatch(args[1], "-b");
+    char *list = args[background ? 2 : 1];
+    if (list != NULL && args[background ? 3 : 2] != NULL)
+    {
+        fprintf(stderr, "affinity: usage: affinity [-b] [CPUS] [command [args...]]\n");
+        return 2;
+    }
+
+    cpu_set_t set;
+    if (list == NULL) // Show the sets
+    {
+        if (!background && sched_getaffinity(0, sizeof(set), &set) == 0)
+            print_cpu_list("shell", &set);
+        if (bg_cpus_set)
+            print_cpu_list("background", &bg_cpus);
+        else
+            printf("background: same as shell\n");
+        fflush(stdout);
+        return 0;
+    }
+    if (background && strmatch(list, "all")) // Back to the shell's own set
+    {
+        bg_cpus_set = false;
+        return 0;
+    }
+    if (!parse_cpu_list(list, &set))
+    {
+        fprintf(stderr, "affinity: %s: invalid CPU list\n", list);
+        return 1;
+    }
+    if (background)
+    {
+        bg_cpus = set;
+        bg_cpus_set = true;
+    }
+    else if (sched_setaffinity(0, sizeof(set), &set) == -1) // Every later command inherits it
+    {
+        fprintf(stderr, "affinity: cannot set CPU affinity: %s\n", strerror(errno));
+        return 1;
+    }
+    return 0;
+}
+
+int smallsh_nice(char **args)
+{
+    if (args[1] != NULL) // An adjustment with no command after it
+    {
+        fprintf(stderr, "nice: usage: nice [-n N | N] command [args...]\n");
+        return 2;
+    }
+    printf("%d\n", getpriority(PRIO_PROCESS, 0));
+    fflush(stdout);
+    return 0;
+}
+
+/**
+ * Print the shell's soft limit of one kind
+ */
+static void show_limit(const struct limit_kind *kind)
+{
+    struct rlimit rl;
+    getrlimit((*kind).resource, &rl);
+    if (rl.rlim_cur == RLIM_INFINITY)
+        printf("-%c: %-24s unlimited\n", (*kind).flag, (*kind).name);
+    else
+        printf("-%c: %-24s %llu\n", (*kind).flag, (*kind).name, (unsigned long long)(rl.rlim_cur / (*kind).unit));
+}
+
+int smallsh_ulimit(char **args)
+{
+    int status = 0;
+    if (args[1] == NULL) // List them all
+        for (int i = 0; i < NLIMITS; i++)
+            show_limit(&limit_kinds[i]);
+    for (int i = 1; args[i] != NULL; i++)
+    {
+        const struct limit_kind *kind = limit_option(args[i]);
+        if (kind == NULL)
+        {
+            fprintf(stderr, "ulimit: usage: ulimit [-v KBYTES] [-t SECONDS] [-n FILES] [command [args...]]\n");
+            status = 2;
+            break;
+        }
+        if (args[i + 1] == NULL || limit_option(args[i + 1]) != NULL) // No value, show it
+        {
+            show_limit(kind);
+            continue;
+        }
+
+        // Only the soft limit, so it can be raised again up to the hard one
+        rlim_t value;
+        struct rlimit rl;
+        i++;
+        if (!parse_limit(args[i], kind, &value))
+        {
+            fprintf(stderr, "ulimit: %s: invalid limit\n", args[i]);
+            status = 1;
+            continue;
+        }
+        getrlimit((*kind).resource, &rl);
+        rl.rlim_cur = value;
+        if (setrlimit((*kind).resource, &rl) == -1)
+        {
+            fprintf(stderr, "ulimit: -%c: cannot set limit: %s\n", (*kind).flag, strerror(errno));
+            status = 1;
+        }
+    }
+    fflush(stdout);
+    return status;
+}
+
+void launch_pipeline(struct pipeline *pl, struct sigaction sa_SIGINT, pid_t *pids, bool group)
+{
+    // With job control, the first stage to start leads a new process group the others join
+    pid_t pgid = group && job_control ? 0 : -1;
+
+    // Launch every stage, connecting stage i's stdout to stage i + 1's stdin
+    int n = (*pl).ncmds;
+    int prevRead = -1; // Read end of the pipe feeding the current stage
+    for (int i = 0; i < n; i++)
+    {
+        struct command *cmd = &(*pl).cmds[i];
+
+        int fds[2] = {-1, -1};
+        if (i < n - 1 && pipe2(fds, O_CLOEXEC) == -1)
+        {
+            fprintf(stderr, "out of resources\n");
+            exit(EXIT_FAILURE);
+        }
+
+        // Create a new process; relays are shell children, so they always fork, and so do
+        // commands with a niceness or limits, which posix_spawn has no attributes for
+        long long phase = trace_now();
+        if (take_prefixes(&(*pl).mem, cmd) == -1)
+            pids[i] = -1;
+        else if (launch_mode == LAUNCH_FORK || (n > 1 && is_relay_stage(cmd)) || needs_fork(cmd))
+            pids[i] = fork_command(cmd, sa_SIGINT, prevRead, fds[1], pgid);
+        else
+            pids[i] = spawn_command(cmd, prevRead, fds[1], pgid);
+        trace_event("spawn", "shell", phase, trace.pid, (*cmd).args[0]);
+        if (pids[i] != -1)
+        {
+            stats_start(pids[i], (*cmd).args[0]);
+            if (pgid == 0) // The group now exists; a foreground job gets the terminal
+            {
+                pgid = pids[i];
+                if (!(*pl).run_in_bg)
+                    tcsetpgrp(STDIN_FILENO, pgid);
+            }
+        }
+
+        // The children hold their own copies of the pipe ends now
+        if (prevRead != -1)
+            close(prevRead);
+        if (fds[1] != -1)
+            close(fds[1]);
+        prevRead = fds[0];
+    }
+}
+
+void run_non_builtin(struct pipeline *pl, int *lastExit, struct sigaction sa_SIGINT, struct background *bg)
+{
+    // A lot of this code comes from the Module 4 explorations
+
+    int n = (*pl).ncmds;
+    pid_t *pids = malloc(sizeof(pid_t) * n);
+
+    // In capture mode, a background pipeline's output goes to a log instead of /dev/null
+    struct job_log *log = NULL;
+    int captureFd = -1;
+    if ((*pl).run_in_bg && capture.enabled)
+    {
+        log = capture_start(&captureFd);
+        for (int i = 0; i < n; i++)
+            (*pl).cmds[i].capture_fd = captureFd;
+    }
+    launch_pipeline(pl, sa_SIGINT, pids, true);
+    if (captureFd != -1) // Only the children write to it
+        close(captureFd);
+
+    if (!((*pl).run_in_bg)) // Pipeline not running in background, so wait until it completes or is stopped
+        job_foreground(bg, job_new(bg, pl, pids, job_control), lastExit);
+    else // Pipeline running in the background, don't wait
+    {
+        // Print a message about the background PID of the last stage that started
+        for (int i = n - 1; i >= 0; i--)
+            if (pids[i] != -1)
+            {
+                printf("background pid: %d\n", pids[i]);
+                vars.lastbg = pids[i];
+                struct job *job = job_new(bg, pl, pids, job_control); // Keep an eye on it
+                if (log != NULL)
+                {
+                    (*job).log = log;
+                    (*log).id = (*job).id;
+                    (*log).pid = (*job).shown;
+                    (*log).text = strdup((*job).text);
+                    log = NULL;
+                }
+                break;
+            }
+        if (log != NULL) // Nothing started, nothing to capture
+            (*log).finished = true;
+    }
+
+    free(pids);
+}
+
+/**
+ * Whether a dup redirect copies a descriptor the child will have: 0-2, one an earlier
+ * redirect of the command opens, or one open in the shell that isn't the shell's own
+ */
+static bool dup_target_ok(struct command *cmd, int upTo)
+{
+    int target = (*cmd).redirs[upTo].target;
+    if (target <= STDERR_FILENO)
+        return true;
+    for (int i = 0; i < upTo; i++)
+        if ((*cmd).redirs[i].fd == target)
+            return true;
+    return !fd_owned(target) && fcntl(target, F_GETFD) != -1;
+}
+
+pid_t spawn_command(struct command *cmd, int pipeIn, int pipeOut, pid_t pgid)
+{
+    // Background processes read and write /dev/null where nothing else is given
+    bool nullIn = (*cmd).run_in_bg && pipeIn == -1 && !redirects_fd(cmd, STDIN_FILENO);
+    bool nullOut = (*cmd).run_in_bg && pipeOut == -1 && (*cmd).capture_fd == -1 && !redirects_fd(cmd, STDOUT_FILENO);
+
+    // Open redirect files here rather than in the child so errors can be reported directly.
+    // O_CLOEXEC keeps them out of the child except where a dup2 action places them.
+    int nredirs = (*cmd).nredirs;
+    int files[nredirs + 1]; // Descriptor opened for each redirect, -1 for dups
+    int nullFd = -1;
+    bool highFds = false; // Some redirect names a descriptor a file could have been opened on
+    for (int i = 0; i < nredirs; i++)
+        highFds |= (*cmd).redirs[i].fd > STDERR_FILENO || (*cmd).redirs[i].target > STDERR_FILENO;
+
+    long long phase = trace_now();
+    int opened = 0;
+    bool failed = false;
+    for (; opened < nredirs && !failed; opened++)
+    {
+        struct redirect *r = &(*cmd).redirs[opened];
+        files[opened] = -1;
+        if ((*r).type == REDIR_DUP)
+        {
+            if (!dup_target_ok(cmd, opened))
+            {
+                fprintf(stderr, "%d: bad file descriptor\n", (*r).target);
+                failed = true;
+            }
+            continue;
+        }
+        files[opened] = open_redirect(r);
+        if (files[opened] == -1)
+        {
+            redirect_error(r);
+            failed = true;
+        }
+        else if (highFds && files[opened] <= MAX_REDIRECT_FD) // Move it where no dup action can clobber it
+        {
+            int moved = fcntl(files[opened], F_DUPFD_CLOEXEC, MAX_REDIRECT_FD + 1);
+            close(files[opened]);
+            files[opened] = moved;
+        }
+    }
+    if (!failed && (nullIn || nullOut) && (nullFd = open("/dev/null", O_RDWR | O_CLOEXEC)) == -1)
+    {
+        fprintf(stderr, "cannot open file /dev/null for %s\n", nullIn ? "input" : "output");
+        failed = true;
+    }
+    if (nredirs > 0 || nullFd != -1)
+        trace_event("redirect", "shell", phase, trace.pid, (*cmd).args[0]);
+
+    // Find the executable without trying execve on every PATH entry
+    char *path = NULL;
+    if (!failed)
+    {
+        phase = trace_now();
+        path = resolve_command((*cmd).args[0]);
+        trace_event("resolve", "shell", phase, trace.pid, (*cmd).args[0]);
+        if (path == NULL)
+        {
+            fprintf(stderr, "%s: no such file or directory\n", (*cmd).args[0]);
+            failed = true;
+        }
+    }
+
+    // There is no spawn attribute for affinity, but the child inherits the shell's CPU set,
+    // so the shell moves onto the command's set just while it spawns it
+    cpu_set_t *cpus = failed ? NULL : launch_cpus(cmd);
+    cpu_set_t shellCpus;
+    if (cpus != NULL && (sched_getaffinity(0, sizeof(shellCpus), &shellCpus) == -1 || sched_setaffinity(0, sizeof(cpu_set_t), cpus) == -1))
+    {
+        fprintf(stderr, "%s: cannot set CPU affinity: %s\n", (*cmd).args[0], strerror(errno));
+        failed = true;
+    }
+    if (failed)
+    {
+        for (int i = 0; i < opened; i++)
+            if (files[i] != -1)
+                close(files[i]);
+        if (nullFd != -1)
+            close(nullFd);
+        return -1;
+    }
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+#ifdef __GLIBC_PREREQ
+#if __GLIBC_PREREQ(2, 35)
+    // A foreground job takes the terminal before it runs, while fd 0 is still the shell's
+    if (pgid != -1 && job_control && !((*cmd).run_in_bg))
+        posix_spawn_file_actions_addtcsetpgrp_np(&actions, STDIN_FILENO);
+#endif
+#endif
+    // Pipes and defaults first, so redirects (applied in order) can override or copy them
+    if (pipeIn != -1)
+        posix_spawn_file_actions_adddup2(&actions, pipeIn, STDIN_FILENO); // Read from the previous stage
+    else if (nullIn)
+        posix_spawn_file_actions_adddup2(&actions, nullFd, STDIN_FILENO);
+    if (pipeOut != -1)
+        posix_spawn_file_actions_adddup2(&actions, pipeOut, STDOUT_FILENO); // Write to the next stage
+    else if ((*cmd).capture_fd != -1)
+        posix_spawn_file_actions_adddup2(&actions, (*cmd).capture_fd, STDOUT_FILENO); // Write to the job's log
+    else if (nullOut)
+        posix_spawn_file_actions_adddup2(&actions, nullFd, STDOUT_FILENO);
+    if ((*cmd).capture_fd != -1)
+        posix_spawn_file_actions_adddup2(&actions, (*cmd).capture_fd, STDERR_FILENO);
+    for (int i = 0; i < nredirs; i++)
+    {
+        struct redirect *r = &(*cmd).redirs[i];
+        posix_spawn_file_actions_adddup2(&actions, (*r).type == REDIR_DUP ? (*r).target : files[i], (*r).fd);
+    }
+
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setsigmask(&attr, &child_sigmask); // Don't pass on the shell's blocked SIGCHLD
+    short flags = POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF;
+    sigset_t sigdef; // Terminal signals ignored for job control go back to their defaults
+    sigemptyset(&sigdef);
+    sigaddset(&sigdef, SIGTTIN);
+    sigaddset(&sigdef, SIGTTOU);
+    if (!((*cmd).run_in_bg)) // Foreground children get the default SIGINT action back
+        sigaddset(&sigdef, SIGINT);
+    posix_spawnattr_setsigdefault(&attr, &sigdef);
+    if (pgid != -1) // Start or join the job's process group
+    {
+        posix_spawnattr_setpgroup(&attr, pgid);
+        flags |= POSIX_SPAWN_SETPGROUP;
+    }
+    posix_spawnattr_setflags(&attr, flags);
+
+    // Make sure nothing buffered by the shell is written after the child's output
+    fflush(stdout);
+
+    // A caught signal goes back to its default in the child, so while a loop catches
+    // Ctrl-C the shell ignores it again just for starting a background child
+    struct sigaction ignore = {0}, loopSIGINT;
+    ignore.sa_handler = SIG_IGN;
+    bool reignore = (*cmd).run_in_bg && loop_catching;
+    if (reignore)
+        sigaction(SIGINT, &ignore, &loopSIGINT);
+
+    pid_t pid;
+    int err = posix_spawn(&pid, path, &actions, &attr, (*cmd).args, var_envp());
+    if (reignore)
+        sigaction(SIGINT, &loopSIGINT, NULL);
+
+    if (cpus != NULL)
+        sched_setaffinity(0, sizeof(shellCpus), &shellCpus);
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+    for (int i = 0; i < nredirs; i++)
+        if (files[i] != -1)
+            close(files[i]);
+    if (nullFd != -1)
+        close(nullFd);
+
+    if (err != 0)
+    {
+        if (err == EAGAIN || err == ENOMEM) // Same as a failed fork
+        {
+            fprintf(stderr, "out of resources\n");
+            exit(EXIT_FAILURE);
+        }
+        fprintf(stderr, "%s: no such file or directory\n", (*cmd).args[0]);
+        return -1;
+    }
+    return pid;
+}
+
+pid_t fork_command(struct command *cmd, struct sigaction sa_SIGINT, int pipeIn, int pipeOut, pid_t pgid)
+{
+    // Resolve in the parent so the result is cached for later commands
+    long long phase = trace_now();
+    char *path = is_relay_stage(cmd) ? NULL : resolve_command((*cmd).args[0]);
+    trace_event("resolve", "shell", phase, trace.pid, (*cmd).args[0]);
+    char **envp = var_envp(); // Likewise for the environment
+
+    fflush(stdout);
+
+    pid_t pid = fork(); // Create a new process
+    if (pid < 0)        // The process failed, print an error and exit
+    {
+        fprintf(stderr, "out of resources\n");
+        exit(EXIT_FAILURE);
+    }
+    else if (pid == 0) // Child process
+    {
+        // Don't pass on the shell's blocked SIGCHLD
+        sigprocmask(SIG_SETMASK, &child_sigmask, NULL);
+        trace.len = 0; // The shell writes out its own pending events
+        phase = trace_now();
+
+        // Start or join the job's process group; a foreground job takes the terminal
+        // (SIGTTOU is still ignored here) before running anything
+        if (pgid != -1)
+        {
+            setpgid(0, pgid);
+            if (job_control && !((*cmd).run_in_bg))
+                tcsetpgrp(STDIN_FILENO, getpgrp());
+        }
+        struct sigaction sa_default = {0};
+        sa_default.sa_handler = SIG_DFL;
+        sigaction(SIGTTIN, &sa_default, NULL);
+        sigaction(SIGTTOU, &sa_default, NULL);
+        sigaction(SIGTSTP, &sa_default, NULL); // A relay stage never execs, so it would keep our handler
+
+        // Connect to the neighbouring pipeline stages
+        if (pipeIn != -1)
+            dup2(pipeIn, STDIN_FILENO);
+        if (pipeOut != -1)
+            dup2(pipeOut, STDOUT_FILENO);
+        else if ((*cmd).capture_fd != -1)
+            dup2((*cmd).capture_fd, STDOUT_FILENO); // Write to the job's log
+        if ((*cmd).capture_fd != -1)
+            dup2((*cmd).capture_fd, STDERR_FILENO);
+
+        if ((*cmd).run_in_bg) // Process is running in the background
+        {
+            sigaction(SIGINT, &sa_SIGINT, NULL); // Ignored, even if a loop in the shell catches it
+            struct redirect devNull = {REDIR_IN, STDIN_FILENO, "/dev/null", -1};
+            if (!redirects_fd(cmd, STDIN_FILENO) && pipeIn == -1)
+                handle_redirect(&devNull); // No input redirect or pipe, use /dev/null
+            devNull = (struct redirect){REDIR_OUT, STDOUT_FILENO, "/dev/null", -1};
+            if (!redirects_fd(cmd, STDOUT_FILENO) && pipeOut == -1 && (*cmd).capture_fd == -1)
+                handle_redirect(&devNull); // No output redirect, pipe or capture, use /dev/null
+        }
+        else // Process is not running in the background
+        {
+            // Set the SIGINT action to its default behavior
+            sa_SIGINT.sa_handler = SIG_DFL;
+            sigaction(SIGINT, &sa_SIGINT, NULL);
+        }
+
+        for (int i = 0; i < (*cmd).nredirs; i++) // In the order given, so "> f 2>&1" and "2>&1 > f" differ
+            handle_redirect(&(*cmd).redirs[i]);
+        trace_event("redirect", "shell", phase, getpid(), (*cmd).args[0]);
+        if (!apply_launch_opts(cmd))
+            exit(EXIT_FAILURE);
+        trace_flush(); // Nothing buffered survives execve
+
+        // Bare "cat"/"tee FILE" stages are relayed by the shell itself in zero-copy mode
+        if ((pipeIn != -1 || pipeOut != -1) && is_relay_stage(cmd))
+            relay_stage(cmd);
+
+        // Execute command
+        if (path != NULL)
+            execve(path, (*cmd).args, envp);
+
+        // An error occurred, print an error and exit
+        fprintf(stderr, "%s: no such file or directory\n", (*cmd).args[0]);
+        exit(EXIT_FAILURE);
+    }
+    if (pgid != -1) // Also from the parent, so the group exists whichever of us runs first
+        setpgid(pid, pgid != 0 ? pgid : pid);
+    return pid; // Parent process
+}
+
+bool is_relay_stage(struct command *cmd)
+{
+    if (!zero_copy)
+        return false;
+    if (strmatch((*cmd).args[0], "cat") && (*cmd).nargs == 1)
+        return true;
+    return strmatch((*cmd).args[0], "tee") && (*cmd).nargs == 2 && (*cmd).args[1][0] != '-';
+}
+
+/**
+ * Check whether fd refers to a pipe, which splice and tee need on at least one side
+ */
+static bool is_pipe(int fd)
+{
+    struct stat sb;
+    return fstat(fd, &sb) == 0 && S_ISFIFO(sb.st_mode);
+}
+
+/**
+ * Copy stdin to stdout (and teeFd, if it is not -1) through a user-space buffer
+ *
+ * Used when splice/tee can't be, e.g. when neither end is a pipe or the kernel
+ * doesn't support splicing to the output (such as some terminals).
+ */
+static void relay_copy(int teeFd)
+{
+    char *buf = malloc(RELAY_CHUNK);
+    ssize_t n;
+    while ((n = read(STDIN_FILENO, buf, RELAY_CHUNK)) != 0)
+    {
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1 || !write_all(STDOUT_FILENO, buf, n) || (teeFd != -1 && !write_all(teeFd, buf, n)))
+            exit(EXIT_FAILURE);
+    }
+    exit(EXIT_SUCCESS);
+}
+
+/**
+ * Move *len bytes from in to out with splice, counting *len down as bytes move
+ *
+ * @return true on success, false if splice failed with *len bytes still to move
+ */
+static bool splice_all(int in, int out, size_t *len)
+{
+    while (*len > 0)
+    {
+        ssize_t n = splice(in, NULL, out, NULL, *len, SPLICE_F_MOVE);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        *len -= n;
+    }
+    return true;
+}
+
+void relay_stage(struct command *cmd)
+{
+    // Drop every descriptor but stdin/stdout, otherwise a stray pipe end could keep
+    // our input from ever reaching EOF
+    close_range(3, ~0U, 0);
+
+    int teeFd = -1;
+    if (strmatch((*cmd).args[0], "tee"))
+    {
+        teeFd = open((*cmd).args[1], O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (teeFd == -1)
+        {
+            fprintf(stderr, "cannot open file %s for output\n", (*cmd).args[1]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    bool inPipe = is_pipe(STDIN_FILENO);
+    bool outPipe = is_pipe(STDOUT_FILENO);
+
+    if (teeFd == -1) // "cat": move pages straight from input to output
+    {
+        if (!inPipe && !outPipe)
+            relay_copy(-1);
+        while (true)
+        {
+            ssize_t n = splice(STDIN_FILENO, NULL, STDOUT_FILENO, NULL, RELAY_CHUNK, SPLICE_F_MOVE);
+            if (n == 0)
+                exit(EXIT_SUCCESS);
+            if (n == -1 && errno == EINTR)
+                continue;
+            if (n == -1 && errno == EINVAL) // Output can't be spliced to, copy instead
+                relay_copy(-1);
+            if (n == -1)
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    // "tee": duplicate the input pipe's pages into the output pipe, then move them into the file.
+    // tee() needs pipes on both sides, so a non-pipe stdout gets a pipe of our own in front of it.
+    if (!inPipe)
+        relay_copy(teeFd);
+    int out = STDOUT_FILENO;
+    int bounce[2] = {-1, -1};
+    if (!outPipe)
+    {
+        if (pipe(bounce) == -1)
+            relay_copy(teeFd);
+        out = bounce[1];
+    }
+
+    while (true)
+    {
+        ssize_t n = tee(STDIN_FILENO, out, RELAY_CHUNK, 0);
+        if (n == 0)
+            exit(EXIT_SUCCESS);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1)
+            exit(EXIT_FAILURE);
+
+        // Consume the duplicated bytes from the input into the file
+        size_t left = n;
+        if (!splice_all(STDIN_FILENO, teeFd, &left))
+            exit(EXIT_FAILURE);
+
+        // Forward the copy from our own pipe to the real stdout
+        left = n;
+        if (bounce[0] != -1 && !splice_all(bounce[0], STDOUT_FILENO, &left))
+        {
+            // stdout can't be spliced to; drain the rest of the copy by hand
+            char buf[4096];
+            while (left > 0)
+            {
+                ssize_t m = read(bounce[0], buf, left < sizeof(buf) ? left : sizeof(buf));
+                if (m <= 0 || !write_all(STDOUT_FILENO, buf, m))
+                    exit(EXIT_FAILURE);
+                left -= m;
+            }
+        }
+    }
+}
+
+void handle_redirect(struct redirect *r)
+{
+    // This code takes from "Exploration: Processes and I/O"
+
+    int fd = (*r).type == REDIR_DUP ? (*r).target : open_redirect(r);
+    if (fd == -1)
+    {
+        // Error opening file; print error and exit
+        redirect_error(r);
+        exit(EXIT_FAILURE);
+    }
+    if ((*r).type == REDIR_DUP && fd_owned(fd)) // The shell's own descriptors are not the command's to copy
+    {
+        fprintf(stderr, "%d: bad file descriptor\n", fd);
+        exit(EXIT_FAILURE);
+    }
+    if (fd == (*r).fd) // Already in place; only the close-on-exec flag has to go
+    {
+        fcntl(fd, F_SETFD, 0);
+        return;
+    }
+    if (dup2(fd, (*r).fd) == -1)
+    {
+        // Error using dup2; print error and exit
+        if ((*r).type == REDIR_DUP)
+            fprintf(stderr, "%d: bad file descriptor\n", fd);
+        else
+            fprintf(stderr, "cannot redirect %d to file %s\n", (*r).fd, (*r).file);
+        exit(EXIT_FAILURE);
+    }
+    if ((*r).type != REDIR_DUP)
+        close(fd); // Close the file
+}
+
+void job_control_init(void)
+{
+    // Wait until we are in the foreground, if we were started as a job of another shell
+    pid_t fg;
+    while ((fg = tcgetpgrp(STDIN_FILENO)) != (shell_pgid = getpgrp()))
+    {
+        if (fg == -1) // Not our controlling terminal, so no job control
+            return;
+        kill(-shell_pgid, SIGTTIN);
+    }
+
+    // Using the terminal from the background would stop the shell when it hands the terminal over
+    struct sigaction sa_ignore = {0};
+    sa_ignore.sa_handler = SIG_IGN;
+    sigaction(SIGTTIN, &sa_ignore, NULL);
+    sigaction(SIGTTOU, &sa_ignore, NULL);
+
+    // Lead a process group of our own (a session leader already does) and take the terminal
+    if (setpgid(0, 0) == 0)
+        shell_pgid = getpid();
+    tcsetpgrp(STDIN_FILENO, shell_pgid);
+    tcgetattr(STDIN_FILENO, &shell_tmodes);
+    job_control = true;
+}
+
+void bg_init(struct background *bg)
+{
+    // Block SIGCHLD and take it from a signalfd instead, so child exits can be polled
+    // for alongside stdin and checking costs a single non-blocking read
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, &child_sigmask);
+    (*bg).sigfd = fd_lift(signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC));
+}
+
+/**
+ * Slot of the PID index to start probing at for pid
+ */
+static int bg_slot(struct background *bg, pid_t pid)
+{
+    return ((unsigned)pid * 2654435761u) & ((*bg).nslots - 1); // Knuth's multiplicative hash
+}
+
+int bg_find(struct background *bg, pid_t pid)
+{
+    if ((*bg).nslots == 0)
+        return -1;
+    for (int slot = bg_slot(bg, pid);; slot = (slot + 1) & ((*bg).nslots - 1))
+    {
+        int pos = (*bg).index[slot] - 1;
+        if (pos == -1) // Reached an empty slot, so pid isn't here
+            return -1;
+        if ((*bg).pids[pos] == pid)
+            return pos;
+    }
+}
+
+/**
+ * Point pid's index entry at position pos of the PID array, inserting it if needed
+ */
+static void bg_index_set(struct background *bg, pid_t pid, int pos)
+{
+    int slot = bg_slot(bg, pid);
+    while ((*bg).index[slot] != 0 && (*bg).pids[(*bg).index[slot] - 1] != pid)
+        slot = (slot + 1) & ((*bg).nslots - 1);
+    (*bg).index[slot] = pos + 1;
+}
+
+void bg_add(struct background *bg, pid_t pid, struct job *job)
+{
+    if ((*bg).size == (*bg).cap) // Out of room, double the PID arrays
+    {
+        (*bg).cap = (*bg).cap ? (*bg).cap * 2 : 64;
+        (*bg).pids = realloc((*bg).pids, sizeof(pid_t) * (*bg).cap);
+        (*bg).owner = realloc((*bg).owner, sizeof(struct job *) * (*bg).cap);
+    }
+
+    if (((*bg).size + 1) * 2 > (*bg).nslots) // Keep the index at most half full
+    {
+        free((*bg).index);
+        (*bg).nslots = (*bg).nslots ? (*bg).nslots * 2 : 128;
+        (*bg).index = calloc((*bg).nslots, sizeof(int));
+        for (int i = 0; i < (*bg).size; i++)
+            bg_index_set(bg, (*bg).pids[i], i);
+    }
+
+    (*bg).pids[(*bg).size] = pid;
+    (*bg).owner[(*bg).size] = job;
+    bg_index_set(bg, pid, (*bg).size);
+    (*bg).size++;
+}
+
+void bg_remove(struct background *bg, int pos)
+{
+    int mask = (*bg).nslots - 1;
+
+    // Empty pid's index slot, then shift later entries of the same probe run back into
+    // the gap so lookups never stop early (no tombstones needed)
+    int slot = bg_slot(bg, (*bg).pids[pos]);
+    while ((*bg).index[slot] - 1 != pos)
+        slot = (slot + 1) & mask;
+    int gap = slot;
+    (*bg).index[gap] = 0;
+    for (slot = (gap + 1) & mask; (*bg).index[slot] != 0; slot = (slot + 1) & mask)
+    {
+        int home = bg_slot(bg, (*bg).pids[(*bg).index[slot] - 1]);
+        if (((slot - home) & mask) >= ((slot - gap) & mask)) // Entry may move back to the gap
+        {
+            (*bg).index[gap] = (*bg).index[slot];
+            (*bg).index[slot] = 0;
+            gap = slot;
+        }
+    }
+
+    // Fill the hole in the PID array with the last PID
+    (*bg).size--;
+    if (pos != (*bg).size)
+    {
+        (*bg).pids[pos] = (*bg).pids[(*bg).size];
+        (*bg).owner[pos] = (*bg).owner[(*bg).size];
+        bg_index_set(bg, (*bg).pids[pos], pos);
+    }
+}
+
+/**
+ * The command line of a pipeline as text, for listing it as a job
+ */
+static char *job_text(struct pipeline *pl)
+{
+    size_t len = 1;
+    for (int i = 0; i < (*pl).ncmds; i++)
+    {
+        struct command *cmd = &(*pl).cmds[i];
+        for (int a = -(*cmd).prefix; a < (*cmd).nargs; a++) // Prefixes too
+            len += strlen((*cmd).args[a]) + 1;
+        for (int r = 0; r < (*cmd).nredirs; r++) // " N>> FILE" or " N>&M"
+            len += 6 + ((*cmd).redirs[r].file ? strlen((*cmd).redirs[r].file) : 0);
+        len += 3;
+    }
+
+    char *text = malloc(len);
+    char *pos = text;
+    for (int i = 0; i < (*pl).ncmds; i++)
+    {
+        struct command *cmd = &(*pl).cmds[i];
+        if (i > 0)
+            pos += sprintf(pos, " | ");
+        for (int a = -(*cmd).prefix; a < (*cmd).nargs; a++)
+            pos += sprintf(pos, a > -(*cmd).prefix ? " %s" : "%s", (*cmd).args[a]);
+        for (int r = 0; r < (*cmd).nredirs; r++)
+        {
+            struct redirect *d = &(*cmd).redirs[r];
+            static const char *const ops[] = {"<", ">", ">>", ">&", "<<", "<<<"};
+            bool in = (*d).type != REDIR_OUT && (*d).type != REDIR_APPEND && (*d).type != REDIR_DUP;
+            bool stdFd = (*d).fd == (in ? STDIN_FILENO : STDOUT_FILENO);
+            if (!stdFd)
+                pos += sprintf(pos, " %d%s", (*d).fd, ops[(*d).type]);
+            else
+                pos += sprintf(pos, " %s", ops[(*d).type]);
+            if ((*d).type == REDIR_DUP)
+                pos += sprintf(pos, "%d", (*d).target);
+            else if ((*d).type != REDIR_HEREDOC) // A body can run to many lines, so it is left out
+                pos += sprintf(pos, " %s", (*d).file);
+        }
+    }
+    *pos = '\0';
+    return text;
+}
+
+struct job *job_new(struct background *bg, struct pipeline *pl, pid_t *pids, bool grouped)
+{
+    int n = (*pl).ncmds;
+    struct job *job = calloc(1, sizeof(struct job));
+    (*job).pids = malloc(sizeof(pid_t) * n);
+    (*job).status = malloc(sizeof(int) * n);
+    (*job).npids = n;
+    (*job).pgid = -1;
+    (*job).shown = -1;
+    for (int i = 0; i < n; i++)
+    {
+        (*job).pids[i] = pids[i];
+        if (pids[i] == -1) // The stage could not be started; an error has already been printed
+        {
+            (*job).status[i] = W_EXITCODE(1, 0); // Same status the fork path's child exits with
+            continue;
+        }
+        (*job).status[i] = 0;
+        (*job).nalive++;
+        (*job).shown = pids[i];
+        if (grouped && (*job).pgid == -1) // The first stage to start leads the group
+            (*job).pgid = pids[i];
+        bg_add(bg, pids[i], job);
+    }
+    (*job).state = (*job).nalive > 0 ? JOB_RUNNING : JOB_DONE;
+    (*job).notified = true;
+    (*job).text = job_text(pl);
+
+    // Take the lowest free job number, keeping the jobs ordered by number
+    int pos = 0;
+    while (pos < (*bg).njobs && (*(*bg).jobs[pos]).id == pos + 1)
+        pos++;
+    (*job).id = pos + 1;
+    if ((*bg).njobs == (*bg).jobcap)
+    {
+        (*bg).jobcap = (*bg).jobcap ? (*bg).jobcap * 2 : 16;
+        (*bg).jobs = realloc((*bg).jobs, sizeof(struct job *) * (*bg).jobcap);
+    }
+    memmove(&(*bg).jobs[pos + 1], &(*bg).jobs[pos], sizeof(struct job *) * ((*bg).njobs - pos));
+    (*bg).jobs[pos] = job;
+    (*bg).njobs++;
+    (*bg).current = (*job).id;
+    return job;
+}
+
+struct job *job_find(struct background *bg, const char *spec)
+{
+    int id = (*bg).current;
+    if (spec != NULL && spec[0] == '%' && spec[1] != '\0' && !strmatch(spec, "%%") && !strmatch(spec, "%+"))
+    {
+        char *end;
+        id = strtol(spec + 1, &end, 10);
+        if (*end != '\0')
+            return NULL;
+    }
+    else if (spec != NULL && spec[0] != '%') // A PID of one of the job's processes
+    {
+        char *end;
+        pid_t pid = strtol(spec, &end, 10);
+        if (*spec == '\0' || *end != '\0')
+            return NULL;
+        int pos = bg_find(bg, pid);
+        if (pos != -1)
+            return (*bg).owner[pos];
+        for (int j = 0; j < (*bg).njobs; j++) // Finished already, but not reported yet
+            for (int i = 0; i < (*(*bg).jobs[j]).npids; i++)
+                if ((*(*bg).jobs[j]).pids[i] == pid)
+                    return (*bg).jobs[j];
+        return NULL;
+    }
+
+    for (int j = 0; j < (*bg).njobs; j++)
+        if ((*(*bg).jobs[j]).id == id)
+            return (*bg).jobs[j];
+    return NULL;
+}
+
+struct job *job_update(struct background *bg, pid_t pid, int status)
+{
+    int pos = bg_find(bg, pid);
+    if (pos == -1) // Not one of our jobs' processes
+        return NULL;
+    struct job *job = (*bg).owner[pos];
+
+    if (WIFSTOPPED(status)) // Stopping any process stops the job
+    {
+        (*job).state = JOB_STOPPED;
+        (*job).stopsig = WSTOPSIG(status);
+        (*job).notified = false;
+        return job;
+    }
+    if (WIFCONTINUED(status)) // e.g. "kill -CONT" from elsewhere
+    {
+        if ((*job).state == JOB_STOPPED)
+            (*job).state = JOB_RUNNING;
+        return job;
+    }
+
+    // The process finished
+    for (int i = 0; i < (*job).npids; i++)
+        if ((*job).pids[i] == pid)
+            (*job).status[i] = status;
+    bg_remove(bg, pos);
+    if (--(*job).nalive == 0)
+    {
+        (*job).state = JOB_DONE;
+        (*job).notified = false;
+    }
+    return job;
+}
+
+void job_remove(struct background *bg, struct job *job)
+{
+    // Forget any processes it still has
+    for (int i = 0; i < (*job).npids && (*job).nalive > 0; i++)
+    {
+        int pos = (*job).pids[i] != -1 ? bg_find(bg, (*job).pids[i]) : -1;
+        if (pos != -1 && (*bg).owner[pos] == job)
+        {
+            bg_remove(bg, pos);
+            (*job).nalive--;
+        }
+    }
+
+    int pos = 0;
+    while ((*bg).jobs[pos] != job)
+        pos++;
+    (*bg).njobs--;
+    memmove(&(*bg).jobs[pos], &(*bg).jobs[pos + 1], sizeof(struct job *) * ((*bg).njobs - pos));
+    if ((*bg).current == (*job).id) // The most recent job left takes over
+        (*bg).current = (*bg).njobs > 0 ? (*(*bg).jobs[(*bg).njobs - 1]).id : 0;
+
+    if ((*job).log != NULL) // The log stays readable until its memory is needed
+        (*(*job).log).finished = true;
+    free((*job).pids);
+    free((*job).status);
+    free((*job).text);
+    free(job);
+}
+
+void job_foreground(struct background *bg, struct job *job, int *lastExit)
+{
+    bool handoff = job_control && (*job).pgid != -1 && (*job).state == JOB_RUNNING;
+    if (handoff)
+    {
+        tcsetpgrp(STDIN_FILENO, (*job).pgid);
+        if ((*job).has_tmodes)
+            tcsetattr(STDIN_FILENO, TCSADRAIN, &(*job).tmodes);
+    }
+
+    // Wait for any child, so processes of other jobs finishing meanwhile are reaped too
+    long long phase = trace_now();
+    while ((*job).state == JOB_RUNNING)
+    {
+        int status;
+        pid_t pid = wait_child(bg, &status, WUNTRACED);
+        if (pid == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            (*job).state = JOB_DONE; // No children left to wait for
+            break;
+        }
+        job_update(bg, pid, status);
+    }
+    trace_event("wait", "shell", phase, trace.pid, (*job).text);
+
+    // Take the terminal back, keeping the job's terminal modes in case it is continued
+    if (handoff)
+    {
+        tcsetpgrp(STDIN_FILENO, shell_pgid);
+        if ((*job).state == JOB_STOPPED)
+            (*job).has_tmodes = tcgetattr(STDIN_FILENO, &(*job).tmodes) == 0;
+        tcsetattr(STDIN_FILENO, TCSADRAIN, &shell_tmodes);
+    }
+
+    if ((*job).state == JOB_STOPPED) // e.g. Ctrl-Z; it waits in the background until "fg" or "bg"
+    {
+        printf("\n[%d]+  %-24s%s\n", (*job).id, job_state_name(job), (*job).text);
+        fflush(stdout);
+        (*job).notified = true;
+        (*bg).current = (*job).id;
+        *lastExit = W_EXITCODE(128 + (*job).stopsig, 0);
+        return;
+    }
+
+    int n = (*job).npids;
+    pipe_status = realloc(pipe_status, sizeof(int) * n);
+    pipe_nstatus = n;
+    for (int i = 0; i < n; i++)
+    {
+        pipe_status[i] = (*job).status[i];
+
+        // If the process was terminated by a signal, print a message about the signal.
+        // Early stages dying of SIGPIPE is normal when a later stage stops reading.
+        if (WIFSIGNALED(pipe_status[i]) && (i == n - 1 || WTERMSIG(pipe_status[i]) != SIGPIPE))
+            printf("terminated by signal %d\n", WTERMSIG(pipe_status[i]));
+    }
+    *lastExit = pipe_status[n - 1]; // The pipeline's status is its last stage's
+    job_remove(bg, job);
+}
+
+void job_report(struct background *bg)
+{
+    for (int j = 0; j < (*bg).njobs; j++)
+    {
+        struct job *job = (*bg).jobs[j];
+        if ((*job).notified)
+            continue;
+        if ((*job).state == JOB_DONE)
+        {
+            if ((*job).client != NULL) // Submitted over the socket, so the client wants to know too
+                server_job_done(job);
+
+            // Print a message about the job finishing
+            printf("background pid %d is done: ", (*job).shown);
+            smallsh_status((*job).status[(*job).npids - 1]);
+            job_remove(bg, job);
+            j--;
+        }
+        else if ((*job).state == JOB_STOPPED)
+        {
+            printf("[%d]+  %-24s%s\n", (*job).id, job_state_name(job), (*job).text);
+            (*job).notified = true;
+        }
+    }
+    fflush(stdout);
+}
+
+/**
+ * Parse a size with an optional k, m or g suffix
+ *
+ * @return the size in bytes, or 0 if str isn't a valid size
+ */
+static size_t parse_size(const char *str, char **end)
+{
+    unsigned long long n = strtoull(str, end, 10);
+    if (*end == str)
+        return 0;
+    if (**end == 'k' || **end == 'K')
+        n <<= 10, (*end)++;
+    else if (**end == 'm' || **end == 'M')
+        n <<= 20, (*end)++;
+    else if (**end == 'g' || **end == 'G')
+        n <<= 30, (*end)++;
+    return n;
+}
+
+bool capture_configure(const char *spec)
+{
+    char *end;
+    capture.job_max = parse_size(spec, &end);
+    capture.total_max = CAPTURE_TOTAL_DEFAULT;
+    if (*end == ',')
+        capture.total_max = parse_size(end + 1, &end);
+    if (capture.job_max == 0 || capture.total_max == 0 || *end != '\0')
+        return false;
+    if (capture.total_max < capture.job_max)
+        capture.total_max = capture.job_max;
+    capture.enabled = true;
+    return true;
+}
+
+/**
+ * Free finished logs, oldest first, until extra more bytes fit under the global cap
+ *
+ * Finished logs that never got a ring hold nothing to show, and are freed either way.
+ *
+ * @param keep a log that must not be freed
+ */
+static void capture_evict(size_t extra, struct job_log *keep)
+{
+    struct job_log **link = &capture.oldest;
+    struct job_log *prev = NULL;
+    while (*link != NULL)
+    {
+        struct job_log *log = *link;
+        bool over = capture.total + extra > capture.total_max;
+        if (log == keep || !(*log).finished || (*log).fd != -1 || (!over && (*log).cap > 0)) // Still in use, or room enough
+        {
+            prev = log;
+            link = &(*log).next;
+            continue;
+        }
+        *link = (*log).next;
+        if (capture.newest == log)
+            capture.newest = prev;
+        capture.total -= (*log).cap;
+        free((*log).ring);
+        free((*log).text);
+        free(log);
+    }
+}
+
+struct job_log *capture_start(int *writeFd)
+{
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) == -1)
+    {
+        fprintf(stderr, "out of resources\n");
+        exit(EXIT_FAILURE);
+    }
+    fds[0] = fd_lift(fds[0]);
+    fcntl(fds[0], F_SETFL, O_NONBLOCK); // Drained whenever poll says there is something to read
+    *writeFd = fds[1];
+
+    capture_evict(0, NULL); // Sweep away finished logs that never held anything
+
+    struct job_log *log = calloc(1, sizeof(struct job_log));
+    (*log).fd = fds[0];
+    (*log).id = -1;
+    (*log).pid = -1;
+    if (capture.newest != NULL)
+        (*capture.newest).next = log;
+    else
+        capture.oldest = log;
+    capture.newest = log;
+    capture.nopen++;
+    return log;
+}
+
+/**
+ * Grow a log's ring towards want bytes, within the per-job and global caps
+ */
+static void capture_grow(struct job_log *log, size_t want)
+{
+    size_t cap = (*log).cap ? (*log).cap : CAPTURE_MIN_RING;
+    while (cap < want && cap < capture.job_max)
+        cap *= 2;
+    if (cap > capture.job_max)
+        cap = capture.job_max;
+    if (cap <= (*log).cap)
+        return;
+
+    // Make room by dropping finished logs; failing that, take what is left
+    capture_evict(cap - (*log).cap, log);
+    if (capture.total + cap - (*log).cap > capture.total_max)
+        cap = (*log).cap + (capture.total_max - capture.total);
+    if (cap <= (*log).cap)
+        return;
+
+    // Unwrap the bytes into the new buffer, oldest first
+    char *ring = malloc(cap);
+    if (ring == NULL)
+    {
+        fprintf(stderr, "out of resources\n");
+        exit(EXIT_FAILURE);
+    }
+    if ((*log).len > 0) // Nothing to move the first time, when there is no ring yet
+    {
+        size_t first = (*log).len < (*log).cap - (*log).head ? (*log).len : (*log).cap - (*log).head;
+        memcpy(ring, (*log).ring + (*log).head, first);
+        memcpy(ring + first, (*log).ring, (*log).len - first);
+    }
+    free((*log).ring);
+    capture.total += cap - (*log).cap;
+    (*log).ring = ring;
+    (*log).cap = cap;
+    (*log).head = 0;
+}
+
+/**
+ * Add bytes to the end of a log, overwriting the oldest ones once the ring is full
+ */
+static void capture_append(struct job_log *log, const char *buf, size_t n)
+{
+    if (n > (*log).cap - (*log).len)
+        capture_grow(log, (*log).len + n);
+    if ((*log).cap == 0) // Other jobs' rings hold the whole total, so there is nowhere to keep it
+    {
+        (*log).dropped += n;
+        return;
+    }
+    if (n >= (*log).cap) // Only the newest cap bytes survive
+    {
+        (*log).dropped += (*log).len + n - (*log).cap;
+        buf += n - (*log).cap;
+        n = (*log).cap;
+        (*log).head = 0;
+        (*log).len = 0;
+    }
+    if ((*log).len + n > (*log).cap) // Overwrite the oldest bytes
+    {
+        size_t overflow = (*log).len + n - (*log).cap;
+        (*log).head = ((*log).head + overflow) % (*log).cap;
+        (*log).len -= overflow;
+        (*log).dropped += overflow;
+    }
+
+    size_t tail = ((*log).head + (*log).len) % (*log).cap;
+    size_t first = n < (*log).cap - tail ? n : (*log).cap - tail;
+    memcpy((*log).ring + tail, buf, first);
+    memcpy((*log).ring, buf + first, n - first);
+    (*log).len += n;
+}
+
+void capture_drain(struct job_log *log)
+{
+    char buf[RELAY_CHUNK];
+    while ((*log).fd != -1)
+    {
+        ssize_t n = read((*log).fd, buf, sizeof(buf));
+        if (n > 0)
+            capture_append(log, buf, n);
+        else if (n == 0 || errno != EINTR) // EOF, or nothing more for now (EAGAIN)
+        {
+            if (n == 0)
+            {
+                close((*log).fd);
+                (*log).fd = -1;
+                capture.nopen--;
+            }
+            return;
+        }
+    }
+}
+
+/**
+ * Poll the given descriptors, the signalfd and every open log pipe, draining the logs that are readable
+ *
+ * A SIGCHLD read from the signalfd here is remembered in bg.sigpending for the next census.
+ *
+ * @param extra descriptors to poll as well; their revents are filled in
+ * @param nextra number of entries in extra
+ * @param timeout as for poll()
+ * @return the number of entries of extra with events, or -1 if poll() failed
+ */
+static int capture_poll(struct background *bg, struct pollfd *extra, int nextra, int timeout)
+{
+    struct pollfd *fds = malloc(sizeof(struct pollfd) * (capture.nopen + nextra + 1));
+    int n = nextra;
+    if (nextra > 0)
+        memcpy(fds, extra, sizeof(struct pollfd) * nextra);
+    fds[n++] = (struct pollfd){.fd = (*bg).sigfd, .events = POLLIN};
+    int first = n;
+    for (struct job_log *log = capture.oldest; log != NULL; log = (*log).next)
+        if ((*log).fd != -1)
+            fds[n++] = (struct pollfd){.fd = (*log).fd, .events = POLLIN};
+
+    int ready = poll(fds, n, timeout);
+    if (ready > 0)
+    {
+        if (fds[first - 1].revents != 0) // A child changed state
+        {
+            struct signalfd_siginfo info;
+            while (read((*bg).sigfd, &info, sizeof(info)) == sizeof(info))
+                (*bg).sigpending = true;
+        }
+        for (struct job_log *log = capture.oldest, *next; log != NULL; log = next) // Logs in the same order as fds
+        {
+            next = (*log).next;
+            if ((*log).fd != -1 && fds[first++].revents != 0)
+                capture_drain(log);
+        }
+    }
+    int result = ready == -1 ? -1 : 0;
+    for (int i = 0; i < nextra; i++)
+    {
+        extra[i].revents = ready == -1 ? 0 : fds[i].revents;
+        result += extra[i].revents != 0;
+    }
+    free(fds);
+    return result;
+}
+
+pid_t wait_child(struct background *bg, int *status, int options)
+{
+    if (capture.nopen == 0) // Nothing to keep draining, so just block
+        return reap_child(-1, status, options);
+    while (true)
+    {
+        pid_t pid = reap_child(-1, status, options | WNOHANG);
+        if (pid != 0)
+            return pid;
+        capture_poll(bg, NULL, 0, -1);
+    }
+}
+
+int smallsh_joblog(char **args, struct background *bg)
+{
+    if (!capture.enabled)
+    {
+        fprintf(stderr, "joblog: output capture is off (start the shell with -o SIZE)\n");
+        return 1;
+    }
+
+    if (args[1] == NULL) // List the jobs that have output
+    {
+        for (struct job_log *log = capture.oldest; log != NULL; log = (*log).next)
+            if ((*log).id != -1)
+                printf("[%d] %d  %zu bytes%s  %s\n", (*log).id, (*log).pid, (*log).len + (size_t)(*log).dropped,
+                       (*log).fd != -1 ? " so far" : "", (*log).text);
+        fflush(stdout);
+        return 0;
+    }
+
+    int result = 0;
+    for (int i = 1; args[i] != NULL; i++)
+    {
+        // A job still being tracked has its log at hand; otherwise take the newest log that matches
+        struct job *job = job_find(bg, args[i]);
+        struct job_log *found = job != NULL ? (*job).log : NULL;
+        char *end;
+        long num = strtol(args[i] + (args[i][0] == '%'), &end, 10);
+        if (found == NULL && *end == '\0')
+            for (struct job_log *log = capture.oldest; log != NULL; log = (*log).next)
+                if ((args[i][0] == '%' ? (*log).id : (*log).pid) == num)
+                    found = log;
+        if (found == NULL || (*found).id == -1)
+        {
+            fprintf(stderr, "joblog: %s: no output captured\n", args[i]);
+            result = 1;
+            continue;
+        }
+
+        // Catch up with the pipe, then write out the tail, oldest byte first
+        capture_drain(found);
+        if ((*found).dropped > 0)
+            fprintf(stderr, "joblog: %s: first %lld bytes dropped\n", args[i], (*found).dropped);
+        fflush(stdout);
+        size_t first = (*found).len < (*found).cap - (*found).head ? (*found).len : (*found).cap - (*found).head;
+        write_all(STDOUT_FILENO, (*found).ring + (*found).head, first);
+        write_all(STDOUT_FILENO, (*found).ring, (*found).len - first);
+    }
+    return result;
+}
+
+/**
+ * Map the history and its index again if either has changed size since they were mapped
+ */
+static void history_map(void)
+{
+    struct stat ds, is;
+    if (fstat(history.fd, &ds) == -1 || fstat(history.idx_fd, &is) == -1)
+        return;
+    size_t dataLen = ds.st_size;
+    size_t count = is.st_size / sizeof(uint64_t); // A torn last entry is left out
+    if (dataLen != history.data_len)
+    {
+        if (history.data != NULL)
+            munmap((void *)history.data, history.data_len);
+        history.data = dataLen > 0 ? mmap(NULL, dataLen, PROT_READ, MAP_SHARED, history.fd, 0) : NULL;
+        if (history.data == MAP_FAILED)
+            history.data = NULL;
+        history.data_len = history.data != NULL ? dataLen : 0;
+    }
+    if (count != history.count)
+    {
+        if (history.ends != NULL)
+            munmap((void *)history.ends, history.count * sizeof(uint64_t));
+        history.ends = count > 0 ? mmap(NULL, count * sizeof(uint64_t), PROT_READ, MAP_SHARED, history.idx_fd, 0) : NULL;
+        if (history.ends == MAP_FAILED)
+            history.ends = NULL;
+        history.count = history.ends != NULL ? count : 0;
+    }
+}
+
+/**
+ * Where the last indexed entry ends
+ */
+static uint64_t history_indexed(void)
+{
+    return history.count > 0 ? history.ends[history.count - 1] : 0;
+}
+
+/**
+ * Map the files again if they have grown, first indexing any whole lines the index lacks
+ */
+static void history_sync(void)
+{
+    history_map();
+    if (history_indexed() == history.data_len) // The usual case: nothing to catch up on
+        return;
+
+    flock(history.fd, LOCK_EX); // So two shells don't both append the missing entries
+    history_map();
+    if (history_indexed() > history.data_len)
+    {
+        // The history was cut short behind our back; index it from scratch
+        if (ftruncate(history.idx_fd, 0) == 0)
+            history_map();
+    }
+    if (history_indexed() < history.data_len && history.data != NULL)
+    {
+        uint64_t batch[HISTORY_INDEX_BATCH];
+        int n = 0;
+        const char *p = history.data + history_indexed();
+        const char *stop = history.data + history.data_len;
+        const char *nl;
+        while ((nl = memchr(p, '\n', stop - p)) != NULL)
+        {
+            batch[n++] = nl + 1 - history.data;
+            if (n == HISTORY_INDEX_BATCH)
+            {
+                write_all(history.idx_fd, (const char *)batch, sizeof(batch));
+                n = 0;
+            }
+            p = nl + 1;
+        }
+        write_all(history.idx_fd, (const char *)batch, n * sizeof(uint64_t));
+        history_map();
+    }
+    flock(history.fd, LOCK_UN);
+}
+
+bool history_open(void)
+{
+    if (history.fd != -1)
+        return true;
+    if (history.tried)
+        return false;
+    history.tried = true;
+
+    // $SMALLSH_HISTORY, or a file in $HOME; an empty $SMALLSH_HISTORY turns history off
+    const char *file = var_get("SMALLSH_HISTORY", 15);
+    const char *home = var_get("HOME", 4);
+    if (file != NULL && *file == '\0')
+        return false;
+    if (file == NULL && home == NULL)
+        return false;
+    size_t len = file != NULL ? strlen(file) : strlen(home) + 1 + strlen(HISTORY_FILE);
+    char *path = malloc(len + sizeof(".idx"));
+    if (file != NULL)
+        strcpy(path, file);
+    else
+        sprintf(path, "%s/%s", home, HISTORY_FILE);
+
+    history.fd = fd_lift(open(path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600));
+    strcat(path, ".idx");
+    history.idx_fd = fd_lift(open(path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600));
+    free(path);
+    if (history.fd == -1 || history.idx_fd == -1)
+    {
+        history_close();
+        return false;
+    }
+    history_sync();
+    return true;
+}
+
+void history_close(void)
+{
+    if (history.data != NULL)
+        munmap((void *)history.data, history.data_len);
+    if (history.ends != NULL)
+        munmap((void *)history.ends, history.count * sizeof(uint64_t));
+    if (history.fd != -1)
+        close(history.fd);
+    if (history.idx_fd != -1)
+        close(history.idx_fd);
+    free(history.line);
+    history = (struct history){.fd = -1, .idx_fd = -1};
+}
+
+void history_add(const char *line)
+{
+    const char *p = line;
+    while (byte_class[(unsigned char)*p] == BYTE_DELIM)
+        p++;
+    if (*p == '\0' || !history_open())
+        return;
+
+    // Append the line and its index entry together, so other shells never see one
+    // without the other. A last line left without its newline (a crash mid-write)
+    // is closed off first and becomes an entry of its own.
+    size_t len = strlen(line);
+    flock(history.fd, LOCK_EX);
+    off_t end = lseek(history.fd, 0, SEEK_END);
+    uint64_t last = 0;
+    struct stat is;
+    if (fstat(history.idx_fd, &is) == 0 && is.st_size >= (off_t)sizeof(uint64_t))
+        pread(history.idx_fd, &last, sizeof(last), is.st_size / sizeof(uint64_t) * sizeof(uint64_t) - sizeof(uint64_t));
+    bool torn = end > 0 && last != (uint64_t)end;
+    struct iovec iov[3] = {{"\n", torn}, {(void *)line, len}, {"\n", 1}};
+    uint64_t ends[2];
+    int n = 0;
+    if (torn)
+        ends[n++] = end + 1;
+    ends[n++] = end + torn + len + 1;
+    if (writev(history.fd, iov, 3) == (ssize_t)(torn + len + 1))
+        write_all(history.idx_fd, (const char *)ends, n * sizeof(uint64_t));
+    flock(history.fd, LOCK_UN);
+}
+
+/**
+ * Entry i (from 1) of the mapped history, without its newline
+ */
+static const char *history_entry(size_t i, size_t *len)
+{
+    uint64_t start = i > 1 ? history.ends[i - 2] : 0;
+    *len = history.ends[i - 1] - start - 1;
+    return history.data + start;
+}
+
+/**
+ * Number of the entry holding byte pos of the history: the first that ends after it
+ */
+static size_t history_entry_at(size_t pos)
+{
+    size_t lo = 0, hi = history.count;
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (history.ends[mid] <= pos)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo + 1;
+}
+
+/**
+ * Number of the newest entry starting with prefix, or 0
+ */
+static size_t history_find_prefix(const char *prefix, size_t plen)
+{
+    for (size_t i = history.count; i >= 1; i--)
+    {
+        size_t len;
+        const char *text = history_entry(i, &len);
+        if (len >= plen && memcmp(text, prefix, plen) == 0)
+            return i;
+    }
+    return 0;
+}
+
+int history_expand(const char *line, char **expanded)
+{
+    const char *ref = line;
+    while (byte_class[(unsigned char)*ref] == BYTE_DELIM)
+        ref++;
+    if (ref[0] != '!' || ref[1] == '\0' || byte_class[(unsigned char)ref[1]] == BYTE_DELIM) // Not a reference
+        return 0;
+    const char *event = ref + 1;
+    const char *rest = event;
+    while (*rest != '\0' && byte_class[(unsigned char)*rest] != BYTE_DELIM)
+        rest++;
+    size_t elen = rest - event;
+
+    size_t n = 0;
+    if (history_open())
+    {
+        history_sync();
+        char *end;
+        long num = strtol(event, &end, 10);
+        if (elen == 1 && event[0] == '!') // The last entry
+            n = history.count;
+        else if (end == rest && num > 0)
+            n = num;
+        else if (end == rest && num < 0 && (size_t)-num <= history.count) // Counting back from the last
+            n = history.count + 1 + num;
+        else if (end != rest)
+            n = history_find_prefix(event, elen);
+    }
+    if (n < 1 || n > history.count)
+    {
+        fprintf(stderr, "!%.*s: event not found\n", (int)elen, event);
+        fflush(stderr);
+        return -1;
+    }
+
+    size_t len;
+    const char *text = history_entry(n, &len);
+    size_t restLen = strlen(rest);
+    if (len + restLen + 1 > history.linecap)
+    {
+        history.linecap = (len + restLen + 1) * 2;
+        history.line = realloc(history.line, history.linecap);
+    }
+    memcpy(history.line, text, len);
+    memcpy(history.line + len, rest, restLen + 1);
+    *expanded = history.line;
+    return 1;
+}
+
+/**
+ * Print entry i of the history the way "history" lists it
+ */
+static void history_print(size_t i)
+{
+    size_t len;
+    const char *text = history_entry(i, &len);
+    printf("%6zu  %.*s\n", i, (int)len, text);
+}
+
+int smallsh_history(char **args)
+{
+    bool search = args[1] != NULL && (strmatch(args[1], "-s") || strmatch(args[1], "-p"));
+    char *end = NULL;
+    long last = args[1] != NULL && !search ? strtol(args[1], &end, 10) : 0;
+    if ((search && (args[2] == NULL || args[3] != NULL)) || (!search && args[1] != NULL && (*end != '\0' || last < 0 || args[2] != NULL)))
+    {
+        fprintf(stderr, "history: usage: history [N] | history -s TEXT | history -p PREFIX\n");
+        return 2;
+    }
+    if (!history_open())
+    {
+        fprintf(stderr, "history: no history file\n");
+        return 1;
+    }
+    history_sync();
+
+    size_t found = 0;
+    if (!search) // The last N entries, or all of them
+    {
+        size_t first = args[1] != NULL && (size_t)last < history.count ? history.count - last + 1 : 1;
+        for (size_t i = first; i <= history.count; i++)
+            history_print(i);
+        found = 1;
+    }
+    else if (strmatch(args[1], "-p")) // Entries starting with the text
+    {
+        size_t plen = strlen(args[2]);
+        for (size_t i = 1; i <= history.count; i++)
+        {
+            size_t len;
+            const char *text = history_entry(i, &len);
+            if (len >= plen && memcmp(text, args[2], plen) == 0)
+            {
+                history_print(i);
+                found++;
+            }
+        }
+    }
+    else if (history.count > 0) // Entries containing the text: one memmem() over the whole mapping
+    {
+        size_t tlen = strlen(args[2]);
+        const char *p = history.data;
+        const char *stop = history.data + history_indexed(); // Only indexed entries
+        const char *match;
+        while (p < stop && (match = memmem(p, stop - p, args[2], tlen)) != NULL)
+        {
+            size_t i = history_entry_at(match - history.data);
+            size_t len;
+            const char *text = history_entry(i, &len);
+            history_print(i);
+            found++;
+            p = text + len + 1; // Each entry once
+        }
+    }
+    fflush(stdout);
+    return found > 0 ? 0 : 1;
+}
+
+/**
+ * Record every state change of our children since the last call, if the signalfd says there were any
+ */
+static void bg_collect(struct background *bg)
+{
+    // Nothing to do unless a SIGCHLD has arrived since the last census
+    if (capture.nopen > 0)
+        capture_poll(bg, NULL, 0, 0); // Empty any log pipes that filled up since the last census
+    struct signalfd_siginfo info;
+    bool signalled = (*bg).sigpending;
+    (*bg).sigpending = false;
+    while (read((*bg).sigfd, &info, sizeof(info)) == sizeof(info))
+        signalled = true;
+    if (!signalled)
+        return;
+
+    // Record every child that has finished, stopped or continued, whichever order it happened in
+    long long phase = trace_now();
+    pid_t pid;
+    int status;
+    while ((pid = reap_child(-1, &status, WNOHANG | WUNTRACED | WCONTINUED)) > 0)
+        job_update(bg, pid, status);
+    trace_event("census", "shell", phase, trace.pid, NULL);
+}
+
+void run_bg_census(struct background *bg)
+{
+    bg_collect(bg);
+    job_report(bg);
+}
+
+void wait_for_input(struct background *bg)
+{
+    trace_flush(); // Nothing else to do while the user types
+
+    while (true)
+    {
+        // Poll stdin and the signalfd, capturing any job output that arrives meanwhile
+        struct pollfd in = {.fd = STDIN_FILENO, .events = POLLIN};
+        int ready = capture_poll(bg, &in, 1, -1);
+        if (ready == -1)
+        {
+            if (errno == EINTR) // e.g. the SIGTSTP handler ran
+                continue;
+            return;
+        }
+        if (ready == 1) // Input (or EOF/hangup) is waiting
+            return;
+        if (!(*bg).sigpending) // Only job output arrived
+            continue;
+
+        // A child changed state while we were waiting; if a job finished or stopped,
+        // report it and give the prompt again
+        bg_collect(bg);
+        bool pending = false;
+        for (int j = 0; j < (*bg).njobs && !pending; j++)
+            pending = !(*(*bg).jobs[j]).notified;
+        if (!pending)
+            continue;
+        printf("\n");
+        job_report(bg);
+        printf(": ");
+        fflush(stdout);
+    }
+}
+
+/**
+ * Reap jobs as they finish, until no process is left or timeout seconds have passed
+ *
+ * All of them are waited for together: each wakeup of the signalfd reaps every
+ * process that has exited since, so the wait doesn't grow with the number of jobs.
+ * Returns the number of processes still running.
+ */
+static int shutdown_wait(struct background *bg, double timeout)
+{
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (true)
+    {
+        (*bg).sigpending = true; // Reap whatever has exited, SIGCHLD read or not
+        bg_collect(bg);
+        if ((*bg).size == 0)
+            return 0;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        double left = timeout - ((now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9);
+        if (left <= 0)
+            return (*bg).size;
+        capture_poll(bg, NULL, 0, (int)(left * 1000) + 1); // Keeps draining job logs, so no job blocks writing
+    }
+}
+
+void kill_zombies(struct background *bg)
+{
+    // Reap jobs that have already exited first, so they aren't counted as stopped by the signal
+    (*bg).sigpending = true;
+    bg_collect(bg);
+
+    // Signal every job at once; a stopped job has to be continued to act on it
+    int sig = shutdown_grace > 0 ? SIGTERM : SIGKILL;
+    int njobs = 0;
+    for (int j = 0; j < (*bg).njobs; j++)
+    {
+        struct job *job = (*bg).jobs[j];
+        if ((*job).state == JOB_DONE)
+            continue;
+        job_signal(job, sig);
+        if ((*job).state == JOB_STOPPED)
+            job_signal(job, SIGCONT);
+        njobs++;
+    }
+    if (njobs == 0)
+        return;
+
+    // One deadline for all of them, then SIGKILL for whatever is left
+    long long phase = trace_now();
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int killed = 0;
+    if (sig == SIGKILL || shutdown_wait(bg, shutdown_grace) > 0)
+    {
+        for (int j = 0; j < (*bg).njobs; j++)
+        {
+            struct job *job = (*bg).jobs[j];
+            if ((*job).state == JOB_DONE)
+                continue;
+            job_signal(job, SIGKILL);
+            killed++;
+        }
+        shutdown_wait(bg, SHUTDOWN_KILL_WAIT);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    // Say how each job ended, then sum it up
+    job_report(bg);
+    if (sig == SIGKILL)
+        printf("shutdown: %d jobs killed\n", njobs);
+    else
+        printf("shutdown: %d of %d jobs stopped on SIGTERM in %.3f s, %d killed\n", njobs - killed, njobs, secs, killed);
+    fflush(stdout);
+    if (trace.fd != -1)
+    {
+        char detail[64];
+        snprintf(detail, sizeof(detail), "%d jobs, %d killed", njobs, killed);
+        trace_event("shutdown", "shell", phase, trace.pid, detail);
+    }
+}
+
+/**
+ * Create the listening socket at path, replacing a socket no daemon is listening on any more
+ */
+static bool server_listen(const char *path)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "%s: socket path too long\n", path);
+        return false;
+    }
+    strcpy(addr.sun_path, path);
+
+    server.listen_fd = fd_lift(socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0));
+    if (server.listen_fd == -1)
+    {
+        fprintf(stderr, "cannot create socket: %s\n", strerror(errno));
+        return false;
+    }
+    int err = bind(server.listen_fd, (struct sockaddr *)&addr, sizeof(addr));
+    if (err == -1 && errno == EADDRINUSE) // Left behind by a daemon that is gone if nothing answers
+    {
+        int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (probe != -1 && connect(probe, (struct sockaddr *)&addr, sizeof(addr)) == -1 && errno == ECONNREFUSED)
+        {
+            unlink(path);
+            err = bind(server.listen_fd, (struct sockaddr *)&addr, sizeof(addr));
+        }
+        else
+            errno = EADDRINUSE;
+        if (probe != -1)
+            close(probe);
+    }
+    if (err == -1 || listen(server.listen_fd, SOMAXCONN) == -1)
+    {
+        fprintf(stderr, "cannot listen on %s: %s\n", path, strerror(errno));
+        close(server.listen_fd);
+        server.listen_fd = -1;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Accept every connection waiting on the listening socket
+ */
+static void server_accept(void)
+{
+    int fd;
+    while ((fd = accept4(server.listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1)
+    {
+        if (server.nclients == server.cap)
+        {
+            server.cap = server.cap ? server.cap * 2 : 16;
+            server.clients = realloc(server.clients, sizeof(struct client *) * server.cap);
+        }
+        struct client *client = calloc(1, sizeof(struct client));
+        (*client).fd = fd_lift(fd);
+        server.clients[server.nclients++] = client;
+    }
+}
+
+/**
+ * Close a client that has gone away; the lines it sent still run, but nobody hears how they went
+ */
+static void client_gone(struct client *client)
+{
+    close((*client).fd);
+    (*client).fd = -1; // Not polled any more
+    (*client).eof = true;
+    (*client).outlen = 0;
+}
+
+/**
+ * Send as much of a client's pending output as its socket takes
+ */
+static void client_flush(struct client *client)
+{
+    size_t sent = 0;
+    while (sent < (*client).outlen)
+    {
+        ssize_t n = send((*client).fd, (*client).out + sent, (*client).outlen - sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) // Try again when it's writable
+            break;
+        if (n == -1)
+        {
+            client_gone(client);
+            return;
+        }
+        sent += n;
+    }
+    (*client).outlen -= sent;
+    memmove((*client).out, (*client).out + sent, (*client).outlen);
+}
+
+/**
+ * Queue a status line for a client and send what fits straight away
+ */
+static void client_status(struct client *client, long lineno, const char *text)
+{
+    if ((*client).fd == -1) // Nobody to tell
+        return;
+    char line[64];
+    int len = snprintf(line, sizeof(line), "%ld %s\n", lineno, text);
+    if ((*client).outlen + len > (*client).outcap)
+    {
+        (*client).outcap = ((*client).outlen + len) * 2;
+        (*client).out = realloc((*client).out, (*client).outcap);
+    }
+    memcpy((*client).out + (*client).outlen, line, len);
+    (*client).outlen += len;
+    client_flush(client);
+}
+
+/**
+ * Send a command's status in the words "status" uses
+ */
+static void client_exit_status(struct client *client, long lineno, int status)
+{
+    char text[48];
+    if (WIFEXITED(status))
+        snprintf(text, sizeof(text), "exit value %d", WEXITSTATUS(status));
+    else
+        snprintf(text, sizeof(text), "terminated by signal %d", WTERMSIG(status));
+    client_status(client, lineno, text);
+}
+
+void server_job_done(struct job *job)
+{
+    struct client *client = (*job).client;
+    client_exit_status(client, (*job).lineno, (*job).status[(*job).npids - 1]);
+    (*client).running--;
+    server.running--;
+    (*job).client = NULL;
+}
+
+/**
+ * Read everything a client has sent so far
+ */
+static void client_read(struct client *client)
+{
+    while (true)
+    {
+        if ((*client).inpos > 0 && (*client).inpos == (*client).inlen) // All run, start over
+            (*client).inpos = (*client).inlen = 0;
+        if ((*client).incap - (*client).inlen < CLIENT_READ_CHUNK)
+        {
+            (*client).incap = (*client).incap ? (*client).incap * 2 : 2 * CLIENT_READ_CHUNK;
+            (*client).in = realloc((*client).in, (*client).incap);
+        }
+        ssize_t n = read((*client).fd, (*client).in + (*client).inlen, (*client).incap - (*client).inlen - 1);
+        if (n > 0)
+        {
+            (*client).inlen += n;
+            continue;
+        }
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (n == -1)
+        {
+            client_gone(client);
+            return;
+        }
+
+        // End of input; a last line without a newline still counts
+        (*client).eof = true;
+        if ((*client).inlen > (*client).inpos && (*client).in[(*client).inlen - 1] != '\n')
+            (*client).in[(*client).inlen++] = '\n'; // The read left room for it
+        return;
+    }
+}
+
+/**
+ * The next whole line a client has sent that hasn't run yet, or NULL
+ */
+static char *client_line(struct client *client)
+{
+    if ((*client).inpos == (*client).inlen)
+        return NULL;
+    char *line = (*client).in + (*client).inpos;
+    char *newline = memchr(line, '\n', (*client).inlen - (*client).inpos);
+    if (newline == NULL)
+        return NULL;
+    *newline = '\0';
+    (*client).inpos = newline + 1 - (*client).in;
+    return line;
+}
+
+/**
+ * Run a client's next line: in the background through run_non_builtin(), or in the
+ * daemon itself for a built-in, whose status is sent straight away
+ */
+static void client_run(struct client *client, char *line, struct pipeline *pl, struct sigaction sa_SIGINT, struct background *bg)
+{
+    long lineno = ++(*client).lineno;
+    reset_pipeline(pl);
+    if (!parse_command(line, pl))
+    {
+        client_status(client, lineno, "syntax error");
+        return;
+    }
+    if ((*pl).ncmds == 0) // Empty line or comment, nothing to report
+        return;
+
+    // Like exec_cmd(), but every program runs in the background so the daemon never waits
+    struct command *cmd = &(*pl).cmds[0];
+    if (take_prefixes(&(*pl).mem, cmd) == -1)
+    {
+        client_exit_status(client, lineno, W_EXITCODE(1, 0));
+        return;
+    }
+    const struct builtin *b = (*pl).ncmds == 1 && (*cmd).prefix == 0 ? find_builtin((*cmd).args[0]) : NULL;
+    int status = 0;
+    if (b != NULL && !(*b).external)
+    {
+        if (!exec_cmd(pl, &status, sa_SIGINT, bg)) // "exit" ends the connection, not the daemon
+        {
+            (*client).eof = true;
+            (*client).inpos = (*client).inlen; // Nor is anything after it run
+        }
+        else
+            client_exit_status(client, lineno, status);
+        return;
+    }
+
+    (*pl).run_in_bg = true;
+    for (int i = 0; i < (*pl).ncmds; i++)
+        (*pl).cmds[i].run_in_bg = true;
+    pid_t lastbg = vars.lastbg; // A client's job is no "$!" of the daemon's
+    vars.lastbg = 0;
+    run_non_builtin(pl, &status, sa_SIGINT, bg);
+    int pos = vars.lastbg != 0 ? bg_find(bg, vars.lastbg) : -1;
+    vars.lastbg = lastbg;
+    if (pos == -1) // Nothing could be started; the error has been logged
     {
-        pid = waitpid(bg.pids[i], &exitVal, WNOHANG); // Check on it
-        if (pid == 0)                                 // The process is still running
-            kill(bg.pids[i], SIGKILL);                // So kill it
+        client_exit_status(client, lineno, W_EXITCODE(1, 0));
+        return;
     }
-}
\ No newline at end of file
+    struct job *job = (*bg).owner[pos];
+    (*job).client = client;
+    (*job).lineno = lineno;
+    (*client).running++;
+    server.running++;
+}
+
+/**
+ * Close and free a client, first unhooking any job still due to report to it
+ */
+static void client_free(struct client *client, struct background *bg)
+{
+    for (int j = 0; j < (*bg).njobs; j++)
+        if ((*(*bg).jobs[j]).client == client)
+        {
+            (*(*bg).jobs[j]).client = NULL;
+            server.running--;
+        }
+    if ((*client).fd != -1)
+        close((*client).fd);
+    free((*client).in);
+    free((*client).out);
+    free(client);
+}
+
+int run_server(const char *path, long max_running, struct sigaction sa_SIGINT, struct background *bg)
+{
+    if (!server_listen(path))
+        return EXIT_FAILURE;
+    server.max_running = max_running > 0 ? max_running : sysconf(_SC_NPROCESSORS_ONLN);
+    if (server.max_running < 1)
+        server.max_running = 1;
+
+    struct pipeline pl = {0};
+    struct pollfd *fds = NULL;
+    int fdcap = 0;
+    int result = EXIT_SUCCESS;
+    while (true)
+    {
+        // Start waiting lines while there is room, one per client in turn
+        bool started = true;
+        while (started && server.running < server.max_running)
+        {
+            started = false;
+            for (int i = 0; i < server.nclients && server.running < server.max_running; i++)
+            {
+                char *line = client_line(server.clients[i]);
+                if (line != NULL)
+                {
+                    client_run(server.clients[i], line, &pl, sa_SIGINT, bg);
+                    started = true;
+                }
+            }
+        }
+
+        // Let go of clients with nothing left to run, wait for or send
+        for (int i = 0; i < server.nclients; i++)
+        {
+            struct client *client = server.clients[i];
+            if (!(*client).eof || (*client).running > 0 || (*client).outlen > 0 || (*client).inpos < (*client).inlen)
+                continue;
+            client_free(client, bg);
+            server.clients[i--] = server.clients[--server.nclients];
+        }
+
+        // Wait for a connection, input from a client with no line waiting, room to
+        // send a client its statuses, or a child to finish
+        if (fdcap < server.nclients + 1)
+        {
+            fdcap = (server.nclients + 1) * 2;
+            fds = realloc(fds, sizeof(struct pollfd) * fdcap);
+        }
+        fds[0] = (struct pollfd){.fd = server.listen_fd, .events = POLLIN};
+        for (int i = 0; i < server.nclients; i++)
+        {
+            struct client *client = server.clients[i];
+            bool waiting = (*client).inlen > (*client).inpos && memchr((*client).in + (*client).inpos, '\n', (*client).inlen - (*client).inpos) != NULL;
+            fds[i + 1] = (struct pollfd){.fd = (*client).fd};
+            if (!(*client).eof && !waiting)
+                fds[i + 1].events |= POLLIN;
+            if ((*client).outlen > 0)
+                fds[i + 1].events |= POLLOUT;
+        }
+        trace_flush(); // Nothing else to do until something happens
+        int ready = capture_poll(bg, fds, server.nclients + 1, -1);
+        if (ready == -1 && errno != EINTR)
+        {
+            fprintf(stderr, "poll: %s\n", strerror(errno));
+            result = EXIT_FAILURE;
+            break;
+        }
+
+        // Reap finished commands first, so their statuses go out with this round
+        run_bg_census(bg);
+        if (ready <= 0)
+            continue;
+        int n = server.nclients; // Clients accepted below weren't polled
+        for (int i = 0; i < n; i++)
+        {
+            struct client *client = server.clients[i];
+            if (fds[i + 1].revents & (POLLIN | POLLHUP | POLLERR))
+            {
+                if ((*client).eof) // Hung up while we weren't reading
+                    client_gone(client);
+                else
+                    client_read(client);
+            }
+            if ((*client).fd == -1)
+                continue;
+            if ((fds[i + 1].revents & POLLOUT) && (*client).outlen > 0)
+                client_flush(client);
+        }
+        if (fds[0].revents & POLLIN)
+            server_accept();
+    }
+
+    for (int i = 0; i < server.nclients; i++) // Jobs still running report to nobody at exit
+        client_free(server.clients[i], bg);
+    server.nclients = 0;
+    close(server.listen_fd);
+    server.listen_fd = -1;
+    unlink(path);
+    free(fds);
+    arena_free(&pl.mem);
+    free(pl.cmds);
+    return result;
+}
+
+bool trace_open(const char *path)
+{
+    trace.fd = fd_lift(open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644));
+    if (trace.fd == -1)
+        return false;
+    trace.pid = getpid();
+
+    // Written straight away, since forked children append to the file directly
+    int len = sprintf(trace.buf, "[\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,"
+                                 "\"args\":{\"name\":\"smallsh\"}},\n",
+                      trace.pid, trace.pid);
+    write_all(trace.fd, trace.buf, len);
+    return true;
+}
+
+long long trace_now(void)
+{
+    if (trace.fd == -1)
+        return 0;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * Copy str into out as the inside of a JSON string, truncated to fit TRACE_FIELD_MAX bytes
+ */
+static void trace_escape(char *out, const char *str)
+{
+    char *end = out + TRACE_FIELD_MAX - 7; // Room for the longest escape and the terminator
+    for (; *str && out < end; str++)
+    {
+        unsigned char c = *str;
+        if (c == '"' || c == '\\')
+        {
+            *out++ = '\\';
+            *out++ = c;
+        }
+        else if (c < 0x20)
+            out += sprintf(out, "\\u%04x", c);
+        else
+            *out++ = c;
+    }
+    *out = '\0';
+}
+
+void trace_event(const char *name, const char *cat, long long start, pid_t tid, const char *detail)
+{
+    if (trace.fd == -1)
+        return;
+    long long dur = trace_now() - start;
+
+    // Make room first, so the event can be formatted straight into the buffer
+    if (trace.len + 3 * TRACE_FIELD_MAX > TRACE_BUF_SIZE)
+        trace_flush();
+
+    char escName[TRACE_FIELD_MAX];
+    trace_escape(escName, name);
+    char *out = trace.buf + trace.len;
+    out += sprintf(out, "{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%lld.%03lld,\"dur\":%lld.%03lld,"
+                        "\"pid\":%d,\"tid\":%d",
+                   escName, cat, start / 1000, start % 1000, dur / 1000, dur % 1000, trace.pid, tid);
+    if (detail != NULL)
+    {
+        char escDetail[TRACE_FIELD_MAX];
+        trace_escape(escDetail, detail);
+        out += sprintf(out, ",\"args\":{\"detail\":\"%s\"}", escDetail);
+    }
+    out += sprintf(out, "},\n");
+    trace.len = out - trace.buf;
+}
+
+void trace_flush(void)
+{
+    if (trace.fd == -1 || trace.len == 0)
+        return;
+    write_all(trace.fd, trace.buf, trace.len);
+    trace.len = 0;
+}
@@ -14,132 +14,1230 @@
 #ifndef SMALLSH
 #define SMALLSH
 
-#define MAX_INPUT_LEN 2048          // Per assignment, max length of a command line
-#define MAX_ARGS 512                // Per assignment, max number of arguments
-#define MAX_FILENAME_LEN 256        // Per OS spec, max length of a file name
 #define MAX_PID_LEN 7               // Per OS spec, max number of digits in a PID
-#define BG_CAP 1000                 // Max number of background processes to allow
-#define TOKEN_DELIMITER " \r\a\n\t" // Delimiters for splitting command line into args
+#define PATH_CACHE_BUCKETS 64       // Number of buckets in the resolved-executable cache
+#define ARENA_CHUNK_SIZE 8192       // Size of the first chunk of a per-command-line arena
+#define ARENA_ALIGN 16              // Alignment of every arena allocation
+#define BUILTIN_SLOTS 64            // Size of the perfect hash table of built-ins, a power of two
+#define LINE_CHUNK_SIZE (1 << 20)   // Initial size of the buffer commands are read into
+#define RELAY_CHUNK (1 << 16)       // Max bytes moved per splice/tee call by zero-copy relay stages
+#define STATS_SUB_BUCKETS 8         // Histogram buckets per power of two, a power of two itself
+#define STATS_BUCKETS (64 * STATS_SUB_BUCKETS) // Enough buckets for any 64-bit value
+#define TRACE_BUF_SIZE (1 << 16)    // Trace events are buffered until this many bytes are waiting
+#define TRACE_FIELD_MAX 256         // Max bytes of an escaped name or detail in a trace event
+#define CAPTURE_MIN_RING 256        // First allocation of a job's output ring buffer
+#define CAPTURE_TOTAL_DEFAULT (16 << 20) // Cap on all captured output together unless -o gives one
+#define VAR_MIN_SLOTS 64            // First size of the variable table, a power of two
+#define MAX_REDIRECT_FD 9           // Highest descriptor a redirect can name, like other shells
+#define NLIMITS 3                   // Resource limits ulimit can set: -v, -t and -n
+#define CLIENT_READ_CHUNK 4096      // Least free space a client's input buffer is read into
+#define HISTORY_FILE ".smallsh_history" // History file in $HOME, unless $SMALLSH_HISTORY names one
+#define HISTORY_INDEX_BATCH 1024    // Index entries written per write() while catching the index up
+#define GLOB_DENTS_BUF (1 << 18)    // Bytes of directory entries read per getdents64 call
+#define HEREDOC_PIPE_MAX 4096       // Largest here-document handed over in a pipe rather than a memfd
+#define COPY_CHUNK (1 << 24)        // Max bytes per copy_file_range/sendfile/splice call of the cat built-in
+#define COPY_BUF_SIZE (1 << 17)     // Buffer the cat built-in reads and writes through when nothing faster works
+#define SHUTDOWN_GRACE_DEFAULT 2.0  // Seconds jobs left at exit get to stop after SIGTERM, unless -k gives one
+#define SHUTDOWN_KILL_WAIT 1.0      // Most seconds spent reaping jobs after SIGKILL at exit
+
+/**
+ * A block of memory handed out by an arena
+ */
+struct arena_chunk
+{
+    struct arena_chunk *next; //< Previously filled chunk
+    size_t size;              //< Usable bytes in data
+    size_t used;              //< Bytes of data handed out so far
+    char data[];              //< The memory itself
+};
+
+/**
+ * Bump allocator for everything belonging to one command line
+ *
+ * Allocations are never freed individually; arena_reset() releases them all at once
+ * and keeps the memory for the next command line.
+ */
+struct arena
+{
+    struct arena_chunk *head;  //< Chunk currently being filled, NULL before the first allocation
+    struct arena_chunk *large; //< One-off blocks such as $(...) output, freed rather than kept
+};
+
+/**
+ * Lexical classes of the bytes the command line lexer stops at
+ *
+ * Delimiters are the characters " \r\a\n\t". The operator characters only
+ * mean something when they make up a whole token; the glob characters make the
+ * word they are in a pattern.
+ */
+enum byte_class
+{
+    BYTE_WORD,   //< Part of an ordinary token
+    BYTE_DELIM,  //< Separates tokens
+    BYTE_DOLLAR, //< "$$" expands to the shell's PID
+    BYTE_LT,     //< "<" input redirect
+    BYTE_GT,     //< ">" output redirect
+    BYTE_AMP,    //< "&" run in background, when last
+    BYTE_HASH,   //< "#" comment, when it starts the first token
+    BYTE_PIPE,   //< "|" separates pipeline stages
+    BYTE_SEMI,   //< ";" separates commands in blocks, and ends a word even when stuck to it
+    BYTE_GLOB    //< "*", "?" or "[" in a pathname pattern
+};
+
+/**
+ * What a word of a command line needs done to it before it becomes an argument
+ */
+enum word_flags
+{
+    WORD_PID = 1,   //< Has a "$$"
+    WORD_VAR = 2,   //< Has a variable reference
+    WORD_SUBST = 4, //< Has a "$(...)"
+    WORD_SEMI = 8,  //< Is a ";" separating commands
+    WORD_GLOB = 16, //< Has a "*", "?" or "[", so may be a pathname pattern
+    WORD_BODY = 32  //< Is the body of a here-document, read from the lines after its own
+};
+
+/**
+ * A word of a command line as the lexer found it, before any expansion
+ */
+struct word
+{
+    char *text;     //< The word, NUL-terminated
+    unsigned flags; //< Any of enum word_flags
+};
+
+/**
+ * Kinds of redirect
+ */
+enum redirect_type
+{
+    REDIR_IN,      //< "N< FILE": read FILE
+    REDIR_OUT,     //< "N> FILE": create or truncate FILE
+    REDIR_APPEND,  //< "N>> FILE": create FILE or append to it
+    REDIR_DUP,     //< "N>&M" or "N<&M": make N a copy of M
+    REDIR_HEREDOC, //< "N<< WORD": read the lines that followed, up to WORD
+    REDIR_HERESTR  //< "N<<< WORD": read WORD and a newline
+};
+
+/**
+ * One redirect of a command; a command's redirects are applied in order
+ */
+struct redirect
+{
+    enum redirect_type type;
+    int fd;     //< Descriptor being redirected
+    char *file; //< File to open, or the text of a here-document or here-string
+    int target; //< REDIR_DUP: the descriptor fd becomes a copy of
+};
 
 /** 
  * Stores information about a command entered into smallsh
  */
-struct command
-{
-    char **args;    //< Individual arguments of the command
-    int nargs;      //< Number of arguments in the command
-    char *inFile;   //< Input redirect file specified in command
-    char *outFile;  //< Output redirect file specified in command
-    bool run_in_bg; //< Determine if command should run as a background process
-};
+struct command
+{
+    char **args;              //< Individual arguments of the command, NULL-terminated
+    int nargs;                //< Number of arguments in the command
+    int cap;                  //< Number of slots allocated in args
+    struct redirect *redirs;  //< Redirects, in the order they were given
+    int nredirs;              //< Number of redirects
+    int redircap;             //< Number of slots allocated in redirs
+    bool run_in_bg;           //< Determine if command should run as a background process
+    int capture_fd;           //< Pipe stderr (and stdout, unless redirected or piped) is captured through, or -1
+    struct launch_opts *opts; //< CPU set, niceness and limits from affinity/nice/ulimit prefixes, or NULL
+    int prefix;               //< Number of prefix words taken off the front of args
+};
+
+/**
+ * Scheduling settings and resource limits a command is launched with
+ */
+struct launch_opts
+{
+    cpu_set_t cpus;         //< CPUs the command may run on, if has_cpus
+    bool has_cpus;          //< Whether cpus replaces the shell's set (and the background default)
+    int nice;               //< Added to the command's niceness
+    unsigned limits;        //< Bit i is set when values[i] is given
+    rlim_t values[NLIMITS]; //< Soft limits, in the units of limit_kinds[i].resource
+};
+
+/**
+ * A resource limit ulimit can set
+ */
+struct limit_kind
+{
+    char flag;        //< Option letter
+    int resource;     //< RLIMIT_* constant
+    rlim_t unit;      //< Bytes (or whatever the resource counts) per unit given on the command line
+    const char *name; //< Description for listing
+};
+
+/**
+ * A directory entry as the getdents64 system call returns it
+ */
+struct linux_dirent64
+{
+    uint64_t d_ino;          //< Inode number
+    int64_t d_off;           //< Offset of the next entry
+    unsigned short d_reclen; //< Size of this entry
+    unsigned char d_type;    //< File type, DT_UNKNOWN if the file system doesn't say
+    char d_name[];           //< File name, NUL-terminated
+};
+
+/**
+ * One name in a directory listing
+ */
+struct dir_entry
+{
+    char *name;         //< File name
+    unsigned char type; //< d_type of the entry
+};
+
+/**
+ * A path matched by a glob, with its sort key
+ */
+struct glob_match
+{
+    uint64_t key; //< First 8 bytes of the path, big-endian, zero-padded
+    char *path;   //< The path
+};
+
+/**
+ * A directory read for globbing
+ *
+ * Each directory is read once per command line, however many patterns look in it;
+ * the listing lives in the command line's arena.
+ */
+struct dir_listing
+{
+    char *path;                //< Directory as the pattern spells it, with a trailing '/', or "" for "."
+    struct dir_entry *entries; //< Entries other than "." and "..", in directory order
+    int count;                 //< Number of entries
+    struct dir_listing *next;  //< Next directory read on the same line
+};
+
+/**
+ * Stores the stages of a command line, connected by "|"
+ */
+struct pipeline
+{
+    struct command *cmds;     //< Stages in order; each stage's stdout feeds the next stage's stdin
+    int ncmds;                //< Number of stages on the command line (0 for an empty line or comment)
+    int cap;                  //< Number of stages allocated in cmds
+    bool run_in_bg;           //< Determine if the whole pipeline should run in the background
+    struct arena mem;         //< Holds the arguments, file names and expanded tokens of the stages
+    struct dir_listing *dirs; //< Directories read for globbing, shared by every pattern on the line
+};
+
+/**
+ * Kinds of node in a parsed script
+ */
+enum node_type
+{
+    NODE_CMD,   //< A pipeline
+    NODE_FOR,   //< for VAR in WORDS; do BODY; done
+    NODE_WHILE, //< while COND; do BODY; done
+    NODE_IF     //< if COND; then BODY; else ORELSE; fi
+};
+
+/**
+ * A command or block of a script, parsed once however many times it runs
+ *
+ * Commands keep their unexpanded words as a template; each run only redoes the
+ * expansions, without lexing the text again.
+ */
+struct node
+{
+    enum node_type type;
+    struct word *words;  //< CMD: the words of the pipeline; FOR: the words to loop over
+    int nwords;          //< Number of words
+    char *var;           //< FOR: the loop variable
+    struct node *cond;   //< WHILE, IF: the commands whose status decides
+    struct node *body;   //< FOR, WHILE: the loop body; IF: run when cond succeeds
+    struct node *orelse; //< IF: run when cond fails ("elif" is an IF here), NULL for none
+    struct node *next;   //< Next node of the same list
+};
+
+/**
+ * Where command lines come from: a script mapped into memory, or a descriptor read in chunks
+ */
+struct line_source
+{
+    char *buf;   //< The mapped script, or the chunk buffer
+    size_t len;  //< Bytes of data in buf
+    size_t pos;  //< Offset in buf of the next line
+    size_t cap;  //< Size of the chunk buffer (unused when mapped)
+    int fd;      //< Descriptor read in chunks, or -1 when the whole script is mapped
+    bool eof;    //< fd has no more data
+    char *spill; //< Copy of a mapped script's last line when it has no newline
+    long lineno; //< Number of lines handed out so far
+};
+
+/**
+ * State of the parser of a script that can span several lines
+ */
+struct script_parser
+{
+    struct line_source *src; //< Where the rest of an open block comes from, NULL if nowhere
+    struct arena *mem;       //< Holds the nodes and copies of their words
+    struct word *words;      //< Words of the current line
+    int nwords;              //< Number of words in the current line
+    int pos;                 //< Next word to look at
+};
+
+/**
+ * A command line being run by the "parallel" built-in
+ */
+struct parallel_slot
+{
+    pid_t *pids; //< PID of each stage, -1 once reaped or if it could not be started
+    int npids;   //< Number of stages
+    int nalive;  //< Stages still running; 0 means the slot is free
+    int status;  //< Status of the last stage
+};
+
+/**
+ * Strategies for launching non-built-in commands
+ */
+enum launch_mode
+{
+    LAUNCH_SPAWN, //< posix_spawn: vfork-style clone, redirects expressed as file actions
+    LAUNCH_FORK   //< Classic fork, then handle_redirect and execvp in the child
+};
+
+/**
+ * An entry in the resolved-executable cache, mapping a command name to its absolute path
+ */
+struct path_entry
+{
+    char *name;              //< Command name as typed by the user
+    char *path;              //< Absolute path the name resolved to
+    unsigned hits;           //< Number of times the entry has been used
+    struct path_entry *next; //< Next entry in the same bucket
+};
+
+/**
+ * Cache of command name -> absolute path, so PATH is not searched on every launch
+ */
+struct path_cache
+{
+    struct path_entry *buckets[PATH_CACHE_BUCKETS]; //< Chained hash table of entries
+    char *path_env;                                 //< Copy of PATH the entries were resolved against
+    int size;                                       //< Number of entries in the cache
+};
+
+/**
+ * A shell variable, kept as a single "NAME=VALUE" string so an exported one can go
+ * into the environment as it is
+ */
+struct var
+{
+    char *entry;    //< "NAME=VALUE", NULL in an empty slot
+    size_t namelen; //< Length of NAME
+    unsigned hash;  //< Hash of NAME
+    bool exported;  //< Passed on to commands in their environment
+};
+
+/**
+ * Every shell variable, in an open-addressing hash table with linear probing
+ *
+ * Commands are given envp as it is. It only holds the exported variables and is
+ * rebuilt lazily, after one of them changes, instead of on every launch.
+ */
+struct var_store
+{
+    struct var *slots; //< The table, nslots long
+    int nslots;        //< A power of two, 0 until the environment is imported
+    int size;          //< Number of variables
+    char **envp;       //< NULL-terminated entries of the exported variables
+    bool stale;        //< An exported variable changed since envp was built
+    pid_t lastbg;      //< PID of the last background job started, for "$!" (0 if none)
+    int status;        //< Status of the last foreground command, for "$?"
+};
+
+/**
+ * Ways the cat built-in can move data, fastest first
+ */
+enum copy_method
+{
+    COPY_RANGE,      //< copy_file_range: file to file inside the kernel, sharing extents where it can
+    COPY_SENDFILE,   //< sendfile: from a file to anything
+    COPY_SPLICE,     //< splice: to or from a pipe
+    COPY_READ_WRITE, //< read and write through a buffer
+    COPY_METHODS     //< Number of methods
+};
+
+/**
+ * Resource usage of every reaped child that ran one command, collected over the session
+ *
+ * Latencies (in microseconds) and peak RSS (in KiB) go into log-linear histograms:
+ * STATS_SUB_BUCKETS buckets per power of two, so percentiles are within 12.5%.
+ */
+struct cmd_stats
+{
+    char *name;                         //< Command name, as typed
+    long runs;                          //< Children reaped
+    long failures;                      //< Children that exited non-zero or were killed
+    double wall;                        //< Total seconds from launch to reap
+    double user;                        //< Total user CPU seconds
+    double sys;                         //< Total system CPU seconds
+    long nvcsw;                         //< Total voluntary context switches
+    long nivcsw;                        //< Total involuntary context switches
+    long max_wall_us;                   //< Slowest run
+    long max_rss;                       //< Largest peak RSS of a run
+    unsigned wall_hist[STATS_BUCKETS];  //< Histogram of wall times
+    unsigned rss_hist[STATS_BUCKETS];   //< Histogram of peak RSS
+};
+
+/**
+ * A child that has been launched but not reaped yet
+ */
+struct proc_start
+{
+    pid_t pid;             //< PID of the child, 0 for an empty slot
+    int cmd;               //< Position of its command in the stats array
+    struct timespec start; //< When it was launched
+};
+
+/**
+ * Per-command resource accounting, fed by reap_child()
+ */
+struct stats
+{
+    struct cmd_stats *cmds;        //< One entry per distinct command name
+    int ncmds;                     //< Number of entries in cmds
+    int cap;                       //< Capacity of cmds
+    int *index;                    //< Open-addressing index of cmds by name, holding positions + 1 (0 = empty)
+    int nslots;                    //< Size of index, a power of two
+    struct proc_start *procs;      //< Open-addressing table of unreaped children by PID
+    int nprocs;                    //< Number of children in procs
+    int nprocslots;                //< Size of procs, a power of two
+    long long copy_bytes;          //< Bytes the cat built-in copied without launching cat
+    double copy_secs;              //< Seconds it spent copying them
+    long copy_files[COPY_METHODS]; //< Inputs it copied with each enum copy_method
+};
+
+/**
+ * Trace of the shell's phases in Chrome's JSON trace event format (-x FILE or SMALLSH_TRACE)
+ *
+ * Events are appended to buf and only written out when it fills up, while the shell
+ * waits for input, or at exit. Each event is a complete ("X") event ending in ",\n", and
+ * the closing "]" is left out, as the format allows, so forked children can append
+ * their own events to the same O_APPEND file.
+ */
+struct trace
+{
+    int fd;                   //< Trace file, -1 when tracing is off
+    pid_t pid;                //< PID of the shell, the "process" every event belongs to
+    size_t len;               //< Bytes of buf waiting to be written
+    char buf[TRACE_BUF_SIZE]; //< Pending events
+};
+
+/**
+ * Command history: an append-only file of lines and an index of where each one ends
+ *
+ * Both files are mapped rather than read, so opening them costs the same however long
+ * the history is, and entry n is found without scanning. The index holds the offset
+ * just past each entry's newline as a uint64_t; it is consistent with the history
+ * when its last offset is the history's size. Entries are appended under flock(), so
+ * several shells can share the files.
+ */
+struct history
+{
+    int fd;                //< History file, opened O_APPEND, or -1 when not open
+    int idx_fd;            //< Index file, opened O_APPEND
+    bool tried;            //< Whether opening has been tried, so a failure isn't retried
+    const char *data;      //< The history, mapped read-only, or NULL when empty
+    size_t data_len;       //< Bytes mapped of the history
+    const uint64_t *ends;  //< The index, mapped read-only
+    size_t count;          //< Entries in the mapped index
+    char *line;            //< Buffer a recalled line is built in
+    size_t linecap;        //< Bytes allocated for line
+};
+
+/**
+ * States of a job
+ */
+enum job_state
+{
+    JOB_RUNNING, //< At least one process is running
+    JOB_STOPPED, //< Stopped by a signal, e.g. Ctrl-Z
+    JOB_DONE     //< Every process has finished, waiting to be reported
+};
+
+/**
+ * The tail of a background job's stdout and stderr, kept in memory (-o)
+ *
+ * Output arrives through a pipe and goes into a ring buffer, which grows up to the
+ * per-job cap and then keeps only the newest bytes. The log outlives its job, so it
+ * can still be read once the job is done, until the global cap needs its memory.
+ */
+struct job_log
+{
+    int id;               //< Number of the job it belonged to
+    pid_t pid;            //< PID the job was announced with
+    char *text;           //< Command line of the job
+    int fd;               //< Read end of the pipe, -1 once every writer has closed it
+    bool finished;        //< Whether the job is gone, so the log may be evicted
+    char *ring;           //< The captured bytes
+    size_t cap;           //< Size of ring
+    size_t head;          //< Position of the oldest byte in ring
+    size_t len;           //< Bytes held in ring
+    long long dropped;    //< Bytes overwritten or never stored
+    struct job_log *next; //< Next newer log
+};
+
+/**
+ * A connection to the job-submission socket (-S)
+ *
+ * Every line received is a command. Once it finishes, its status goes back as the
+ * line "N exit value V" or "N terminated by signal S", N being the line's number.
+ */
+struct client
+{
+    int fd;        //< The connection, non-blocking
+    char *in;      //< Bytes received: whole lines waiting to run, then maybe part of one
+    size_t inpos;  //< Start of the first line not run yet
+    size_t inlen;  //< Bytes in in
+    size_t incap;  //< Bytes allocated for in
+    char *out;     //< Status lines the socket had no room for yet
+    size_t outlen; //< Bytes in out
+    size_t outcap; //< Bytes allocated for out
+    long lineno;   //< Lines taken from in so far
+    int running;   //< Commands of this client still running
+    bool eof;      //< Nothing more will be read: the client finished sending, said "exit" or went away
+};
+
+/**
+ * State of the job-submission daemon (-S)
+ */
+struct server
+{
+    int listen_fd;           //< Listening socket, or -1 when not serving
+    struct client **clients; //< Connected clients
+    int nclients;            //< Number of clients
+    int cap;                 //< Number of clients allocated in clients
+    int running;             //< Commands running for all clients together
+    int max_running;         //< Most commands to run at once; the rest wait their turn
+};
+
+/**
+ * Every captured job log and the limits they share
+ */
+struct capture
+{
+    bool enabled;           //< Whether background jobs are captured (-o)
+    size_t job_max;         //< Largest ring a single job may have
+    size_t total_max;       //< Largest total size of every ring together
+    size_t total;           //< Total size of every ring
+    int nopen;              //< Logs whose pipe is still open
+    struct job_log *oldest; //< List of logs, oldest first
+    struct job_log *newest; //< Last log of the list
+};
+
+/**
+ * A command line the shell launched: every stage of a pipeline, in one process group
+ */
+struct job
+{
+    int id;                //< Job number, as in %1
+    pid_t pgid;            //< Process group of the job, or -1 if it shares the shell's (no job control)
+    pid_t *pids;           //< PID of each stage, -1 for a stage that could not be started
+    int *status;           //< Status of each stage, once it has finished
+    int npids;             //< Number of stages
+    int nalive;            //< Stages that have not finished yet
+    pid_t shown;           //< PID of the last stage that started, the one "background pid" messages name
+    enum job_state state;  //< Whether the job is running, stopped or done
+    bool notified;         //< Whether its current state has been reported to the user
+    int stopsig;           //< Signal that stopped the job
+    char *text;            //< The command line, as listed by "jobs"
+    struct termios tmodes; //< Terminal modes the job had when it was stopped
+    bool has_tmodes;       //< Whether tmodes has been saved
+    struct job_log *log;   //< Captured output, or NULL
+    struct client *client; //< Client that submitted it over the socket (-S), or NULL
+    long lineno;           //< Number of the client's line it came from
+};
+
+/** 
+ * Stores information about the jobs the shell has launched and is still tracking
+ *
+ * Every process still running is indexed by PID so the job a reaped child belongs to
+ * is found in O(1), however many processes are running.
+ */
+struct background
+{
+    pid_t *pids;        //< Array to hold PIDs of all currently running processes of every job, in no particular order
+    struct job **owner; //< The job each PID in pids belongs to
+    int size;           //< The number of currently running processes
+    int cap;            //< Number of PIDs allocated in pids
+    int *index;         //< Open-addressing hash of PID -> position in pids + 1 (0 marks an empty slot)
+    int nslots;         //< Number of slots in index, a power of two
+    int sigfd;          //< signalfd that becomes readable when a child exits
+    bool sigpending;    //< A SIGCHLD was read from sigfd while capturing output, but not acted on yet
+    struct job **jobs;  //< Every job, ordered by job number
+    int njobs;          //< Number of jobs
+    int jobcap;         //< Number of jobs allocated in jobs
+    int current;        //< Number of the current job (%+), 0 if there is none
+};
+
+/**
+ * Signature shared by every built-in in the dispatch table; the parameters are those of exec_cmd()
+ *
+ * @return true if shell should continue running, false if the shell should stop running
+ */
+typedef bool (*builtin_fn)(struct command *, int *, struct sigaction, struct background *);
+
+/**
+ * A command run inside the shell instead of in a new process
+ */
+struct builtin
+{
+    const char *name;                   //< Command name
+    builtin_fn fn;                      //< Runs the command
+    bool external;                      //< Also exists as a program, which is used when run in the background
+    bool (*in_shell)(struct command *); //< If set, whether the built-in can run cmd; the program runs it if not
+};
+
+/**
+ * sa_handler ((*sa_handler)(int)) for SIGTSTP
+ * 
+ * When SIGTSTP occurs, toggles foreground-only mode.
+ * Uses global bool variable allow_bg to accomplish this.
+ * 
+ * @param signo required but not used
+ */
+void handle_SIGTSTP(int);
+
+/**
+ * Reset members of the command structure so it can be reused/filled again
+ * 
+ * @param cmd pointer to command struct to reset
+ */
+void reset_command(struct command *);
+
+/**
+ * Release every stage of a pipeline so it can be filled again
+ *
+ * Resets the pipeline's arena, which frees everything parse_command() allocated.
+ *
+ * @param pl pointer to pipeline struct to reset
+ */
+void reset_pipeline(struct pipeline *);
+
+/**
+ * Append a new, empty stage to a pipeline
+ *
+ * @param pl the pipeline to extend
+ * @return pointer to the new stage
+ */
+struct command *add_stage(struct pipeline *);
+
+/**
+ * Append an argument to a command, growing its args array as needed
+ *
+ * @param mem the arena the args array lives in
+ * @param cmd the command to add to
+ * @param arg the argument to add
+ */
+void add_arg(struct arena *, struct command *, char *);
+
+/**
+ * Add the paths matching a pattern to a command's arguments, in sorted order
+ *
+ * "*", "?" and "[...]" match as fnmatch() does, and only match a leading '.' when
+ * the pattern spells it out. Each directory is listed once into dirs, and reused by
+ * later patterns on the same line. A pattern matching nothing is added unchanged.
+ *
+ * @param mem the arena the arguments and listings live in
+ * @param dirs the line's directory cache, NULL-initialized
+ * @param cmd the command to add to
+ * @param pattern the pattern
+ * @return the number of paths added, 0 if the pattern was added as it is
+ */
+int glob_expand(struct arena *, struct dir_listing **, struct command *, char *);
+
+/**
+ * Append a redirect to a command, growing its redirs array as needed
+ *
+ * @param mem the arena the redirs array lives in
+ * @param cmd the command to add to
+ * @param type the kind of redirect
+ * @param fd the descriptor being redirected
+ * @param file the file to open, or NULL if it comes later or isn't needed
+ * @param target for REDIR_DUP, the descriptor to copy
+ * @return the new redirect, valid until the next one is added
+ */
+struct redirect *add_redirect(struct arena *, struct command *, enum redirect_type, int, char *, int);
+
+/**
+ * Check whether any of a command's redirects points a descriptor elsewhere
+ *
+ * @param cmd the command
+ * @param fd the descriptor
+ * @return true if fd is redirected
+ */
+bool redirects_fd(struct command *, int);
+
+/**
+ * Allocate memory from an arena
+ *
+ * @param a the arena to allocate from
+ * @param size number of bytes needed
+ * @return pointer to size bytes, aligned to ARENA_ALIGN, valid until the next arena_reset()
+ */
+void *arena_alloc(struct arena *, size_t);
+
+/**
+ * Copy a string into an arena
+ *
+ * @param a the arena to allocate from
+ * @param str the string to copy
+ * @return the copy
+ */
+char *arena_strdup(struct arena *, const char *);
+
+/**
+ * Release every allocation made from an arena
+ *
+ * The memory is kept for reuse. If more than one chunk was in use they are merged
+ * into a single chunk of the same total size. Large blocks are freed outright.
+ *
+ * @param a the arena to reset
+ */
+void arena_reset(struct arena *);
+
+/**
+ * Open a script file as a line source, mapping it into memory when it is a regular file
+ *
+ * @param path the script to read
+ * @param src the line source to initialize
+ * @return false if the file could not be opened
+ */
+bool open_script(const char *, struct line_source *);
+
+/**
+ * Use a descriptor as a line source, reading it in LINE_CHUNK_SIZE chunks
+ *
+ * @param fd the descriptor to read
+ * @param src the line source to initialize
+ */
+void open_stream(int, struct line_source *);
+
+/**
+ * Determine whether a complete line is already buffered, so reading it won't block
+ *
+ * @param src the line source to check
+ * @return true if read_command() can return a line without reading
+ */
+bool line_ready(struct line_source *);
+
+/**
+ * Give all of an arena's memory back to the system
+ *
+ * @param a the arena to free; it can be used again afterwards
+ */
+void arena_free(struct arena *);
+
+/**
+ * Get the next command line
+ * 
+ * Lines are split off in place in the source's buffer (the newline becomes '\0'),
+ * so the result is only valid until the next call.
+ * 
+ * @param src where to read the command from
+ * @return the next command line, or NULL at end of input
+ */
+char *read_command(struct line_source *);
+
+/**
+ * Parse a command line
+ * 
+ * Split the command line into tokens, split the tokens into stages at each "|",
+ * count the arguments, detect any i/o redirects, expand the PID variable, and check
+ * for the background commands, filling a pipeline struct with the information.
+ * A syntax error (such as a missing redirect file or an empty stage) leaves the
+ * pipeline empty; reporting it is up to the caller.
+ *
+ * This is a single pass over the line: delimiters and special bytes are found with
+ * SSE2/AVX2 byte-class scanning when the CPU has it (scalar otherwise), tokens are
+ * split off in place, and "$$" is expanded as each token is finished. There is no
+ * limit on the length of the line or the number of arguments.
+ * 
+ * A line with ";" or a block keyword is more than one pipeline and is a syntax error
+ * here; parse_line() handles those.
+ *
+ * @param cmd_str the full command line
+ * @param pl the pipeline struct to store parsed data in
+ * @return false if the line has a syntax error
+ */
+bool parse_command(char *, struct pipeline *);
+
+/**
+ * Parse a command line that may also be a list of commands or a block
+ *
+ * A single pipeline is parsed into pl exactly as parse_command() does. Anything with
+ * ";" or a for/while/if keyword is parsed into a tree of nodes instead, reading
+ * more lines from src (prompting with "> " at a terminal) until every block is closed.
+ * Outside a block, ";" only separates commands when lists is set.
+ *
+ * @param line the command line, split up in place
+ * @param src where more lines come from, or NULL if the line has to be complete
+ * @param lists whether ";" separates commands on a line that doesn't open a block, as in "$(...)"
+ * @param pl the pipeline struct to store a single pipeline in
+ * @param mem the arena to put the nodes in; they stay valid until it is reset
+ * @param script set to the first node, or NULL for a single pipeline
+ * @return false if there is a syntax error, or input ends inside a block
+ */
+bool parse_line(char *, struct line_source *, bool, struct pipeline *, struct arena *, struct node **);
+
+/**
+ * Run the nodes of a parsed script in order
+ *
+ * Each command's words are expanded again as it runs, then it is run by exec_cmd().
+ * A command killed by SIGINT ends every enclosing block.
+ *
+ * @param n the first node
+ * @param pl the pipeline struct commands are expanded into
+ * @param lastExit the exit value or terminating signal of the last process
+ * @param sa_SIGINT the SIGINT action struct to be passed down to exec_cmd()
+ * @param bg the background struct holding information about the jobs
+ * @return true if shell should continue running, false if "exit" was run
+ */
+bool run_script(struct node *, struct pipeline *, int *, struct sigaction, struct background *);
+
+/**
+ * Determine whether two strings are equal
+ * 
+ * This is just to make the syntax for checking string equality a little nicer
+ * 
+ * @param str1 the first string to compare
+ * @param str2 the second string to compare
+ * @return true if str1 == str2, false otherwise
+ */
+bool strmatch(const char *, const char *);
+
+/**
+ * Replace any instance of "$$" in token to the value of pid, storing the expanded version in result 
+ * 
+ * @param result a string to hold the current argument after "$$" has been replaced by the PID. Must
+ *        be large enough to hold a string containing only '$' characters 
+ *        (the string length + half the string length * the length of pid)
+ * @param token the original arg perform variable expansion on
+ * @param the current PID, stored as a string
+ */
+void expand_pid(char *, char *, char *);
+
+/**
+ * Execute the command entered by the user
+ * 
+ * Execute built-in function if one exists, otherwise outsource execution, and
+ * tell the main loop whether to continue or not. If the command is an empty line
+ * or a comment, then continue without doing anything. If the command is "exit",
+ * exit the main loop. Otherwise execute the appropriate built-in or outsource,
+ * then continue.
+ * 
+ * Built-ins are only recognized when the pipeline has a single stage.
+ * 
+ * @param  pl the pipeline struct holding information about the current command line
+ * @param  lastExit the exit value or terminating signal of the last process
+ * @param  sa_SIGINT the SIGINT action struct to be passed down to run_non_builtin()
+ * 
+ * @return true if shell should continue running, false if the shell should stop running
+ */
+bool exec_cmd(struct pipeline *, int *, struct sigaction, struct background *);
+
+/**
+ * Look up a built-in by name
+ *
+ * The first call searches for a hash seed under which every built-in gets its own
+ * slot of a BUILTIN_SLOTS table; after that a lookup is one hash and one comparison.
+ *
+ * @param name the command name
+ * @return the built-in, or NULL if name isn't one
+ */
+const struct builtin *find_builtin(const char *);
+
+/**
+ * Apply a command's redirects to the shell itself while a built-in runs
+ *
+ * @param cmd the command whose redirects to apply
+ * @param saved receives a copy of each original descriptor (-1 where not redirected,
+ *              -2 where it wasn't open), indexed by descriptor
+ * @return false if a file could not be opened; nothing is left redirected then
+ */
+bool swap_redirects(struct command *, int[MAX_REDIRECT_FD + 1]);
+
+/**
+ * Undo swap_redirects(), flushing anything the built-in printed first
+ *
+ * @param saved the descriptors filled in by swap_redirects()
+ */
+void restore_redirects(int[MAX_REDIRECT_FD + 1]);
+
+/**
+ * Change the current directory
+ * 
+ * @param  dir is the path (relative or absolute) to the directory to change to
+ * 
+ * @return always true
+ */
+bool smallsh_cd(char *);
+
+/**
+ * Change the current directory
+ * 
+ * @param  dir is the path (relative or absolute) to the directory to change to
+ * 
+ * @return always true
+ */
+bool smallsh_status(int);
+
+/**
+ * Print the exit value or terminating signal of every stage of the last foreground pipeline
+ *
+ * @return always true
+ */
+bool smallsh_pipestatus(void);
+
+/**
+ * Print or update the resolved-executable cache
+ *
+ * With no arguments, list every cached command with its hit count and path.
+ * With "-r", clear the cache. Otherwise look up each named command and add it.
+ *
+ * @param args the arguments of the command, starting with "hash"
+ * @return always true
+ */
+bool smallsh_hash(char **);
+
+/**
+ * Print the arguments separated by spaces, like echo(1)
+ *
+ * Leading -n (no newline), -e (interpret backslash escapes) and -E options are accepted.
+ *
+ * @param args the arguments of the command, starting with "echo"
+ * @return the exit value, always 0
+ */
+int smallsh_echo(char **);
+
+/**
+ * Print the current working directory
+ *
+ * @return the exit value: 0, or 1 if it could not be determined
+ */
+int smallsh_pwd(void);
+
+/**
+ * Formatted output, like printf(1)
+ *
+ * Supports backslash escapes and the d, i, o, u, x, X, e, E, f, g, G, c, s and b
+ * conversions with flags, width and precision. The format is reused until every
+ * argument has been consumed.
+ *
+ * @param args the arguments of the command, starting with "printf"
+ * @return the exit value: 0, 1 for an invalid directive, 2 for a missing format
+ */
+int smallsh_printf(char **);
+
+/**
+ * Evaluate a conditional expression, like test(1) and [
+ *
+ * Supports string, integer and file tests, "!", "-a", "-o" and parentheses.
+ *
+ * @param args the arguments of the command, starting with "test" or "["
+ * @return the exit value: 0 if true, 1 if false, 2 for a syntax error
+ */
+int smallsh_test(char **);
+
+/**
+ * Run the command lines read from stdin, keeping N of them running at once
+ *
+ * A new line is started as soon as one finishes. Each line may be a pipeline, runs
+ * like a foreground command and gets /dev/null as stdin unless it redirects it.
+ * Background processes that finish meanwhile are reported as usual.
+ *
+ * @param args the arguments of the command: "parallel" [-j N], N defaulting to the number of CPUs
+ * @param sa_SIGINT the SIGINT action struct to be passed down to launch_pipeline()
+ * @param bg the background struct holding information about the processes currently running in the background
+ * @return the exit value: the number of lines that failed (at most 255), or 2 for a usage error
+ */
+int smallsh_parallel(char **, struct sigaction, struct background *);
+
+/**
+ * Wait for background jobs to finish, reporting them as they do
+ *
+ * @param args the arguments of the command: "wait" followed by optional PIDs or job specs (%n); with none, waits for all
+ * @param bg the background struct holding information about the jobs currently running in the background
+ * @return the exit value: the status of the last job waited for, 127 if one isn't a
+ *         background job, or 0 when waiting for all
+ */
+int smallsh_wait(char **, struct background *);
+
+/**
+ * List the jobs in the background, running or stopped
+ *
+ * @param args the arguments of the command: "jobs", or "jobs -p" to list process group IDs only
+ * @param bg the background struct holding information about the jobs
+ * @return the exit value: 0, or 2 for a usage error
+ */
+int smallsh_jobs(char **, struct background *);
+
+/**
+ * Bring a job to the foreground, continuing it if it is stopped, and wait for it
+ *
+ * @param args the arguments of the command: "fg" and an optional job spec, the current job by default
+ * @param bg the background struct holding information about the jobs
+ * @param lastExit receives the status of the job
+ * @return the exit value: 0 unless the job couldn't be found or there is no job control
+ */
+int smallsh_fg(char **, struct background *, int *);
+
+/**
+ * Continue stopped jobs in the background
+ *
+ * @param args the arguments of the command: "bg" and optional job specs, the current job by default
+ * @param bg the background struct holding information about the jobs
+ * @return the exit value: 0, or 1 if a job couldn't be found
+ */
+int smallsh_bg(char **, struct background *);
+
+/**
+ * Send a signal to jobs or processes
+ *
+ * A job spec (%n) signals the job's whole process group. Stopped jobs sent a signal
+ * that should end them are also continued, so they get to act on it.
+ *
+ * @param args the arguments of the command: "kill" [-SIG | -s SIG | -l] and job specs or PIDs
+ * @param bg the background struct holding information about the jobs
+ * @return the exit value: 0 if every target was signalled, 1 otherwise, 2 for a usage error
+ */
+int smallsh_kill(char **, struct background *);
+
+/**
+ * Print the captured output of background jobs, or list the jobs that have some
+ *
+ * @param args the arguments of the command: "joblog" followed by job specs (%n) or PIDs; with none, lists the logs
+ * @param bg the background struct holding information about the jobs
+ * @return the exit value: 0, or 1 if capture is off or a job has no log
+ */
+int smallsh_joblog(char **, struct background *);
 
-/** 
- * Stores information about currently running background processes
+/**
+ * Open and map the history file and its index, if that hasn't been done yet
+ *
+ * The index is brought up to date if the history has entries it lacks (e.g. the
+ * shell died between the two writes); only then does the cost depend on the history.
+ *
+ * @return false if there is no history file to use
  */
-struct background
-{
-    pid_t pids[BG_CAP]; //< Array to hold PIDs of all currently running background processes
-    int size;           //< The number of currently running background processes
-};
+bool history_open(void);
 
 /**
- * sa_handler ((*sa_handler)(int)) for SIGTSTP
- * 
- * When SIGTSTP occurs, toggles foreground-only mode.
- * Uses global bool variable allow_bg to accomplish this.
- * 
- * @param signo required but not used
+ * Unmap and close the history, so the next use opens it again
  */
-void handle_SIGTSTP(int);
+void history_close(void);
 
 /**
- * Reset members of the command structure so it can be reused/filled again
- * 
- * @param cmd pointer to command struct to reset
+ * Append a line to the history; blank lines are skipped
+ *
+ * @param line the line, without its newline
  */
-void reset_command(struct command *);
+void history_add(const char *);
 
 /**
- * Get the last command entered by the user
- * 
- * @return the user-entered command
+ * Expand a history reference at the start of a line: "!!", "!n", "!-n" or "!prefix"
+ *
+ * The reference is replaced by the entry it names; the rest of the line is kept.
+ *
+ * @param line the line as typed
+ * @param expanded receives the expanded line, valid until the next call
+ * @return 1 if the line was expanded, 0 if it has no reference, -1 if the entry
+ *         doesn't exist (already reported)
  */
-char *read_command(void);
+int history_expand(const char *, char **);
 
 /**
- * Parse a command line
- * 
- * Split the command line into tokens, count the arguments, detect any i/o redirects, 
- * expand the PID variable, and check for the background commands, filling 
- * a command struct with the information
- * 
- * @param cmd_str the full command line
- * @param cmd the command struct to store parsed data in
+ * List or search the history
+ *
+ * @param args the arguments of the command: "history" [N], "history -s TEXT" or "history -p PREFIX"
+ * @return the exit value: 0, 1 if nothing matched or there is no history, or 2 for a usage error
  */
-void parse_command(char *, struct command *);
+int smallsh_history(char **);
 
 /**
- * Determine whether two strings are equal
- * 
- * This is just to make the syntax for checking string equality a little nicer
- * 
- * @param str1 the first string to compare
- * @param str2 the second string to compare
- * @return true if str1 == str2, false otherwise
+ * Copy files, or stdin, to stdout without leaving the shell
+ *
+ * Each input is moved with the fastest of copy_file_range, sendfile, splice and
+ * read/write that works for it and stdout, and counted in the stats; with tracing on,
+ * each gets an event giving its size, method and throughput. "-" is stdin. Ctrl-C
+ * stops the copy.
+ *
+ * @param args the arguments of the command, starting with "cat"
+ * @return the exit value: 0, 1 if an input failed, or -1 if interrupted
  */
-bool strmatch(const char *, const char *);
+int smallsh_cat(char **);
 
 /**
- * Replace any instance of "$$" in token to the value of pid, storing the expanded version in result 
- * 
- * @param result a string to hold the current argument after "$$" has been replaced by the PID. Must
- *        be large enough to hold a string containing only '$' characters 
- *        (half the string length * the max number of digits in a PID)
- * @param token the original arg perform variable expansion on
- * @param the current PID, stored as a string
+ * Print per-command resource usage for every child reaped so far
+ *
+ * Commands are listed slowest first (by total wall time) with run and failure counts,
+ * p50/p99/max wall time, total CPU time, p50/p99/max peak RSS and context switches.
+ *
+ * @param args the arguments of the command: "stats", or "stats -c" to clear the counters
+ * @return the exit value: 0, or 2 for a usage error
  */
-void expand_pid(char *, char *, char *);
+int smallsh_stats(char **);
 
 /**
- * Execute the command entered by the user
- * 
- * Execute built-in function if one exists, otherwise outsource execution, and
- * tell the main loop whether to continue or not. If the command is an empty line
- * or a comment, then continue without doing anything. If the command is "exit",
- * exit the main loop. Otherwise execute the appropriate built-in or outsource,
- * then continue.
- * 
- * @param  cmd the command struct holding information about the current command
- * @param  lastExit the exit value or terminating signal of the last process
- * @param  sa_SIGINT the SIGINT action struct to be passed down to run_non_builtin()
- * 
- * @return true if shell should continue running, false if the shell should stop running
+ * Set shell variables, or list them all
+ *
+ * @param args the arguments of the command: "set" followed by NAME=VALUE assignments
+ * @return the exit value: 0, or 1 if a name was not valid
  */
-bool exec_cmd(struct command *, int *, struct sigaction, struct background *);
+int smallsh_set(char **);
 
 /**
- * Change the current directory
- * 
- * @param  dir is the path (relative or absolute) to the directory to change to
- * 
- * @return always true
+ * Export shell variables to the commands the shell runs, or list the exported ones
+ *
+ * @param args the arguments of the command: "export" followed by NAME or NAME=VALUE
+ * @return the exit value: 0, or 1 if a name was not valid
  */
-bool smallsh_cd(char *);
+int smallsh_export(char **);
 
 /**
- * Change the current directory
- * 
- * @param  dir is the path (relative or absolute) to the directory to change to
- * 
- * @return always true
+ * Remove shell variables
+ *
+ * @param args the arguments of the command: "unset" followed by names
+ * @return the exit value: 0, or 1 if a name was not valid
  */
-bool smallsh_status(int);
+int smallsh_unset(char **);
+
+/**
+ * Find the absolute path of the executable for a command
+ *
+ * Names containing a '/' are returned unchanged. Other names are looked up in the
+ * resolved-executable cache, which is cleared when PATH changes; a cached path that
+ * is no longer executable is dropped and searched for again. On a miss each directory
+ * in PATH is checked in order and the result is cached.
+ *
+ * @param name the command name (first argument of the command)
+ * @return the path to execute, or NULL if no executable was found
+ */
+char *resolve_command(char *);
+
+/**
+ * Remove every entry from the resolved-executable cache
+ */
+void clear_path_cache(void);
+
+/**
+ * Look up a shell variable, importing the environment first if it hasn't been yet
+ *
+ * @param name the variable's name, which need not be NUL-terminated
+ * @param len the length of name
+ * @return the value, or NULL if the variable isn't set
+ */
+const char *var_get(const char *, size_t);
+
+/**
+ * Set a shell variable
+ *
+ * @param name the variable's name
+ * @param value the new value
+ * @param export true to also export it; a variable that already is stays exported
+ */
+void var_set(const char *, const char *, bool);
+
+/**
+ * Remove a shell variable
+ *
+ * @param name the variable's name
+ * @return false if it wasn't set
+ */
+bool var_unset(const char *);
+
+/**
+ * The environment for a new command: every exported variable as "NAME=VALUE"
+ *
+ * @return the NULL-terminated array, valid until the next change to a variable
+ */
+char **var_envp(void);
+
+/**
+ * Expand the variable references in a token: "$NAME", "${NAME}", "$$", "$?" and "$!"
+ *
+ * Unset variables expand to nothing. A '$' that starts no reference is kept.
+ *
+ * @param mem the arena to put the expanded token in
+ * @param token the token, NUL-terminated
+ * @param pid_str the shell's PID as text
+ * @return the expanded token
+ */
+char *expand_vars(struct arena *, const char *, const char *);
+
+/**
+ * Parse a list of CPUs such as "0-3,6"
+ *
+ * @param list the list: CPU numbers and ranges separated by commas
+ * @param set receives the CPUs
+ * @return false if the list is malformed or names no CPU
+ */
+bool parse_cpu_list(const char *, cpu_set_t *);
+
+/**
+ * Take the affinity, nice and ulimit prefixes off the front of a command
+ *
+ * "affinity CPUS", "nice [-n] [N]" and "ulimit -v|-t|-n VALUE..." only count as
+ * prefixes when a command follows them; on their own they are built-ins.
+ *
+ * @param mem the arena to put the command's launch_opts in
+ * @param cmd the command; its args are advanced past the prefixes
+ * @return 1 if prefixes were taken, 0 if there were none, -1 if one was invalid (already reported)
+ */
+int take_prefixes(struct arena *, struct command *);
+
+/**
+ * Show or set the CPUs the shell, and the background jobs it starts, run on
+ *
+ * @param args the arguments of the command: "affinity" [CPUS] or "affinity -b" [CPUS | all]
+ * @return the exit value: 0, 1 if the set could not be applied, or 2 for a usage error
+ */
+int smallsh_affinity(char **);
+
+/**
+ * Show the shell's niceness (with a command after it, "nice" is a prefix instead)
+ *
+ * @param args the arguments of the command: "nice"
+ * @return the exit value: 0, or 2 for a usage error
+ */
+int smallsh_nice(char **);
+
+/**
+ * Show or set the shell's soft resource limits, which every later command inherits
+ *
+ * @param args the arguments of the command: "ulimit" followed by -v, -t or -n, each with an optional value
+ * @return the exit value: 0, 1 if a limit could not be set, or 2 for a usage error
+ */
+int smallsh_ulimit(char **);
+
+/**
+ * Start every stage of a pipeline without waiting for them
+ *
+ * Adjacent stages are connected with pipes, and each stage is started with the
+ * launch strategy selected with -m (relay stages always fork). With job control
+ * on, a foreground pipeline is also handed the terminal.
+ *
+ * @param pl the pipeline to start
+ * @param sa_SIGINT the SIGINT action struct to be passed down to fork_command()
+ * @param pids receives the PID of each stage, or -1 for a stage that could not be started
+ * @param group whether to put the stages in a process group of their own (only done with job control on)
+ */
+void launch_pipeline(struct pipeline *, struct sigaction, pid_t *, bool);
 
 /**
  * Execute a non-built-in command
  * 
- * Create a new process and execute a command in the foreground or background.
- * If running in background and no i/o redirectoins are specified, redirect
+ * Create a new job and execute a command in the foreground or background,
+ * using the launch strategy selected with -m (posix_spawn by default).
+ * If running in background and no i/o redirections are specified, redirect
  * input and output both to /dev/null. If not running in background, set the
  * SIGINT action to its default and handle any i/o redirects. 
  * 
@@ -148,38 +1246,322 @@ bool smallsh_status(int);
  * @param sa_SIGINT the SIGINT action struct to be passed down to run_non_builtin()
  * @param bg the background struct holding information about the currently running background processes
  */
-void run_non_builtin(struct command *, int *, struct sigaction, struct background *);
+void run_non_builtin(struct pipeline *, int *, struct sigaction, struct background *);
+
+/**
+ * Launch a command with posix_spawn
+ *
+ * Redirect files (including the /dev/null defaults for background commands) are opened
+ * in the shell and handed to the child as dup2 file actions, and the SIGINT reset for
+ * foreground commands is done with POSIX_SPAWN_SETSIGDEF. There is no attribute for CPU
+ * affinity, so the shell runs on the command's CPU set just while spawning it, which the
+ * child inherits; commands with a niceness or limits are forked instead. Errors are
+ * reported here with the same messages the fork path prints from the child.
+ *
+ * @param cmd the command struct holding information about the command to launch
+ * @param pipeIn read end of the pipe from the previous stage, or -1
+ * @param pipeOut write end of the pipe to the next stage, or -1
+ * @param pgid process group to put the process in: 0 for a new one, -1 to stay in the shell's
+ * @return the PID of the new process, or -1 if the command could not be started
+ */
+pid_t spawn_command(struct command *, int, int, pid_t);
+
+/**
+ * Launch a command with fork, setting up redirects, signals, CPU set, niceness and limits in
+ * the child before execvp
+ *
+ * @param cmd the command struct holding information about the command to launch
+ * @param sa_SIGINT the SIGINT action struct, reset to its default in foreground children
+ * @param pipeIn read end of the pipe from the previous stage, or -1
+ * @param pipeOut write end of the pipe to the next stage, or -1
+ * @param pgid process group to put the process in: 0 for a new one, -1 to stay in the shell's
+ * @return the PID of the new process
+ */
+pid_t fork_command(struct command *, struct sigaction, int, int, pid_t);
+
+/**
+ * Determine whether a pipeline stage is run by relay_stage() instead of being executed
+ *
+ * Only in zero-copy mode (-z): a bare "cat", or "tee FILE" with a single file.
+ *
+ * @param cmd the stage to check
+ * @return true if the stage should be relayed by the shell
+ */
+bool is_relay_stage(struct command *);
+
+/**
+ * Run a zero-copy relay stage in a forked shell child; never returns
+ *
+ * "cat" splices stdin to stdout. "tee FILE" uses tee() to duplicate the input pipe's
+ * pages into the output pipe and splice() to move them into the file, so the bytes
+ * never pass through user space. Falls back to a read/write loop when neither end
+ * is a pipe or the output doesn't support splicing.
+ *
+ * @param cmd the stage to relay
+ */
+void relay_stage(struct command *);
 
 /**
- * Handle input and output file redirects
+ * Apply one redirect in a forked child
  * 
- * If direction is "in", redirect stdin to the specified file,
- * otherwise redirect stdout to the specified file
+ * Opens the file (appending for REDIR_APPEND) or duplicates the target descriptor
+ * onto the redirected one. On failure, prints an error and exits the child.
  * 
- * @param file the path to the file to redirect to
- * @param direction a string indicating whether the redirect is for input or output
+ * @param r the redirect
+ */
+void handle_redirect(struct redirect *);
+
+/**
+ * Turn on job control, if the shell is reading commands from its controlling terminal
+ *
+ * Waits until the shell is in the foreground, puts it in a process group of its own
+ * and takes the terminal, ignoring the signals background groups get for using it.
+ */
+void job_control_init(void);
+
+/**
+ * Set up background process tracking
+ *
+ * Blocks SIGCHLD in the shell (children get the old mask back) and opens a
+ * non-blocking signalfd for it, so child exits can be waited for with poll().
+ *
+ * @param bg the background struct to initialize
+ */
+void bg_init(struct background *);
+
+/**
+ * Find a PID among the running processes of every job
+ *
+ * @param bg the background struct to search
+ * @param pid the PID to look for
+ * @return its position in bg.pids, or -1 if it isn't a running process of a job
+ */
+int bg_find(struct background *, pid_t);
+
+/**
+ * Start tracking a process, growing the arrays as needed
+ *
+ * @param bg the background struct to add to
+ * @param pid the PID of the new process
+ * @param job the job it belongs to
+ */
+void bg_add(struct background *, pid_t, struct job *);
+
+/**
+ * Stop tracking a process in O(1): its slot is filled by the last PID
+ *
+ * @param bg the background struct to remove from
+ * @param pos the position of the PID in bg.pids
+ */
+void bg_remove(struct background *, int);
+
+/**
+ * Note that a child was just launched, so its resources can be accounted for once it is reaped
+ *
+ * @param pid the PID of the child
+ * @param name the command it runs
+ */
+void stats_start(pid_t, const char *);
+
+/**
+ * Wait for a child like waitpid(), recording its wall time and resource usage if it finished
+ *
+ * Every child the shell reaps goes through here, using wait4() to collect its rusage.
+ *
+ * @param pid the PID to wait for, or -1 for any child
+ * @param status receives the status of the child
+ * @param options options for wait4(), such as WNOHANG
+ * @return the PID reaped, 0 if WNOHANG was given and none was ready, or -1 on error
+ */
+pid_t reap_child(pid_t, int *, int);
+
+/**
+ * Create a job for a pipeline that was just launched, numbering it with the lowest free job number
+ *
+ * @param bg the background struct to add the job to
+ * @param pl the pipeline, whose command line becomes the job's text
+ * @param pids the PID of each stage, -1 for those that could not be started
+ * @param grouped whether the stages were put in a process group of their own
+ * @return the new job, which becomes the current job
+ */
+struct job *job_new(struct background *, struct pipeline *, pid_t *, bool);
+
+/**
+ * Look up a job by spec: %n, %+, %% or % (the current job), or the PID of one of its processes
+ *
+ * @param bg the background struct holding information about the jobs
+ * @param spec the job spec, or NULL for the current job
+ * @return the job, or NULL if there is no such job
+ */
+struct job *job_find(struct background *, const char *);
+
+/**
+ * Record a state change reported by waitpid() in the job the process belongs to
+ *
+ * @param bg the background struct holding information about the jobs
+ * @param pid the PID returned by waitpid()
+ * @param status the status returned by waitpid()
+ * @return the job, or NULL if pid doesn't belong to one
  */
-void handle_redirect(char *, const char *);
+struct job *job_update(struct background *, pid_t, int);
+
+/**
+ * Stop tracking a job and free it
+ *
+ * @param bg the background struct holding information about the jobs
+ * @param job the job to remove; any processes it still has are forgotten
+ */
+void job_remove(struct background *, struct job *);
+
+/**
+ * Wait for a job in the foreground until it finishes or is stopped
+ *
+ * With job control on, the job is given the terminal (with the terminal modes it
+ * was stopped with) and the shell takes it back afterwards. Processes of other jobs
+ * that change state meanwhile are recorded and reported at the next census.
+ *
+ * @param bg the background struct holding information about the jobs
+ * @param job the job to wait for; it is removed once it finishes
+ * @param lastExit receives the status of the job's last stage, or 128 + the stop signal
+ */
+void job_foreground(struct background *, struct job *, int *);
+
+/**
+ * Report background jobs that have finished or stopped since they were last reported
+ *
+ * Finished jobs are removed once reported.
+ *
+ * @param bg the background struct holding information about the jobs
+ */
+void job_report(struct background *);
 
 /**
  * Check on and clean up background processes
  * 
- * @param  bg the background struct holding information about the processes currently running in the background
- * @param  lastExit the exit value or terminating signal of the last process
+ * Returns straight away unless the signalfd says a child has changed state since the
+ * last census. Otherwise records every change and reports the background jobs affected.
  * 
- * @return a new background struct with information about the still-running background processess
+ * @param  bg the background struct holding information about the processes currently running in the background
+ */
+void run_bg_census(struct background *);
+
+/**
+ * Wait for the user to type something, reporting background processes that finish meanwhile
+ *
+ * Only used when stdin is a terminal, which hands over at most one line per read,
+ * so nothing is left waiting in the stdio buffer when this polls.
+ *
+ * @param bg the background struct holding information about the processes currently running in the background
+ */
+void wait_for_input(struct background *);
+
+/**
+ * Run as a daemon: serve commands from clients of a Unix socket until the shell is killed
+ *
+ * Any number of clients can connect at once. Each line a client sends is run like a
+ * background command line through the usual launch paths, so one census reaps every
+ * child; at most max_running run at once, taking a line from each client in turn.
+ * A finished command's status is sent to its client. Lines are only read from a
+ * client while it has none waiting, so a busy daemon pushes back on its clients.
+ * Built-ins run in the daemon itself and affect every client.
+ *
+ * @param path where to create the socket; a stale socket left there is replaced
+ * @param max_running the concurrency cap, or 0 for one command per CPU
+ * @param sa_SIGINT the SIGINT action struct to be passed down to launch_pipeline()
+ * @param bg the background struct the commands are tracked in as jobs
+ * @return the exit status for the shell: EXIT_FAILURE if the socket could not be created or polled
+ */
+int run_server(const char *, long, struct sigaction, struct background *);
+
+/**
+ * Send a finished job's status to the client that submitted it
+ *
+ * @param job the job, which must have a client
  */
-struct background run_bg_census(struct background, int);
+void server_job_done(struct job *);
 
 /**
- * Kill all background processes stored in bg
+ * Stop all background jobs stored in bg
  * 
- * This function is intended to be run as smallsh is exiting. bg should contain all of the PIDs of the processes that 
- * were running in the background after the last command was run. This function walks through all of those PIDs,
- * killing any that are still running (sends SIGKILL).
+ * This function is intended to be run as smallsh is exiting. bg contains all of the jobs that 
+ * are still running or stopped. Every one of them (its process group, with job control) is
+ * sent SIGTERM at once, and continued if stopped; they are then reaped together until none
+ * is left or shutdown_grace seconds have passed, and whatever is left gets SIGKILL and is
+ * reaped too. How each job ended is reported, followed by a summary line. With a grace
+ * period of 0, SIGKILL is sent straight away.
  * 
- * @param bg the background struct containing information about all processes running in the background after the last command executed
+ * @param bg the background struct containing information about all jobs
+ */
+void kill_zombies(struct background *);
+
+/**
+ * Turn on output capture for background jobs
+ *
+ * @param spec the argument of -o: the per-job cap and optionally the total cap, e.g. "64k" or "64k,8m"
+ * @return false if spec isn't valid
+ */
+bool capture_configure(const char *);
+
+/**
+ * Create a log and the pipe that feeds it, for a background job about to be launched
+ *
+ * @param writeFd receives the write end of the pipe, to hand to the job's processes
+ * @return the new log
+ */
+struct job_log *capture_start(int *);
+
+/**
+ * Move whatever is waiting in a log's pipe into its ring buffer, without blocking
+ *
+ * @param log the log to fill; its pipe is closed once every writer has closed it
+ */
+void capture_drain(struct job_log *);
+
+/**
+ * Wait for a child like reap_child(-1, ...), capturing job output while no child is ready
+ *
+ * Without open logs this is a plain blocking wait. Otherwise the signalfd and the
+ * log pipes are polled, so background jobs never block on a full pipe while the
+ * shell waits for something else.
+ *
+ * @param bg the background struct holding the signalfd
+ * @param status receives the status of the child
+ * @param options options for wait4(), such as WUNTRACED
+ * @return the PID reaped, or -1 on error
+ */
+pid_t wait_child(struct background *, int *, int);
+
+/**
+ * Start writing trace events to a file
+ *
+ * @param path the file to write, truncated if it exists
+ * @return true if the file could be opened
+ */
+bool trace_open(const char *);
+
+/**
+ * Read the clock trace events are timed with
+ *
+ * @return nanoseconds on the monotonic clock, or 0 when tracing is off
+ */
+long long trace_now(void);
+
+/**
+ * Record a phase that started at start and ends now
+ *
+ * Does nothing when tracing is off.
+ *
+ * @param name the name of the phase, e.g. "parse"
+ * @param cat the category of the phase, e.g. "shell" or "job"
+ * @param start when the phase started, from trace_now()
+ * @param tid the track to show the phase on: the shell's PID or a child's
+ * @param detail extra text shown with the event, or NULL
+ */
+void trace_event(const char *, const char *, long long, pid_t, const char *);
+
+/**
+ * Write out every buffered trace event
  */
-void kill_zombies(struct background bg);
+void trace_flush(void);
 
 #endif
\ No newline at end of file